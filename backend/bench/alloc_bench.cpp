@@ -0,0 +1,145 @@
+/**
+ * @file alloc_bench.cpp
+ * @brief Count the heap allocations per message on the hot paths of the
+ * server.
+ * @details Replace the global operator new with a counting one, warm up every
+ * path, then report the allocations and the time per message in the steady
+ * state.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-18
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#include "frame.h"
+#include "message.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <fmt/core.h>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace {
+
+/**
+ * @brief The number of heap allocations so far.
+ */
+std::atomic<std::uint64_t> allocations{0};
+
+/**
+ * @brief The number of iterations before measuring.
+ */
+constexpr std::size_t warmup = 10000;
+/**
+ * @brief The number of sessions a relayed frame is queued for.
+ */
+constexpr std::size_t recipients = 8;
+
+/**
+ * @brief Run a step in a loop, and print its allocations and time per
+ * iteration.
+ *
+ * @param name The name of the step.
+ * @param iterations The number of measured iterations.
+ * @param step The step, called once per message.
+ */
+template <typename Step>
+void measure(const char *name, std::size_t iterations, Step &&step) {
+    for (std::size_t i = 0; i < warmup; ++i) {
+        step();
+    }
+
+    auto const before = allocations.load(std::memory_order_relaxed);
+    auto const start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iterations; ++i) {
+        step();
+    }
+    auto const elapsed = std::chrono::steady_clock::now() - start;
+    auto const count = allocations.load(std::memory_order_relaxed) - before;
+
+    fmt::print("{:<28} {:>10.4f} allocations/message {:>10.1f} ns/message\n",
+               name, static_cast<double>(count) / iterations,
+               static_cast<double>(
+                   std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+                       .count()) /
+                   iterations);
+}
+
+} // namespace
+
+void *operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *memory = std::malloc(size == 0 ? 1 : size)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t /*size*/) noexcept {
+    std::free(memory);
+}
+
+/**
+ * @brief Benchmark entry point.
+ *
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments: the number of iterations, one
+ * million by default.
+ * @return int The exit code.
+ */
+int main(int argc, char **argv) {
+    auto const iterations =
+        argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000ULL;
+    if (iterations == 0) {
+        fmt::print(stderr, "Usage: {} [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::string const chat =
+        R"({"type":"message","sender":"alice","text":"hello, world"})";
+    std::string const join = R"({"type":"join","room":"lobby"})";
+    std::string room;
+
+    measure("chat fast path", iterations, [&] {
+        room.clear();
+        if (!Message::is_chat_frame(chat, room)) {
+            std::abort();
+        }
+    });
+
+    measure("control message", iterations, [&] {
+        Message const message(join);
+        if (!message.is_join_request() || message.get_room().empty()) {
+            std::abort();
+        }
+    });
+
+    // Validate, build the shared frame once, and queue it for every session
+    std::vector<std::deque<std::shared_ptr<const Frame>>> queues(recipients);
+    measure("relay to 8 sessions", iterations, [&] {
+        if (!Message::is_chat_frame(chat, room)) {
+            std::abort();
+        }
+        auto const frame = std::make_shared<const Frame>(chat);
+        for (auto &queue : queues) {
+            queue.push_back(frame);
+        }
+        for (auto &queue : queues) {
+            queue.pop_front();
+        }
+    });
+
+    return EXIT_SUCCESS;
+}
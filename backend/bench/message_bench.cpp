@@ -0,0 +1,257 @@
+/**
+ * @file message_bench.cpp
+ * @brief Microbenchmarks of the Message codec and of the State fan-out.
+ * @details The fan-out benchmarks use sessions without a socket. They run
+ * the coroutine engine, whose writer is never started, so a delivered frame
+ * is only queued, and they keep one queued frame, so the queues stay small
+ * whatever the number of iterations.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-19
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#include "config.h"
+#include "frame.h"
+#include "message.h"
+#include "session.h"
+#include "session_pool.h"
+#include "state.h"
+
+#include <benchmark/benchmark.h>
+#include <fmt/core.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace {
+
+const std::string login = R"({"type":"login","username":"alice"})";
+const std::string chat =
+    R"({"type":"message","sender":"alice","text":"hello, world"})";
+const std::string join = R"({"type":"join","room":"lobby"})";
+
+/**
+ * @brief The number of posted deliveries after which the fan-out benchmarks
+ * run the handlers, to bound the memory they hold.
+ */
+constexpr std::size_t max_posted = 1 << 20;
+
+/**
+ * @brief A state and its sessions, without sockets.
+ */
+class Fanout {
+  public:
+    /**
+     * @brief Construct a new Fanout object.
+     * @details Join the sessions one by one, as clients do.
+     *
+     * @param sessions The number of sessions.
+     */
+    explicit Fanout(std::size_t sessions)
+        : work_(asio::make_work_guard(ioc_)), state_(make_state()) {
+        sessions_.reserve(sessions);
+        for (std::size_t i = 0; i < sessions; ++i) {
+            sessions_.push_back(make_session(i));
+            boost::ignore_unused(state_->join(sessions_.back()));
+        }
+    }
+
+    /**
+     * @brief Get the fan-out of a number of sessions.
+     * @details Joining is quadratic, so every size is built once and shared
+     * by the benchmarks. This method is thread-safe.
+     *
+     * @param sessions The number of sessions.
+     * @return Fanout& The fan-out.
+     */
+    static Fanout &get(std::size_t sessions) {
+        // The sessions give their buffer back to the pool when the fan-outs
+        // are destroyed, so the pool must be made first
+        session_pool();
+        static std::mutex mutex;
+        static std::map<std::size_t, std::unique_ptr<Fanout>> fanouts;
+        std::lock_guard<std::mutex> const lock(mutex);
+        auto &fanout = fanouts[sessions];
+        if (!fanout) {
+            fanout = std::make_unique<Fanout>(sessions);
+        }
+        return *fanout;
+    }
+
+    /**
+     * @brief Make a session that is not joined yet.
+     *
+     * @param id The number of the session.
+     * @return SessionInfo The session.
+     */
+    SessionInfo make_session(std::size_t id) {
+        return {std::make_shared<Session>(tcp::socket(ioc_), state_),
+                std::make_shared<const std::string>(
+                    fmt::format("user{}", id))};
+    }
+
+    /**
+     * @brief Get the state.
+     *
+     * @return State& The state.
+     */
+    State &state() {
+        return *state_;
+    }
+
+    /**
+     * @brief Run the deliveries posted so far.
+     * @details Thread-safe, like io_context::poll().
+     */
+    void drain() {
+        while (ioc_.poll() != 0) {
+        }
+    }
+
+  private:
+    /**
+     * @brief Make a state whose sessions only keep one queued frame.
+     *
+     * @return std::shared_ptr<State> The state.
+     */
+    static std::shared_ptr<State> make_state() {
+        auto config = std::make_shared<Config>();
+        config->engine = Engine::coroutine;
+        config->slow_consumer = SlowConsumerPolicy::drop_newest;
+        config->queue_max_messages = 1;
+        return std::make_shared<State>(std::move(config));
+    }
+
+    /**
+     * @brief The io_context of the sessions. It is only polled.
+     */
+    asio::io_context ioc_;
+    /**
+     * @brief Keep the io_context from stopping when it runs out of handlers.
+     */
+    asio::executor_work_guard<asio::io_context::executor_type> work_;
+    /**
+     * @brief The state.
+     */
+    std::shared_ptr<State> state_;
+    /**
+     * @brief The joined sessions.
+     */
+    std::vector<SessionInfo> sessions_;
+};
+
+void BM_MessageParse(benchmark::State &state, const std::string &text) {
+    for (auto _ : state) {
+        Message const message(text);
+        benchmark::DoNotOptimize(&message);
+    }
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations()) *
+                            static_cast<std::int64_t>(text.size()));
+}
+BENCHMARK_CAPTURE(BM_MessageParse, login, login);
+BENCHMARK_CAPTURE(BM_MessageParse, chat, chat);
+BENCHMARK_CAPTURE(BM_MessageParse, join, join);
+
+void BM_MessageStringify(benchmark::State &state) {
+    Message const message(chat);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(message.stringify());
+    }
+}
+BENCHMARK(BM_MessageStringify);
+
+void BM_IsLoginInfo(benchmark::State &state) {
+    Message const message(login);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(message.is_login_info());
+    }
+}
+BENCHMARK(BM_IsLoginInfo);
+
+void BM_IsChatMessage(benchmark::State &state) {
+    Message const message(chat);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(message.is_chat_message());
+    }
+}
+BENCHMARK(BM_IsChatMessage);
+
+void BM_IsChatFrame(benchmark::State &state) {
+    std::string room;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Message::is_chat_frame(chat, room));
+    }
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations()) *
+                            static_cast<std::int64_t>(chat.size()));
+}
+BENCHMARK(BM_IsChatFrame)->ThreadRange(1, 8);
+
+void BM_ToCbor(benchmark::State &state) {
+    std::string cbor;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Message::to_cbor(chat, cbor));
+    }
+}
+BENCHMARK(BM_ToCbor);
+
+void BM_FromCbor(benchmark::State &state) {
+    std::string cbor;
+    std::string json;
+    if (!Message::to_cbor(chat, cbor)) {
+        state.SkipWithError("to_cbor failed");
+        return;
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Message::from_cbor(cbor, json));
+    }
+}
+BENCHMARK(BM_FromCbor);
+
+void BM_SendToAll(benchmark::State &state) {
+    auto &fanout = Fanout::get(static_cast<std::size_t>(state.range(0)));
+    auto const frame = std::make_shared<const Frame>(chat);
+    std::size_t posted = 0;
+    for (auto _ : state) {
+        fanout.state().send_to_all(frame);
+        posted += static_cast<std::size_t>(state.range(0));
+        if (posted >= max_posted) {
+            state.PauseTiming();
+            fanout.drain();
+            posted = 0;
+            state.ResumeTiming();
+        }
+    }
+    fanout.drain();
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()) *
+                            state.range(0));
+}
+BENCHMARK(BM_SendToAll)
+    ->RangeMultiplier(10)
+    ->Range(10, 100000)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+void BM_JoinLeave(benchmark::State &state) {
+    auto &fanout = Fanout::get(static_cast<std::size_t>(state.range(0)));
+    auto const session =
+        fanout.make_session(static_cast<std::size_t>(state.range(0)) +
+                            static_cast<std::size_t>(state.thread_index()));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(fanout.state().join(session));
+        fanout.state().leave(session);
+    }
+}
+BENCHMARK(BM_JoinLeave)
+    ->RangeMultiplier(10)
+    ->Range(10, 100000)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+} // namespace
+
+BENCHMARK_MAIN();
@@ -11,9 +11,21 @@
  */
 
 #include "base.h"
+#include "metrics.h"
 #include <fmt/core.h>
 
 void fail(beast::error_code ec, char const *what) {
+    bump(metrics().errors);
     fmt::print(stderr, "Error: {} - {}\n", what, ec.message());
 }
 
+void report_on(asio::signal_set &signals) {
+    signals.async_wait([&signals](beast::error_code ec, int /*signal*/) {
+        if (ec) {
+            return;
+        }
+        Metrics::report_stages();
+        Metrics::report_memory();
+        report_on(signals);
+    });
+}
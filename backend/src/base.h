@@ -12,7 +12,11 @@
 
 #pragma once
 
+// Boost 1.74 uses std::exchange in awaitable.hpp without including <utility>
+#include <utility>
+
 #include <boost/asio/io_context.hpp>
+#include <boost/asio/signal_set.hpp>
 #include <boost/asio/spawn.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
@@ -31,4 +35,14 @@ using tcp = boost::asio::ip::tcp;
  * @param ec Error code.
  * @param what Error message.
  */
-void fail(beast::error_code ec, char const *what);
\ No newline at end of file
+void fail(beast::error_code ec, char const *what);
+
+/**
+ * @brief Print the stage latencies and the memory per connection every time a
+ * signal is received.
+ * @see Metrics::report_stages
+ * @see Metrics::report_memory
+ *
+ * @param signals The signals, usually SIGUSR1. They must outlive the waits.
+ */
+void report_on(asio::signal_set &signals);
@@ -0,0 +1,270 @@
+/**
+ * @file config.cpp
+ * @brief Config struct implementation.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-14
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <string_view>
+
+namespace {
+
+/**
+ * @brief Get the value of an option of the form --name=value.
+ *
+ * @param option The command line argument.
+ * @param name The option name, with its leading dashes.
+ * @return std::optional<std::string_view> The value, or nothing if the
+ * argument is another option.
+ */
+std::optional<std::string_view> option_value(std::string_view option,
+                                             std::string_view name) {
+    if (option.size() <= name.size() || option.substr(0, name.size()) != name ||
+        option[name.size()] != '=') {
+        return std::nullopt;
+    }
+    return option.substr(name.size() + 1);
+}
+
+/**
+ * @brief Parse a positive number.
+ *
+ * @param text The text to parse.
+ * @param value Receive the number.
+ * @return true The text is a positive number.
+ * @return false The text is not a positive number.
+ */
+template <typename T> bool parse_number(std::string_view text, T &value) {
+    T number{};
+    auto const [end, ec] =
+        std::from_chars(text.data(), text.data() + text.size(), number);
+    if (ec != std::errc() || end != text.data() + text.size() || number <= 0) {
+        return false;
+    }
+    value = number;
+    return true;
+}
+
+/**
+ * @brief Parse a slow consumer policy.
+ *
+ * @param text The policy name.
+ * @param policy Receive the policy.
+ * @return true The name is a known policy.
+ * @return false The name is unknown.
+ */
+bool parse_policy(std::string_view text, SlowConsumerPolicy &policy) {
+    if (text == "drop-oldest") {
+        policy = SlowConsumerPolicy::drop_oldest;
+    } else if (text == "drop-newest") {
+        policy = SlowConsumerPolicy::drop_newest;
+    } else if (text == "coalesce") {
+        policy = SlowConsumerPolicy::coalesce;
+    } else if (text == "disconnect") {
+        policy = SlowConsumerPolicy::disconnect;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+std::optional<Config> Config::parse(int argc, char **argv) {
+    if (argc < 4) {
+        return std::nullopt;
+    }
+
+    Config config;
+    boost::system::error_code ec;
+    config.address = asio::ip::make_address(argv[1], ec);
+    if (ec) {
+        return std::nullopt;
+    }
+    config.port = static_cast<std::uint16_t>(std::atoi(argv[2]));
+    config.threads = std::max<int>(1, std::atoi(argv[3]));
+
+    for (int i = 4; i < argc; ++i) {
+        std::string_view const option(argv[i]);
+        bool valid = true;
+        if (auto const value = option_value(option, "--queue-max-messages")) {
+            valid = parse_number(*value, config.queue_max_messages);
+        } else if (auto const value =
+                       option_value(option, "--queue-max-bytes")) {
+            valid = parse_number(*value, config.queue_max_bytes);
+        } else if (auto const value = option_value(option, "--slow-consumer")) {
+            valid = parse_policy(*value, config.slow_consumer);
+        } else if (auto const value =
+                       option_value(option, "--slow-consumer-grace")) {
+            std::chrono::seconds::rep seconds = 0;
+            valid = parse_number(*value, seconds);
+            config.slow_consumer_grace = std::chrono::seconds(seconds);
+        } else if (auto const value = option_value(option, "--idle-after")) {
+            std::chrono::seconds::rep seconds = 0;
+            valid = parse_number(*value, seconds);
+            config.idle_after = std::chrono::seconds(seconds);
+        } else if (auto const value = option_value(option, "--timer-tick-ms")) {
+            std::chrono::milliseconds::rep milliseconds = 0;
+            valid = parse_number(*value, milliseconds) && milliseconds > 0;
+            config.timer_tick = std::chrono::milliseconds(milliseconds);
+        } else if (auto const value = option_value(option, "--rate-limit")) {
+            valid = parse_number(*value, config.rate_limit);
+        } else if (auto const value = option_value(option, "--rate-burst")) {
+            valid = parse_number(*value, config.rate_burst);
+        } else if (auto const value = option_value(option, "--ip-rate-limit")) {
+            valid = parse_number(*value, config.ip_rate_limit);
+        } else if (auto const value = option_value(option, "--ip-rate-burst")) {
+            valid = parse_number(*value, config.ip_rate_burst);
+        } else if (auto const value =
+                       option_value(option, "--presence-interval-ms")) {
+            std::chrono::milliseconds::rep milliseconds = 0;
+            valid = parse_number(*value, milliseconds);
+            config.presence_interval = std::chrono::milliseconds(milliseconds);
+        } else if (option == "--batch-writes") {
+            config.batch_writes = true;
+        } else if (option == "--tcp-cork") {
+            config.tcp_cork = true;
+        } else if (option == "--deflate") {
+            config.deflate = true;
+        } else if (auto const value =
+                       option_value(option, "--deflate-min-size")) {
+            valid = parse_number(*value, config.deflate_min_size);
+        } else if (auto const value = option_value(option, "--history")) {
+            valid = parse_number(*value, config.history_size);
+        } else if (option == "--no-history") {
+            config.history_size = 0;
+        } else if (auto const value = option_value(option, "--log-dir")) {
+            config.log_dir = std::string(*value);
+            valid = !config.log_dir.empty();
+        } else if (auto const value =
+                       option_value(option, "--log-segment-size")) {
+            valid = parse_number(*value, config.log_segment_size);
+        } else if (auto const value = option_value(option, "--log-sync-ms")) {
+            std::chrono::milliseconds::rep milliseconds = 0;
+            valid = parse_number(*value, milliseconds);
+            config.log_sync_interval = std::chrono::milliseconds(milliseconds);
+        } else if (auto const value = option_value(option, "--pool-size")) {
+            valid = parse_number(*value, config.pool_size);
+        } else if (option == "--no-pool") {
+            config.pool_size = 0;
+        } else if (auto const value =
+                       option_value(option, "--pool-buffer-capacity")) {
+            valid = parse_number(*value, config.pool_buffer_capacity);
+        } else if (auto const value = option_value(option, "--metrics-path")) {
+            config.metrics_path = std::string(*value);
+            valid = config.metrics_path.size() > 1 &&
+                    config.metrics_path.front() == '/';
+        } else if (option == "--no-metrics") {
+            config.metrics_path.clear();
+        } else if (auto const value = option_value(option, "--acceptors")) {
+            valid = parse_number(*value, config.acceptors);
+        } else if (auto const value =
+                       option_value(option, "--accepts-in-flight")) {
+            valid = parse_number(*value, config.accepts_in_flight);
+        } else if (option == "--trace") {
+            config.trace = true;
+        } else if (option == "--shards") {
+            config.sharded = true;
+        } else if (option == "--engine=callback") {
+            config.engine = Engine::callback;
+#ifdef MESSAGE_COROUTINE_ENGINE
+        } else if (option == "--engine=coroutine") {
+            config.engine = Engine::coroutine;
+#endif
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            return std::nullopt;
+        }
+    }
+
+    // Corking only pays off when a write holds a batch of frames
+    if (config.tcp_cork && !config.batch_writes) {
+        return std::nullopt;
+    }
+
+    return config;
+}
+
+void Config::print_usage(char const *program) {
+    fmt::print(stderr, "Usage: {} <address> <port> <threads> [options]\n",
+               program);
+    fmt::print(stderr,
+               "Options:\n"
+               "  --shards                   one io_context, acceptor and "
+               "state per thread\n"
+               "  --engine=<engine>          callback (default) or "
+               "coroutine\n"
+               "  --acceptors=<n>            SO_REUSEPORT acceptors, each "
+               "on its own thread\n"
+               "                             (default 1, ignored with "
+               "--shards)\n"
+               "  --accepts-in-flight=<n>    accepts in flight per acceptor "
+               "(default 1)\n"
+               "  --queue-max-messages=<n>   frames queued per session "
+               "(default 1024)\n"
+               "  --queue-max-bytes=<n>      bytes queued per session "
+               "(default 4194304)\n"
+               "  --slow-consumer=<policy>   drop-oldest (default), "
+               "drop-newest, coalesce\n"
+               "                             or disconnect\n"
+               "  --slow-consumer-grace=<s>  seconds over the limits before "
+               "disconnecting\n"
+               "                             (default 5)\n"
+               "  --batch-writes             write all queued frames with one "
+               "gather write\n"
+               "  --tcp-cork                 cork the socket during a batch "
+               "write\n"
+               "                             (needs --batch-writes)\n"
+               "  --deflate                  offer permessage-deflate, "
+               "compress broadcasts once\n"
+               "  --deflate-min-size=<n>     smallest payload to compress "
+               "(default 256)\n"
+               "  --history=<n>              chat messages replayed on login "
+               "and join (default 32)\n"
+               "  --no-history               keep no chat history\n"
+               "  --log-dir=<path>           log chat messages to segments "
+               "in path\n"
+               "  --log-segment-size=<n>     bytes per log segment (default "
+               "67108864)\n"
+               "  --log-sync-ms=<ms>         time between two log commits "
+               "(default 10)\n"
+               "  --pool-size=<n>            closed sessions kept for reuse "
+               "(default 1024)\n"
+               "  --no-pool                  keep no closed sessions\n"
+               "  --pool-buffer-capacity=<n> largest read buffer kept "
+               "(default 65536)\n"
+               "  --idle-after=<s>           seconds of silence before a "
+               "session goes idle\n"
+               "                             and frees its buffers (default "
+               "0, never)\n"
+               "  --timer-tick-ms=<ms>       resolution of the session timers "
+               "(default 100)\n"
+               "  --rate-limit=<n>           messages per second per session "
+               "(default 0, none)\n"
+               "  --rate-burst=<n>           messages at once per session "
+               "(default 32)\n"
+               "  --ip-rate-limit=<n>        messages per second per client "
+               "address (default 0)\n"
+               "  --ip-rate-burst=<n>        messages at once per client "
+               "address (default 256)\n"
+               "  --presence-interval-ms=<ms>\n"
+               "                             time between two presence deltas "
+               "(default 1000)\n"
+               "  --metrics-path=<path>      serve Prometheus metrics on "
+               "path (default /metrics)\n"
+               "  --no-metrics               do not serve metrics\n"
+               "  --trace                    record the stage latencies of "
+               "chat messages\n");
+}
@@ -0,0 +1,253 @@
+/**
+ * @file config.h
+ * @brief Config struct definition. Config holds the command line settings of
+ * the server.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-14
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#pragma once
+
+#include "base.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+/**
+ * @brief The engine that drives the sessions.
+ */
+enum class Engine {
+    /**
+     * @brief Chained completion handlers.
+     */
+    callback,
+    /**
+     * @brief C++20 coroutines, only available when the server is built with
+     * MESSAGE_COROUTINE_ENGINE.
+     */
+    coroutine,
+};
+
+/**
+ * @brief What a session does when its outbound queue is over its limits.
+ */
+enum class SlowConsumerPolicy {
+    /**
+     * @brief Drop the oldest queued frames that are not being written.
+     */
+    drop_oldest,
+    /**
+     * @brief Drop the incoming frame.
+     */
+    drop_newest,
+    /**
+     * @brief Replace queued frames that have the same key as the incoming
+     * frame, then drop the oldest frames if that is not enough.
+     * @see Frame::key
+     */
+    coalesce,
+    /**
+     * @brief Drop the incoming frames, and close the connection if the queue
+     * is still over its limits after the grace period.
+     */
+    disconnect,
+};
+
+/**
+ * @brief Config struct, the command line settings of the server.
+ * @details The first three arguments are positional: address, port and
+ * number of threads. They can be followed by options of the form --name or
+ * --name=value.
+ */
+struct Config {
+    /**
+     * @brief The address to listen on.
+     */
+    asio::ip::address address;
+    /**
+     * @brief The port to listen on.
+     */
+    std::uint16_t port = 0;
+    /**
+     * @brief The number of io threads.
+     */
+    int threads = 1;
+    /**
+     * @brief Whether to run one shard per thread.
+     * @details When set, every thread owns its own io_context, acceptor and
+     * state, and broadcasts are relayed between shards.
+     * @see ShardGroup
+     */
+    bool sharded = false;
+    /**
+     * @brief The engine that drives the sessions.
+     */
+    Engine engine = Engine::callback;
+    /**
+     * @brief The maximum number of frames queued for one session.
+     */
+    std::size_t queue_max_messages = 1024;
+    /**
+     * @brief The maximum number of bytes queued for one session.
+     */
+    std::size_t queue_max_bytes = 4 * 1024 * 1024;
+    /**
+     * @brief What a session does when its queue is over its limits.
+     */
+    SlowConsumerPolicy slow_consumer = SlowConsumerPolicy::drop_oldest;
+    /**
+     * @brief How long a session may stay over its limits under the disconnect
+     * policy.
+     */
+    std::chrono::seconds slow_consumer_grace{5};
+    /**
+     * @brief Whether to write all the queued frames with one gather write.
+     * @details The frames are written below Beast, as consecutive WebSocket
+     * frames, instead of one Beast write per frame. The control frames
+     * written by Beast, keep-alive pings included, are kept out of the
+     * batches.
+     * @see GatedStream
+     */
+    bool batch_writes = false;
+    /**
+     * @brief Whether to cork the socket while a batch is written.
+     * @details Only valid with batch_writes, and only used on platforms that
+     * have TCP_CORK. Config::parse() rejects it alone.
+     */
+    bool tcp_cork = false;
+    /**
+     * @brief Whether to offer permessage-deflate.
+     * @details A broadcast frame is compressed once and the same bytes are
+     * written to every session that negotiated the extension. They are
+     * written below Beast, through the same write gate as the batches, one
+     * frame at a time unless batch_writes is set.
+     */
+    bool deflate = false;
+    /**
+     * @brief The smallest payload worth compressing, in bytes.
+     */
+    std::size_t deflate_min_size = 256;
+    /**
+     * @brief The number of recent chat messages replayed to a session when it
+     * logs in or joins a room.
+     */
+    std::size_t history_size = 32;
+    /**
+     * @brief The directory of the message log.
+     * @details Empty if chat messages are not logged.
+     * @see MessageLog
+     */
+    std::string log_dir;
+    /**
+     * @brief The size of a log segment before a new one is started, in bytes.
+     */
+    std::uint64_t log_segment_size = 64 * 1024 * 1024;
+    /**
+     * @brief The time between two group commits of the log.
+     */
+    std::chrono::milliseconds log_sync_interval{10};
+    /**
+     * @brief The number of session slots, and of read buffers, kept for the
+     * next connections.
+     * @see SessionPool
+     */
+    std::size_t pool_size = 1024;
+    /**
+     * @brief The largest read buffer kept for the next connections, in bytes.
+     */
+    std::size_t pool_buffer_capacity = 64 * 1024;
+    /**
+     * @brief How long a logged in client may stay silent before its session
+     * goes idle.
+     * @details An idle session gives its read buffer back to the pool and
+     * frees its scratch state, and waits for the next message with a small
+     * read into the session itself. Zero disables the idle mode.
+     * @see Session::go_idle
+     */
+    std::chrono::seconds idle_after{0};
+    /**
+     * @brief The duration of a slot of the timer wheels.
+     * @details The deadlines, keep-alive pings and grace periods of the
+     * sessions fire at most one tick late.
+     * @see TimerWheel
+     */
+    std::chrono::milliseconds timer_tick{100};
+    /**
+     * @brief The messages per second a session may send, sustained.
+     * @details A session over its rate stops reading until it is back within
+     * it, so TCP pushes back on the client. Zero disables the limit.
+     * @see RateLimiter
+     */
+    std::size_t rate_limit = 0;
+    /**
+     * @brief The messages a session may send at once.
+     */
+    std::size_t rate_burst = 32;
+    /**
+     * @brief The messages per second all the sessions of a client address
+     * may send, sustained.
+     * @details Zero disables the limit.
+     */
+    std::size_t ip_rate_limit = 0;
+    /**
+     * @brief The messages all the sessions of a client address may send at
+     * once.
+     */
+    std::size_t ip_rate_burst = 256;
+    /**
+     * @brief The time between two presence deltas.
+     * @details The joins and leaves of an interval are sent to everyone as
+     * one delta.
+     * @see Presence
+     */
+    std::chrono::milliseconds presence_interval{1000};
+    /**
+     * @brief The path of the metrics, served over plain HTTP on the
+     * WebSocket port.
+     * @details Empty if the metrics are not served.
+     * @see Metrics::scrape
+     */
+    std::string metrics_path = "/metrics";
+    /**
+     * @brief Whether chat messages are traced.
+     * @details A traced message is stamped when it is read, and the time of
+     * every stage is recorded per recipient.
+     * @see Stage
+     */
+    bool trace = false;
+    /**
+     * @brief The number of acceptors, without shards.
+     * @details With more than one, every acceptor is bound with SO_REUSEPORT
+     * and runs on its own io_context and thread, and the kernel spreads the
+     * new connections between them. The sessions still run on the shared
+     * io_context.
+     */
+    std::size_t acceptors = 1;
+    /**
+     * @brief The number of accepts in flight on every acceptor.
+     */
+    std::size_t accepts_in_flight = 1;
+
+    /**
+     * @brief Parse the command line.
+     *
+     * @param argc The number of command line arguments.
+     * @param argv The command line arguments.
+     * @return std::optional<Config> The settings, or nothing if the command
+     * line is invalid.
+     */
+    static std::optional<Config> parse(int argc, char **argv);
+    /**
+     * @brief Print the usage message to stderr.
+     *
+     * @param program The program name.
+     */
+    static void print_usage(char const *program);
+};
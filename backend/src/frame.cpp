@@ -0,0 +1,152 @@
+/**
+ * @file frame.cpp
+ * @brief Frame class implementation.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-12
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#include "frame.h"
+#include "message.h"
+#include "metrics.h"
+
+#include <boost/beast/zlib/deflate_stream.hpp>
+#include <chrono>
+
+namespace {
+
+/**
+ * @brief FIN bit, see RFC 6455 section 5.2.
+ */
+constexpr std::uint8_t fin = 0x80;
+/**
+ * @brief RSV1 bit, set on compressed messages, see RFC 7692 section 6.
+ */
+constexpr std::uint8_t rsv1 = 0x40;
+
+/**
+ * @brief Build an unmasked WebSocket frame header.
+ *
+ * @param header Receive the header.
+ * @param first The first byte of the header.
+ * @param size The payload size.
+ * @return std::size_t The header size.
+ */
+std::size_t make_header(std::array<std::uint8_t, 10> &header,
+                        std::uint8_t first, std::size_t size) {
+    std::size_t header_size = 0;
+    header[0] = first;
+    if (size < 126) {
+        header[1] = static_cast<std::uint8_t>(size);
+        header_size = 2;
+    } else if (size <= 0xFFFF) {
+        header[1] = 126;
+        header_size = 4;
+    } else {
+        header[1] = 127;
+        header_size = 10;
+    }
+    // The extended length is big-endian
+    for (std::size_t i = header_size; i > 2; --i) {
+        header[i - 1] = static_cast<std::uint8_t>(
+            static_cast<std::uint64_t>(size) >> (8 * (header_size - i)));
+    }
+    return header_size;
+}
+
+/**
+ * @brief Compress a payload as a permessage-deflate message.
+ * @details The stream is reset before every message, which is what no
+ * context takeover requires, and kept per thread so its buffers are reused.
+ *
+ * @param payload The payload.
+ * @return std::string The compressed payload, or an empty string on failure.
+ */
+std::string deflate(const std::string &payload) {
+    thread_local beast::zlib::deflate_stream stream;
+    stream.reset();
+
+    // Room for the empty stored block of the sync flush
+    std::string out(stream.upper_bound(payload.size()) + 16, '\0');
+    beast::zlib::z_params zs;
+    zs.next_in = payload.data();
+    zs.avail_in = payload.size();
+    zs.next_out = out.data();
+    zs.avail_out = out.size();
+
+    beast::error_code ec;
+    stream.write(zs, beast::zlib::Flush::sync, ec);
+    if (ec || zs.avail_in != 0 || zs.total_out < 4) {
+        return {};
+    }
+
+    // Remove the 0x00 0x00 0xff 0xff tail of the sync flush
+    out.resize(zs.total_out - 4);
+    return out;
+}
+
+} // namespace
+
+Frame::Frame(std::string payload, std::string room, std::string key)
+    : payload_(std::move(payload)), room_(std::move(room)),
+      key_(std::move(key)) {
+    header_size_ = make_header(header_, fin | text_opcode, payload_.size());
+}
+
+Frame::Frame(std::string payload, std::uint8_t opcode)
+    : payload_(std::move(payload)) {
+    header_size_ = make_header(header_, fin | opcode, payload_.size());
+}
+
+const Frame &Frame::encoded(Encoding encoding) const {
+    if (encoding == Encoding::json) {
+        return *this;
+    }
+
+    std::call_once(cbor_once_, [this] {
+        std::string cbor;
+        if (Message::to_cbor(payload_, cbor)) {
+            cbor_.reset(new Frame(std::move(cbor), binary_opcode));
+        }
+    });
+    return cbor_ ? *cbor_ : *this;
+}
+
+std::array<asio::const_buffer, 2> Frame::deflated(std::size_t min_size) const {
+    std::call_once(deflate_once_, [this, min_size] {
+        if (payload_.size() < min_size) {
+            return;
+        }
+
+        auto const start = std::chrono::steady_clock::now();
+        auto compressed = deflate(payload_);
+        auto const elapsed = std::chrono::steady_clock::now() - start;
+
+        bump(metrics().deflate_frames);
+        bump(metrics().deflate_nanoseconds,
+             std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+                 .count());
+        if (compressed.empty() || compressed.size() >= payload_.size()) {
+            return;
+        }
+        deflated_ = std::move(compressed);
+        // Same opcode, with the compressed bit
+        deflated_header_size_ =
+            make_header(deflated_header_,
+                        static_cast<std::uint8_t>(header_[0] | rsv1),
+                        deflated_.size());
+    });
+
+    if (deflated_.empty()) {
+        return {header(), buffer()};
+    }
+    return {asio::buffer(deflated_header_.data(), deflated_header_size_),
+            asio::buffer(deflated_)};
+}
+
+std::shared_ptr<const Frame> Frame::from_message(const Message &message) {
+    return std::make_shared<const Frame>(message.stringify());
+}
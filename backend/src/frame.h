@@ -0,0 +1,284 @@
+/**
+ * @file frame.h
+ * @brief Frame class definition. A frame is an immutable, serialized message
+ * ready to be written to the wire.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-12
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#pragma once
+
+#include "base.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+class Message;
+
+/**
+ * @brief The encoding of the messages of a session.
+ * @details Negotiated with the Sec-WebSocket-Protocol header of the handshake.
+ * @see WebSocket::negotiate
+ */
+enum class Encoding {
+    /**
+     * @brief JSON text frames, the default.
+     */
+    json,
+    /**
+     * @brief CBOR binary frames.
+     */
+    cbor,
+};
+
+/**
+ * @brief Frame class, an immutable serialized message.
+ * @details A frame holds the wire representation of a message. It is built
+ * once per broadcast and shared by every recipient through a shared_ptr, so
+ * the fan-out cost does not depend on the serialization work.
+ * @see State::send_to_all
+ * @see Session::send
+ */
+class Frame {
+  public:
+    /**
+     * @brief Construct a new Frame object.
+     *
+     * @param payload The serialized message.
+     * @param room The room the frame is sent to, or an empty string if it is
+     * sent to everyone.
+     * @param key The coalescing key, or an empty string if the frame must not
+     * be coalesced.
+     */
+    explicit Frame(std::string payload, std::string room = {},
+                   std::string key = {});
+
+    /**
+     * @brief Build a frame from a message.
+     * @details Stringify the message once and wrap the result in a frame.
+     *
+     * @param message The message to be serialized.
+     * @return std::shared_ptr<const Frame> The frame.
+     */
+    static std::shared_ptr<const Frame> from_message(const Message &message);
+
+    /**
+     * @brief Get the frame in an encoding.
+     * @details The payload of a frame is JSON. The CBOR frame is transcoded
+     * once, by the first session that needs it, and shared by every session
+     * that negotiated CBOR. This method is thread-safe. If the payload cannot
+     * be transcoded, the JSON frame is returned.
+     *
+     * @param encoding The encoding of the recipient.
+     * @return const Frame& The frame in the encoding. It lives as long as this
+     * frame.
+     */
+    [[nodiscard]] const Frame &encoded(Encoding encoding) const;
+
+    /**
+     * @brief Get the payload as a buffer.
+     * @details The buffer refers to the frame, so the frame must outlive any
+     * write that uses it.
+     *
+     * @return asio::const_buffer The payload buffer.
+     */
+    [[nodiscard]] asio::const_buffer buffer() const {
+        return asio::buffer(payload_);
+    }
+
+    /**
+     * @brief Get the WebSocket frame header of the payload.
+     * @details The header of a single, unmasked text or binary frame holding
+     * the whole payload, as a server sends it. It is built once with the
+     * frame, so a batch of frames can be written to the socket directly.
+     *
+     * @return asio::const_buffer The header buffer.
+     */
+    [[nodiscard]] asio::const_buffer header() const {
+        return asio::buffer(header_.data(), header_size_);
+    }
+
+    /**
+     * @brief Get the frame as sent to a session that negotiated
+     * permessage-deflate.
+     * @details The payload is compressed once, by the first session that
+     * needs it, without context takeover, so every such session shares the
+     * same compressed bytes. This method is thread-safe. A payload smaller
+     * than min_size, or that does not shrink, is sent uncompressed.
+     *
+     * @param min_size The smallest payload worth compressing.
+     * @return std::array<asio::const_buffer, 2> The header and payload
+     * buffers.
+     */
+    [[nodiscard]] std::array<asio::const_buffer, 2>
+    deflated(std::size_t min_size) const;
+
+    /**
+     * @brief Get the payload.
+     *
+     * @return const std::string& The serialized message.
+     */
+    [[nodiscard]] const std::string &payload() const {
+        return payload_;
+    }
+
+    /**
+     * @brief Get the payload size in bytes.
+     *
+     * @return std::size_t The payload size.
+     */
+    [[nodiscard]] std::size_t size() const {
+        return payload_.size();
+    }
+
+    /**
+     * @brief Get the room the frame is sent to.
+     *
+     * @return const std::string& The room, or an empty string if the frame is
+     * sent to everyone.
+     */
+    [[nodiscard]] const std::string &room() const {
+        return room_;
+    }
+
+    /**
+     * @brief Get the coalescing key of the frame.
+     * @details A queued frame may be replaced by a newer frame with the same
+     * key under the coalesce policy, because the newer one supersedes it.
+     * @see SlowConsumerPolicy::coalesce
+     *
+     * @return const std::string& The key, or an empty string if the frame
+     * must not be coalesced.
+     */
+    [[nodiscard]] const std::string &key() const {
+        return key_;
+    }
+
+    /**
+     * @brief Stamp the frame with the time its message was read.
+     * @details Only done when tracing, before the frame is shared.
+     * @see Config::trace
+     *
+     * @param received The end of the read, from trace_clock().
+     */
+    void set_received(std::int64_t received) {
+        received_ = received;
+    }
+
+    /**
+     * @brief Get the time the message of the frame was read.
+     *
+     * @return std::int64_t The time, or 0 if the frame is not traced.
+     */
+    [[nodiscard]] std::int64_t received() const {
+        return received_;
+    }
+
+    /**
+     * @brief Stamp the start of the fan-out, unless it is stamped already.
+     * @details A relayed frame is fanned out by every shard, the first one
+     * counts.
+     *
+     * @param fanout The start of the fan-out, from trace_clock().
+     */
+    void set_fanout(std::int64_t fanout) const {
+        std::int64_t expected = 0;
+        fanout_.compare_exchange_strong(expected, fanout,
+                                        std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Get the start of the first fan-out of the frame.
+     *
+     * @return std::int64_t The time, or 0 if it is not stamped yet.
+     */
+    [[nodiscard]] std::int64_t fanout() const {
+        return fanout_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    /**
+     * @brief The WebSocket opcode of a text frame.
+     */
+    static constexpr std::uint8_t text_opcode = 0x1;
+    /**
+     * @brief The WebSocket opcode of a binary frame.
+     */
+    static constexpr std::uint8_t binary_opcode = 0x2;
+
+    /**
+     * @brief Construct a frame with an opcode.
+     *
+     * @param payload The serialized message.
+     * @param opcode The WebSocket opcode.
+     */
+    Frame(std::string payload, std::uint8_t opcode);
+
+    /**
+     * @brief The serialized message.
+     */
+    const std::string payload_;
+    /**
+     * @brief The room the frame is sent to.
+     * @details The room travels with the frame, so that a frame relayed to
+     * another shard is routed the same way.
+     */
+    const std::string room_;
+    /**
+     * @brief The coalescing key of the frame.
+     */
+    const std::string key_;
+    /**
+     * @brief The WebSocket frame header.
+     */
+    std::array<std::uint8_t, 10> header_{};
+    /**
+     * @brief The size of the WebSocket frame header.
+     */
+    std::size_t header_size_ = 0;
+    /**
+     * @brief Guard the compression of the payload.
+     */
+    mutable std::once_flag deflate_once_;
+    /**
+     * @brief The compressed payload.
+     * @details Empty if the payload is sent uncompressed. Written once under
+     * deflate_once_.
+     */
+    mutable std::string deflated_;
+    /**
+     * @brief The WebSocket frame header of the compressed payload.
+     */
+    mutable std::array<std::uint8_t, 10> deflated_header_{};
+    /**
+     * @brief The size of the WebSocket frame header of the compressed
+     * payload.
+     */
+    mutable std::size_t deflated_header_size_ = 0;
+    /**
+     * @brief Guard the transcoding of the payload to CBOR.
+     */
+    mutable std::once_flag cbor_once_;
+    /**
+     * @brief The CBOR frame.
+     * @details Null if the payload could not be transcoded. Written once under
+     * cbor_once_.
+     */
+    mutable std::unique_ptr<const Frame> cbor_;
+    /**
+     * @brief The time the message was read, 0 if the frame is not traced.
+     */
+    std::int64_t received_ = 0;
+    /**
+     * @brief The start of the first fan-out, 0 until then.
+     */
+    mutable std::atomic<std::int64_t> fanout_{0};
+};
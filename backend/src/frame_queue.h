@@ -0,0 +1,159 @@
+/**
+ * @file frame_queue.h
+ * @brief FrameQueue class definition. The outbound queue of a session.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-20
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+class Frame;
+
+/**
+ * @brief FrameQueue class, a queue of shared frames that owns no memory while
+ * it is empty.
+ * @details A vector and the index of its front. A std::deque allocates its
+ * map and a first block even when it is empty, which every idle session would
+ * pay for. Popping only moves the front, the vector is cleared when the queue
+ * empties, and the popped prefix is erased when the vector is full. The queue
+ * is not synchronized, its owner guards it.
+ * @see Session
+ */
+class FrameQueue {
+  public:
+    /**
+     * @brief The iterator over the queued frames.
+     */
+    using iterator = std::vector<std::shared_ptr<const Frame>>::iterator;
+
+    /**
+     * @brief Whether the queue is empty.
+     *
+     * @return true No frame is queued.
+     */
+    [[nodiscard]] bool empty() const {
+        return head_ == frames_.size();
+    }
+
+    /**
+     * @brief Get the number of queued frames.
+     *
+     * @return std::size_t The number of frames.
+     */
+    [[nodiscard]] std::size_t size() const {
+        return frames_.size() - head_;
+    }
+
+    /**
+     * @brief Get the oldest frame.
+     *
+     * @return const std::shared_ptr<const Frame>& The oldest frame.
+     */
+    [[nodiscard]] const std::shared_ptr<const Frame> &front() const {
+        return frames_[head_];
+    }
+
+    /**
+     * @brief Get a queued frame.
+     *
+     * @param index The position of the frame, 0 is the oldest.
+     * @return const std::shared_ptr<const Frame>& The frame.
+     */
+    const std::shared_ptr<const Frame> &operator[](std::size_t index) const {
+        return frames_[head_ + index];
+    }
+
+    /**
+     * @brief Get an iterator to the oldest frame.
+     *
+     * @return iterator The iterator.
+     */
+    iterator begin() {
+        return frames_.begin() + static_cast<std::ptrdiff_t>(head_);
+    }
+
+    /**
+     * @brief Get the end iterator.
+     *
+     * @return iterator The iterator.
+     */
+    iterator end() {
+        return frames_.end();
+    }
+
+    /**
+     * @brief Queue a frame.
+     *
+     * @param frame The frame.
+     */
+    void push_back(std::shared_ptr<const Frame> frame) {
+        if (head_ > 0 && frames_.size() == frames_.capacity()) {
+            frames_.erase(frames_.begin(), begin());
+            head_ = 0;
+        }
+        frames_.push_back(std::move(frame));
+    }
+
+    /**
+     * @brief Remove the oldest frame.
+     */
+    void pop_front() {
+        frames_[head_].reset();
+        if (++head_ == frames_.size()) {
+            frames_.clear();
+            head_ = 0;
+        }
+    }
+
+    /**
+     * @brief Remove a frame.
+     *
+     * @param it The frame.
+     * @return iterator The frame after the removed one.
+     */
+    iterator erase(iterator it) {
+        auto const next = frames_.erase(it);
+        if (empty()) {
+            frames_.clear();
+            head_ = 0;
+            return end();
+        }
+        return next;
+    }
+
+    /**
+     * @brief Release the memory of an empty queue.
+     */
+    void shrink_to_fit() {
+        if (empty()) {
+            frames_ = {};
+        }
+    }
+
+    /**
+     * @brief Get the memory held by the queue.
+     *
+     * @return std::size_t The capacity of the vector, in bytes.
+     */
+    [[nodiscard]] std::size_t memory() const {
+        return frames_.capacity() * sizeof(std::shared_ptr<const Frame>);
+    }
+
+  private:
+    /**
+     * @brief The frames, the popped ones first.
+     */
+    std::vector<std::shared_ptr<const Frame>> frames_;
+    /**
+     * @brief The position of the oldest frame.
+     */
+    std::size_t head_ = 0;
+};
@@ -0,0 +1,298 @@
+/**
+ * @file gated_stream.h
+ * @brief GatedStream class definition. The next layer of the WebSocket
+ * stream, which keeps the batch writes of the session and the writes of
+ * Beast from interleaving.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-25
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#pragma once
+
+#include "base.h"
+
+#include <boost/asio/associated_allocator.hpp>
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/websocket/teardown.hpp>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+/**
+ * @brief GatedStream class, a TCP stream with a write gate.
+ * @details The batch writer writes prebuilt WebSocket frames below Beast,
+ * while Beast still writes control frames by itself: the pongs and the
+ * close frames it answers with while reading, and the pings of the session.
+ * Every write of Beast goes through async_write_some(), and every batch
+ * through async_write_batch(). Whichever starts while the other is in
+ * flight is parked, and resumed when the other completes, so the bytes of a
+ * control frame never land inside a batch, and the reverse.
+ *
+ * A Beast write ends when a write_some call writes all it was given. This
+ * holds for the control frames, which are far smaller than the 64 KiB that
+ * a single write_some call is given. Messages are only written by Beast
+ * when no batch is ever written. Both sides run on the strand of the
+ * session.
+ * @see Session::do_write
+ */
+class GatedStream {
+  public:
+    /**
+     * @brief The executor of the stream.
+     */
+    using executor_type = beast::tcp_stream::executor_type;
+
+    /**
+     * @brief Construct a new GatedStream object.
+     *
+     * @param socket The connected socket.
+     */
+    explicit GatedStream(tcp::socket &&socket) : stream_(std::move(socket)) {}
+
+    /**
+     * @brief Get the executor of the stream.
+     *
+     * @return executor_type The executor.
+     */
+    executor_type get_executor() noexcept {
+        return stream_.get_executor();
+    }
+
+    /**
+     * @brief Get the TCP stream.
+     *
+     * @return beast::tcp_stream& The TCP stream.
+     */
+    beast::tcp_stream &next_layer() {
+        return stream_;
+    }
+
+    /**
+     * @brief Read some bytes. Reads are never gated.
+     *
+     * @param buffers The buffers to read into.
+     * @param token The completion token.
+     * @return auto The result of the token.
+     */
+    template <class MutableBufferSequence, class ReadToken>
+    auto async_read_some(const MutableBufferSequence &buffers,
+                         ReadToken &&token) {
+        return stream_.async_read_some(buffers,
+                                       std::forward<ReadToken>(token));
+    }
+
+    /**
+     * @brief Write some bytes for Beast.
+     * @details Parked while a batch is in flight.
+     *
+     * @param buffers The buffers to write.
+     * @param token The completion token.
+     * @return auto The result of the token.
+     */
+    template <class ConstBufferSequence, class WriteToken>
+    auto async_write_some(const ConstBufferSequence &buffers,
+                          WriteToken &&token) {
+        return asio::async_initiate<WriteToken,
+                                    void(beast::error_code, std::size_t)>(
+            [this](auto handler, const ConstBufferSequence &data) {
+                write_some(data, std::move(handler));
+            },
+            token, buffers);
+    }
+
+    /**
+     * @brief Write a batch of prebuilt frames.
+     * @details Parked while a write of Beast is in flight. Only one batch
+     * may be in flight.
+     *
+     * @param buffers The buffers to write, all of them.
+     * @param token The completion token.
+     * @return auto The result of the token.
+     */
+    template <class ConstBufferSequence, class WriteToken>
+    auto async_write_batch(const ConstBufferSequence &buffers,
+                           WriteToken &&token) {
+        return asio::async_initiate<WriteToken,
+                                    void(beast::error_code, std::size_t)>(
+            [this](auto handler, const ConstBufferSequence &data) {
+                write_batch(data, std::move(handler));
+            },
+            token, buffers);
+    }
+
+  private:
+    /**
+     * @brief A write that waits for the gate.
+     */
+    struct Parked {
+        virtual ~Parked() = default;
+        /**
+         * @brief Start the write.
+         */
+        virtual void resume() = 0;
+    };
+
+    /**
+     * @brief A parked write, as a function that starts it.
+     *
+     * @tparam Start The function.
+     */
+    template <class Start> struct ParkedWrite : Parked {
+        explicit ParkedWrite(Start start) : start(std::move(start)) {}
+
+        void resume() override {
+            start();
+        }
+
+        Start start;
+    };
+
+    /**
+     * @brief The completion handler of a write, which opens the gate.
+     * @details The executor and the allocator of the handler are kept.
+     *
+     * @tparam Handler The handler of the write.
+     */
+    template <class Handler> struct Completion {
+        using executor_type =
+            asio::associated_executor_t<Handler, GatedStream::executor_type>;
+        using allocator_type = asio::associated_allocator_t<Handler>;
+
+        executor_type get_executor() const noexcept {
+            return asio::get_associated_executor(handler,
+                                                 gate->get_executor());
+        }
+
+        allocator_type get_allocator() const noexcept {
+            return asio::get_associated_allocator(handler);
+        }
+
+        void operator()(beast::error_code ec, std::size_t bytes) {
+            if (batch) {
+                gate->batch_done();
+            } else if (ec || bytes == size) {
+                gate->stream_done();
+            }
+            handler(ec, bytes);
+        }
+
+        GatedStream *gate;
+        bool batch;
+        std::size_t size;
+        Handler handler;
+    };
+
+    template <class ConstBufferSequence, class Handler>
+    void write_some(const ConstBufferSequence &buffers, Handler handler) {
+        if (batch_busy_) {
+            park([this, buffers, handler = std::move(handler)]() mutable {
+                write_some(buffers, std::move(handler));
+            });
+            return;
+        }
+        stream_busy_ = true;
+        auto const size = beast::buffer_bytes(buffers);
+        stream_.async_write_some(
+            buffers,
+            Completion<Handler>{this, false, size, std::move(handler)});
+    }
+
+    template <class ConstBufferSequence, class Handler>
+    void write_batch(const ConstBufferSequence &buffers, Handler handler) {
+        if (stream_busy_) {
+            park([this, buffers, handler = std::move(handler)]() mutable {
+                write_batch(buffers, std::move(handler));
+            });
+            return;
+        }
+        batch_busy_ = true;
+        asio::async_write(stream_, buffers,
+                          Completion<Handler>{this, true, 0,
+                                              std::move(handler)});
+    }
+
+    template <class Start> void park(Start start) {
+        parked_ = std::make_unique<ParkedWrite<Start>>(std::move(start));
+    }
+
+    /**
+     * @brief Open the gate after a write of Beast.
+     */
+    void stream_done() {
+        stream_busy_ = false;
+        resume();
+    }
+
+    /**
+     * @brief Open the gate after a batch.
+     */
+    void batch_done() {
+        batch_busy_ = false;
+        resume();
+    }
+
+    /**
+     * @brief Start the parked write, if any.
+     */
+    void resume() {
+        if (parked_) {
+            auto const parked = std::move(parked_);
+            parked->resume();
+        }
+    }
+
+    /**
+     * @brief The TCP stream.
+     */
+    beast::tcp_stream stream_;
+    /**
+     * @brief The write that waits for the gate.
+     * @details Beast writes one frame at a time, and the session one batch
+     * at a time, so at most one write waits.
+     */
+    std::unique_ptr<Parked> parked_;
+    /**
+     * @brief Whether a write of Beast is in flight.
+     */
+    bool stream_busy_ = false;
+    /**
+     * @brief Whether a batch is in flight.
+     */
+    bool batch_busy_ = false;
+};
+
+/**
+ * @brief Tear down the connection, as Beast does for a TCP stream.
+ *
+ * @param role The role of the WebSocket stream.
+ * @param stream The stream.
+ * @param ec Receive the error, if any.
+ */
+inline void teardown(beast::role_type role, GatedStream &stream,
+                     beast::error_code &ec) {
+    using beast::websocket::teardown;
+    teardown(role, stream.next_layer(), ec);
+}
+
+/**
+ * @brief Tear down the connection asynchronously, as Beast does for a TCP
+ * stream.
+ *
+ * @param role The role of the WebSocket stream.
+ * @param stream The stream.
+ * @param handler The completion handler.
+ */
+template <class TeardownHandler>
+void async_teardown(beast::role_type role, GatedStream &stream,
+                    TeardownHandler &&handler) {
+    using beast::websocket::async_teardown;
+    async_teardown(role, stream.next_layer(),
+                   std::forward<TeardownHandler>(handler));
+}
@@ -0,0 +1,72 @@
+/**
+ * @file history.cpp
+ * @brief History class implementation.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-16
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#include "history.h"
+
+#include <thread>
+
+std::uint64_t History::push(const std::shared_ptr<const Frame> &frame) {
+    if (slots_.empty()) {
+        return 0;
+    }
+    auto const seq = pushed_.fetch_add(1) + 1;
+    auto &slot = slots_[(seq - 1) % slots_.size()];
+
+    // Only a push a full ring apart stores into the same slot
+    auto current = slot.seq.load(std::memory_order_relaxed);
+    do {
+        while (current == busy) {
+            std::this_thread::yield();
+            current = slot.seq.load(std::memory_order_relaxed);
+        }
+        if (current > seq) {
+            return seq;
+        }
+    } while (!slot.seq.compare_exchange_weak(current, busy,
+                                             std::memory_order_acquire,
+                                             std::memory_order_relaxed));
+    std::atomic_store(&slot.frame, frame);
+    slot.seq.store(seq, std::memory_order_release);
+    return seq;
+}
+
+Backlog History::frames(std::uint64_t last) const {
+    Backlog backlog;
+    backlog.last = last;
+    if (slots_.empty() || last == 0) {
+        return backlog;
+    }
+    backlog.first = last > slots_.size() ? last - slots_.size() + 1 : 1;
+    backlog.frames.reserve(last - backlog.first + 1);
+    for (auto seq = backlog.first; seq <= last; ++seq) {
+        auto const &slot = slots_[(seq - 1) % slots_.size()];
+
+        // The push that took the number has not stored its frame yet
+        auto stored = slot.seq.load(std::memory_order_acquire);
+        while (stored < seq || stored == busy) {
+            std::this_thread::yield();
+            stored = slot.seq.load(std::memory_order_acquire);
+        }
+        std::shared_ptr<const Frame> frame;
+        if (stored == seq) {
+            frame = std::atomic_load(&slot.frame);
+            stored = slot.seq.load(std::memory_order_acquire);
+        }
+        if (stored != seq) {
+            // Overwritten, the window starts after it
+            backlog.frames.clear();
+            backlog.first = seq + 1;
+            continue;
+        }
+        backlog.frames.push_back(std::move(frame));
+    }
+    return backlog;
+}
@@ -0,0 +1,131 @@
+/**
+ * @file history.h
+ * @brief History class definition. A fixed-capacity ring of the recent frames
+ * of a room.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-16
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class Frame;
+
+/**
+ * @brief The recent frames of a history, and their sequence numbers.
+ * @details The frames numbered first to last, oldest first. The window is
+ * empty when first is greater than last.
+ */
+struct Backlog {
+    /**
+     * @brief The frames, oldest first.
+     */
+    std::vector<std::shared_ptr<const Frame>> frames;
+    /**
+     * @brief The sequence number of the oldest frame.
+     */
+    std::uint64_t first = 1;
+    /**
+     * @brief The sequence number of the newest frame.
+     */
+    std::uint64_t last = 0;
+};
+
+/**
+ * @brief History class, the recent frames of a room.
+ * @details A ring of shared frames, allocated once with its capacity. Pushing
+ * a frame only stores a reference, and the oldest frame is overwritten when
+ * the ring is full. The frames are numbered from 1 in the order they are
+ * pushed.
+ *
+ * The ring is safe to push to from any thread without a lock: a push takes
+ * the next number, and stores the frame in its slot. The slot is only
+ * contended by a push a full ring later, which waits for the store, or gives
+ * up if the later frame was stored first. Readers never block pushes.
+ * @see State
+ */
+class History {
+  public:
+    /**
+     * @brief Construct a new History object.
+     *
+     * @param capacity The number of frames kept.
+     */
+    explicit History(std::size_t capacity) : slots_(capacity) {}
+
+    /**
+     * @brief Record a frame. This method is thread-safe.
+     *
+     * @param frame The frame to be recorded.
+     * @return std::uint64_t The sequence number of the frame, or 0 if the
+     * history keeps no frame.
+     */
+    std::uint64_t push(const std::shared_ptr<const Frame> &frame);
+
+    /**
+     * @brief Get the number of frames pushed so far. This method is
+     * thread-safe.
+     * @details The load is sequentially consistent, like the increment of
+     * push(). A reader that publishes a snapshot of sessions then loads the
+     * count, and a push that then loads the snapshot, cannot both miss the
+     * other.
+     *
+     * @return std::uint64_t The sequence number of the last frame.
+     */
+    [[nodiscard]] std::uint64_t pushed() const {
+        return pushed_.load();
+    }
+
+    /**
+     * @brief Get the recorded frames up to a sequence number. This method is
+     * thread-safe.
+     * @details Copy the references to the frames, not the frames. It waits
+     * for the pushes that took a number up to last and have not stored their
+     * frame yet, so that no frame of the window is missing. A frame that a
+     * later push overwrites meanwhile ends the window before it.
+     *
+     * @param last The sequence number of the newest frame.
+     * @return Backlog The frames, oldest first.
+     */
+    [[nodiscard]] Backlog frames(std::uint64_t last) const;
+
+  private:
+    /**
+     * @brief A slot of the ring.
+     */
+    struct Slot {
+        /**
+         * @brief The sequence number of the frame in the slot.
+         * @details 0 while the slot is empty, and busy while a push stores
+         * its frame.
+         */
+        std::atomic<std::uint64_t> seq{0};
+        /**
+         * @brief The frame, loaded and stored atomically.
+         */
+        std::shared_ptr<const Frame> frame;
+    };
+
+    /**
+     * @brief The sequence number of a slot being stored.
+     */
+    static constexpr std::uint64_t busy = ~std::uint64_t{0};
+
+    /**
+     * @brief The ring of frames.
+     */
+    std::vector<Slot> slots_;
+    /**
+     * @brief The number of frames pushed so far.
+     */
+    std::atomic<std::uint64_t> pushed_{0};
+};
@@ -11,10 +11,40 @@
 
 #include "listener.h"
 #include "base.h"
+#include "metrics.h"
 #include "session.h"
+#include "session_pool.h"
+
+#include <sys/socket.h>
+
+tcp::acceptor Listener::make_acceptor(asio::io_context &ioc,
+                                      const tcp::endpoint &endpoint,
+                                      bool reuse_port) {
+    tcp::acceptor acceptor(asio::make_strand(ioc));
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(asio::socket_base::reuse_address(true));
+    if (reuse_port) {
+        using reuse_port_option =
+            asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+        acceptor.set_option(reuse_port_option(true));
+    }
+    acceptor.bind(endpoint);
+    acceptor.listen(asio::socket_base::max_listen_connections);
+    return acceptor;
+}
 
 void Listener::run() {
+    for (std::size_t i = 0; i < state_->config().accepts_in_flight; ++i) {
+        do_accept();
+    }
+}
+
+void Listener::do_accept() {
+    // Every session gets its own strand, so its handlers never run
+    // concurrently when the io_context runs on several threads. The handler
+    // runs on the strand of the acceptor.
     acceptor_.async_accept(
+        asio::make_strand(sessions_),
         [self = shared_from_this()](boost::system::error_code ec,
                                     tcp::socket socket) {
             self->on_accept(ec, std::move(socket));
@@ -25,7 +55,11 @@ void Listener::on_accept(boost::system::error_code ec, tcp::socket socket) {
     if (ec) {
         fail(ec, "accept");
     } else {
-        std::make_shared<Session>(std::move(socket), state_)->run();
+        bump(metrics().connections_accepted);
+        // The session and its control block come from a recycled slot
+        std::allocate_shared<Session>(SessionAllocator<Session>(),
+                                      std::move(socket), state_)
+            ->run();
     }
-    run();
+    do_accept();
 }
\ No newline at end of file
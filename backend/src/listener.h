@@ -34,17 +34,46 @@ class Listener : public std::enable_shared_from_this<Listener> {
      * @param acceptor An acceptor object, which is used to listen on a port.
      * When main function build a tcp acceptor, then pass it to build an
      * acceptor object.
+     * @param sessions The io_context of the accepted sessions. It may differ
+     * from the io_context of the acceptor.
+     * @param state The state object shared by the accepted sessions.
      */
-    explicit Listener(tcp::acceptor &&acceptor)
-        : acceptor_(std::move(acceptor)), state_(std::make_shared<State>()){};
+    Listener(tcp::acceptor &&acceptor, asio::io_context &sessions,
+             std::shared_ptr<State> state)
+        : acceptor_(std::move(acceptor)), sessions_(sessions),
+          state_(std::move(state)){};
+
+    /**
+     * @brief Build a listening acceptor.
+     * @details Open, bind and listen on the endpoint. With reuse_port, several
+     * acceptors can listen on the same endpoint, and the kernel spreads the
+     * new connections between them. The acceptor runs on a strand, so that
+     * several accepts can be in flight when its io_context runs on several
+     * threads.
+     *
+     * @param ioc The io_context of the acceptor.
+     * @param endpoint The endpoint to listen on.
+     * @param reuse_port Whether to set SO_REUSEPORT.
+     * @return tcp::acceptor The listening acceptor.
+     */
+    static tcp::acceptor make_acceptor(asio::io_context &ioc,
+                                       const tcp::endpoint &endpoint,
+                                       bool reuse_port);
 
     /**
      * @brief Run the listener.
-     * @details Run the listener, start listening on the port.
+     * @details Run the listener, start listening on the port. It starts as
+     * many accepts as configured, each one starts the next when it completes.
+     * It must be called before the io_context of the acceptor runs.
+     * @see Config::accepts_in_flight
      */
     void run();
 
   private:
+    /**
+     * @brief Start an accept.
+     */
+    void do_accept();
     /**
      * @brief Accept a new connection.
      * @details Accept a new connection, and create a new session to handle it.
@@ -60,6 +89,10 @@ class Listener : public std::enable_shared_from_this<Listener> {
      * @details The acceptor object, which is used to listen on a port.
      */
     tcp::acceptor acceptor_;
+    /**
+     * @brief The io_context of the accepted sessions.
+     */
+    asio::io_context &sessions_;
     /**
      * @brief The state object.
      * @details The state object, which is used to store the state of the
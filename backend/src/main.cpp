@@ -6,7 +6,7 @@
  * number of threads is specified by the command line arguments. The listener
  * will listen on a port and accept new connections. When a new connection is
  * accepted, a new session is created and run. The session will handle the
- * connection.
+ * connection. With --shards, every thread runs its own io_context instead.
  *
  * @author salvor
  * @version 0.1
@@ -15,7 +15,14 @@
  * Copyright (c) 2023 Salvor
  */
 
+#include "config.h"
 #include "listener.h"
+#include "message_log.h"
+#include "metrics.h"
+#include "rate_limiter.h"
+#include "session_pool.h"
+#include "shard.h"
+#include "timer_wheel.h"
 
 #include <boost/asio/signal_set.hpp>
 #include <cstdint>
@@ -39,25 +46,85 @@
  */
 int main(int argc, char **argv) {
     // Check command line arguments.
-    if (argc != 4) {
-        fmt::print(stderr, "Usage: {} <address> <port> <threads>", argv[0]);
+    auto const parsed = Config::parse(argc, argv);
+    if (!parsed) {
+        Config::print_usage(argv[0]);
         return EXIT_FAILURE;
     }
-    auto const address = asio::ip::make_address(argv[1]);
-    auto const port = static_cast<std::uint16_t>(std::atoi(argv[2]));
-    auto const threads = std::max<int>(1, std::atoi(argv[3]));
+    auto const config = std::make_shared<const Config>(*parsed);
+    auto const threads = config->threads;
+    session_pool().configure(*config);
+    rate_limiter().configure(*config);
+
+    // Open the message log before any session can write to it
+    std::shared_ptr<MessageLog> log;
+    if (!config->log_dir.empty()) {
+        beast::error_code ec;
+        log = MessageLog::open(*config, ec);
+        if (ec) {
+            fail(ec, "log");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (config->sharded) {
+        ShardGroup(config, log).run();
+        Metrics::report();
+        return EXIT_SUCCESS;
+    }
 
     asio::io_context ioc;
 
-    // Create and launch a listening port
-    std::make_shared<Listener>(tcp::acceptor(ioc, {address, port}))->run();
+    auto const state = std::make_shared<State>(config);
+    if (log) {
+        state->set_log(log);
+    }
+
+    // The sessions are striped over one timer wheel per io thread, to spread
+    // the arms and cancels over as many mutexes. Any thread may use any wheel.
+    std::vector<std::shared_ptr<TimerWheel>> wheels;
+    for (int i = 0; i < threads; ++i) {
+        wheels.push_back(TimerWheel::start(ioc, config->timer_tick));
+    }
+    state->set_timer_wheels(std::move(wheels));
+
+    // Create and launch a listening port. Several acceptors each get their
+    // own io_context and thread, and the kernel spreads the connections.
+    tcp::endpoint const endpoint(config->address, config->port);
+    std::vector<std::unique_ptr<asio::io_context>> acceptors;
+    if (config->acceptors == 1) {
+        std::make_shared<Listener>(
+            Listener::make_acceptor(ioc, endpoint, false), ioc, state)
+            ->run();
+    } else {
+        for (std::size_t i = 0; i < config->acceptors; ++i) {
+            acceptors.push_back(std::make_unique<asio::io_context>(1));
+            std::make_shared<Listener>(
+                Listener::make_acceptor(*acceptors.back(), endpoint, true),
+                ioc, state)
+                ->run();
+        }
+    }
 
     // Capture SIGINT and SIGTERM to perform a clean shutdown
     asio::signal_set signals(ioc, SIGINT, SIGTERM);
-    signals.async_wait([&ioc](boost::system::error_code const &, int) {
-        // Stop the io_context. This will cause run() to return immediately,
-        ioc.stop();
-    });
+    signals.async_wait(
+        [&ioc, &acceptors](boost::system::error_code const &, int) {
+            // Stop the io_contexts. This will cause run() to return
+            // immediately,
+            ioc.stop();
+            for (auto &acceptor : acceptors) {
+                acceptor->stop();
+            }
+        });
+
+    // Capture SIGUSR1 to print the stage latencies and the memory
+    asio::signal_set dump(ioc, SIGUSR1);
+    report_on(dump);
+
+    // Send the joins and leaves of every interval as one presence delta
+    asio::steady_timer presence(ioc);
+    state->publish_presence_on(presence);
 
     // Run the I/O service on the requested number of threads
     std::vector<std::thread> v;
@@ -65,7 +132,15 @@ int main(int argc, char **argv) {
     for (auto i = threads - 1; i > 0; --i) {
         v.emplace_back([&ioc] { ioc.run(); });
     }
+    for (auto &acceptor : acceptors) {
+        v.emplace_back([&acceptor = *acceptor] { acceptor.run(); });
+    }
     ioc.run();
 
+    for (auto &t : v) {
+        t.join();
+    }
+    Metrics::report();
+
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -11,12 +11,570 @@
 
 #include "message.h"
 
+#include <rapidjson/memorystream.h>
+#include <rapidjson/reader.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <limits>
 #include <string>
+#include <vector>
 
-Message::Message(const std::string &message) {
-    document_.Parse(message.c_str());
+namespace {
+
+/**
+ * @brief SAX handler that accepts only a flat chat or direct message object.
+ * @details Every event that is not part of the expected message falls back
+ * to Default() and stops the parse. A chat message may have a room, a direct
+ * message must have a recipient.
+ */
+class ChatFrameHandler
+    : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>,
+                                          ChatFrameHandler> {
+  public:
+    explicit ChatFrameHandler(bool direct) : direct_(direct) {}
+
+    bool Default() {
+        return false;
+    }
+
+    bool StartObject() {
+        return depth_++ == 0;
+    }
+
+    bool EndObject(rapidjson::SizeType /*member_count*/) {
+        --depth_;
+        return true;
+    }
+
+    bool Key(const char *str, rapidjson::SizeType length, bool /*copy*/) {
+        std::string_view const key(str, length);
+        if (key == "type") {
+            field_ = type_field;
+        } else if (key == "sender") {
+            field_ = sender_field;
+        } else if (key == "text") {
+            field_ = text_field;
+        } else if (key == "room" && !direct_) {
+            field_ = room_field;
+        } else if (key == "to" && direct_) {
+            field_ = to_field;
+        } else {
+            return false;
+        }
+        // Duplicate keys are read differently by different parsers.
+        return (seen_ & field_) == 0;
+    }
+
+    bool String(const char *str, rapidjson::SizeType length, bool /*copy*/) {
+        if (field_ == 0) {
+            return false;
+        }
+        std::string_view const value(str, length);
+        if (field_ == type_field && value != (direct_ ? "direct" : "message")) {
+            return false;
+        }
+        if (field_ == room_field && !Message::is_valid_room(value)) {
+            return false;
+        }
+        if (field_ == to_field && value.empty()) {
+            return false;
+        }
+        if (field_ == room_field || field_ == to_field) {
+            // The value only lives until this callback returns.
+            target_.assign(value);
+        } else if (field_ == sender_field && direct_) {
+            sender_.assign(value);
+        }
+        seen_ |= field_;
+        field_ = 0;
+        return true;
+    }
+
+    [[nodiscard]] bool complete() const {
+        auto const required =
+            type_field | sender_field | text_field | (direct_ ? to_field : 0);
+        return (seen_ & required) == required;
+    }
+
+    std::string &target() {
+        return target_;
+    }
+
+    std::string &sender() {
+        return sender_;
+    }
+
+  private:
+    static constexpr unsigned type_field = 1U << 0U;
+    static constexpr unsigned sender_field = 1U << 1U;
+    static constexpr unsigned text_field = 1U << 2U;
+    static constexpr unsigned room_field = 1U << 3U;
+    static constexpr unsigned to_field = 1U << 4U;
+
+    bool direct_;
+    int depth_ = 0;
+    unsigned field_ = 0;
+    unsigned seen_ = 0;
+    std::string target_;
+    std::string sender_;
+};
+
+/**
+ * @brief The CBOR major types, see RFC 8949 section 3.1.
+ */
+enum CborMajor : std::uint8_t {
+    cbor_unsigned = 0,
+    cbor_negative = 1,
+    cbor_bytes = 2,
+    cbor_text = 3,
+    cbor_array = 4,
+    cbor_map = 5,
+    cbor_tag = 6,
+    cbor_simple = 7,
+};
+
+/**
+ * @brief The additional information of an indefinite length item.
+ */
+constexpr std::uint8_t cbor_indefinite = 31;
+/**
+ * @brief The stop code of an indefinite length item.
+ */
+constexpr std::uint8_t cbor_break = 0xFF;
+
+/**
+ * @brief SAX handler that writes the parsed JSON as CBOR.
+ * @details The head of a map or an array is written when it starts, as an
+ * indefinite length. When it ends with fewer than 24 entries, the head is
+ * patched to a definite length and no stop code is written.
+ */
+class CborWriter
+    : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, CborWriter> {
+  public:
+    explicit CborWriter(std::string &out) : out_(out) {}
+
+    bool Null() {
+        out_.push_back(static_cast<char>(0xF6));
+        return true;
+    }
+
+    bool Bool(bool b) {
+        out_.push_back(static_cast<char>(b ? 0xF5 : 0xF4));
+        return true;
+    }
+
+    bool Int(int i) {
+        return Int64(i);
+    }
+
+    bool Uint(unsigned u) {
+        return Uint64(u);
+    }
+
+    bool Int64(std::int64_t i) {
+        if (i < 0) {
+            // -1 - n, computed without overflowing on the minimum value
+            head(cbor_negative, ~static_cast<std::uint64_t>(i));
+        } else {
+            head(cbor_unsigned, static_cast<std::uint64_t>(i));
+        }
+        return true;
+    }
+
+    bool Uint64(std::uint64_t u) {
+        head(cbor_unsigned, u);
+        return true;
+    }
+
+    bool Double(double d) {
+        std::uint64_t bits = 0;
+        std::memcpy(&bits, &d, sizeof(bits));
+        out_.push_back(static_cast<char>(0xFB));
+        big_endian(bits, sizeof(bits));
+        return true;
+    }
+
+    bool String(const char *str, rapidjson::SizeType length, bool /*copy*/) {
+        head(cbor_text, length);
+        out_.append(str, length);
+        return true;
+    }
+
+    bool Key(const char *str, rapidjson::SizeType length, bool copy) {
+        return String(str, length, copy);
+    }
+
+    bool StartObject() {
+        return start(cbor_map);
+    }
+
+    bool EndObject(rapidjson::SizeType member_count) {
+        return end(cbor_map, member_count);
+    }
+
+    bool StartArray() {
+        return start(cbor_array);
+    }
+
+    bool EndArray(rapidjson::SizeType element_count) {
+        return end(cbor_array, element_count);
+    }
+
+  private:
+    void head(std::uint8_t major, std::uint64_t value) {
+        auto const type = static_cast<std::uint8_t>(major << 5U);
+        if (value < 24) {
+            out_.push_back(static_cast<char>(type | value));
+        } else if (value <= 0xFF) {
+            out_.push_back(static_cast<char>(type | 24U));
+            big_endian(value, 1);
+        } else if (value <= 0xFFFF) {
+            out_.push_back(static_cast<char>(type | 25U));
+            big_endian(value, 2);
+        } else if (value <= 0xFFFFFFFF) {
+            out_.push_back(static_cast<char>(type | 26U));
+            big_endian(value, 4);
+        } else {
+            out_.push_back(static_cast<char>(type | 27U));
+            big_endian(value, 8);
+        }
+    }
+
+    void big_endian(std::uint64_t value, std::size_t size) {
+        for (std::size_t i = size; i > 0; --i) {
+            out_.push_back(static_cast<char>(value >> (8 * (i - 1))));
+        }
+    }
+
+    bool start(std::uint8_t major) {
+        starts_.push_back(out_.size());
+        out_.push_back(
+            static_cast<char>((major << 5U) | cbor_indefinite));
+        return true;
+    }
+
+    bool end(std::uint8_t major, rapidjson::SizeType count) {
+        auto const start = starts_.back();
+        starts_.pop_back();
+        if (count < 24) {
+            out_[start] = static_cast<char>((major << 5U) | count);
+        } else {
+            out_.push_back(static_cast<char>(cbor_break));
+        }
+        return true;
+    }
+
+    std::string &out_;
+    std::vector<std::size_t> starts_;
+};
+
+/**
+ * @brief Recursive CBOR decoder that writes the data items as JSON.
+ */
+class CborReader {
+  public:
+    using Writer =
+        rapidjson::Writer<rapidjson::StringBuffer, rapidjson::UTF8<>,
+                          rapidjson::UTF8<>, rapidjson::CrtAllocator,
+                          rapidjson::kWriteValidateEncodingFlag>;
+
+    explicit CborReader(std::string_view in)
+        : it_(reinterpret_cast<const std::uint8_t *>(in.data())),
+          end_(it_ + in.size()) {}
+
+    /**
+     * @brief Decode exactly one data item.
+     */
+    bool parse(Writer &writer) {
+        return item(writer, 0) && it_ == end_;
+    }
+
+  private:
+    bool read_head(std::uint8_t &major, std::uint8_t &info,
+                   std::uint64_t &value) {
+        if (it_ == end_) {
+            return false;
+        }
+        major = *it_ >> 5U;
+        info = *it_ & 0x1FU;
+        ++it_;
+        value = info;
+        if (info < 24 || info == cbor_indefinite) {
+            return true;
+        }
+        if (info > 27) {
+            return false;
+        }
+        auto const size = std::size_t{1} << (info - 24U);
+        if (static_cast<std::size_t>(end_ - it_) < size) {
+            return false;
+        }
+        value = 0;
+        for (std::size_t i = 0; i < size; ++i) {
+            value = (value << 8U) | *it_++;
+        }
+        return true;
+    }
+
+    bool at_break() {
+        if (it_ != end_ && *it_ == cbor_break) {
+            ++it_;
+            return true;
+        }
+        return false;
+    }
+
+    bool text(std::uint64_t size, bool key, Writer &writer) {
+        if (static_cast<std::uint64_t>(end_ - it_) < size) {
+            return false;
+        }
+        auto const *str = reinterpret_cast<const char *>(it_);
+        auto const length = static_cast<rapidjson::SizeType>(size);
+        it_ += size;
+        return key ? writer.Key(str, length) : writer.String(str, length);
+    }
+
+    bool item(Writer &writer, int depth) {
+        std::uint8_t major = 0;
+        std::uint8_t info = 0;
+        std::uint64_t value = 0;
+        if (depth > Message::max_depth || !read_head(major, info, value)) {
+            return false;
+        }
+        bool const indefinite = info == cbor_indefinite;
+
+        switch (major) {
+        case cbor_unsigned:
+            return !indefinite && writer.Uint64(value);
+
+        case cbor_negative:
+            if (indefinite ||
+                value > static_cast<std::uint64_t>(
+                            std::numeric_limits<std::int64_t>::max())) {
+                return false;
+            }
+            return writer.Int64(-1 - static_cast<std::int64_t>(value));
+
+        case cbor_text:
+            // Chunked strings are not worth supporting
+            return !indefinite && text(value, false, writer);
+
+        case cbor_array: {
+            rapidjson::SizeType count = 0;
+            if (!writer.StartArray()) {
+                return false;
+            }
+            while (indefinite ? !at_break() : count < value) {
+                if (!item(writer, depth + 1)) {
+                    return false;
+                }
+                ++count;
+            }
+            return writer.EndArray(count);
+        }
+
+        case cbor_map: {
+            rapidjson::SizeType count = 0;
+            if (!writer.StartObject()) {
+                return false;
+            }
+            while (indefinite ? !at_break() : count < value) {
+                // JSON only has text keys
+                std::uint8_t key_major = 0;
+                std::uint8_t key_info = 0;
+                std::uint64_t key_size = 0;
+                if (!read_head(key_major, key_info, key_size) ||
+                    key_major != cbor_text || key_info == cbor_indefinite ||
+                    !text(key_size, true, writer) || !item(writer, depth + 1)) {
+                    return false;
+                }
+                ++count;
+            }
+            return writer.EndObject(count);
+        }
+
+        case cbor_simple:
+            switch (info) {
+            case 20:
+                return writer.Bool(false);
+            case 21:
+                return writer.Bool(true);
+            case 22:
+                return writer.Null();
+            case 26: {
+                auto const bits = static_cast<std::uint32_t>(value);
+                float f = 0;
+                std::memcpy(&f, &bits, sizeof(f));
+                return writer.Double(f);
+            }
+            case 27: {
+                double d = 0;
+                std::memcpy(&d, &value, sizeof(d));
+                // The writer rejects NaN and infinity, which JSON lacks
+                return writer.Double(d);
+            }
+            default:
+                return false;
+            }
+
+        default:
+            // Byte strings and tags have no JSON equivalent
+            return false;
+        }
+    }
+
+    const std::uint8_t *it_;
+    const std::uint8_t *end_;
+};
+
+} // namespace
+
+/**
+ * @brief The text and the memory a message is parsed into.
+ * @details Every thread has one arena, taken by one message at a time. The
+ * pool allocates from a chunk made once, and the text keeps its capacity, so
+ * a message that fits does not allocate. Only a larger message makes the pool
+ * allocate more chunks, which are freed when the arena is reset.
+ */
+class Message::Arena {
+  public:
+    /**
+     * @brief The size of the chunk the pool allocates from first.
+     */
+    static constexpr std::size_t chunk_size = 64 * 1024;
+    /**
+     * @brief The initial capacity of the parse stack, in bytes.
+     */
+    static constexpr std::size_t stack_capacity = 1024;
+
+    explicit Arena(bool owned)
+        : owned(owned), chunk(std::make_unique<char[]>(chunk_size)),
+          pool(chunk.get(), chunk_size) {
+        text.reserve(max_size + 1);
+    }
+
+    /**
+     * @brief Take the arena of the thread, or make one if it is taken.
+     *
+     * @return Arena* The arena, to be released with ArenaRelease.
+     */
+    static Arena *acquire() {
+        thread_local Arena arena(false);
+        if (!arena.busy.exchange(true, std::memory_order_acquire)) {
+            return &arena;
+        }
+        return new Arena(true);
+    }
+
+    /**
+     * @brief Whether the arena belongs to one message, instead of a thread.
+     */
+    const bool owned;
+    /**
+     * @brief Whether a message holds the arena.
+     * @details Atomic, since a message may be destroyed on another thread.
+     */
+    std::atomic<bool> busy{false};
+    /**
+     * @brief The first chunk of the pool.
+     */
+    std::unique_ptr<char[]> chunk;
+    /**
+     * @brief The pool of the values and the parse stack.
+     */
+    rapidjson::MemoryPoolAllocator<> pool;
+    /**
+     * @brief The text parsed in place.
+     */
+    std::string text;
+};
+
+void Message::ArenaRelease::operator()(Arena *arena) const {
+    if (arena->owned) {
+        delete arena;
+        return;
+    }
+    arena->pool.Clear();
+    arena->busy.store(false, std::memory_order_release);
+}
+
+Message::Message(std::string_view message)
+    : arena_(Arena::acquire()),
+      document_(&arena_->pool, Arena::stack_capacity, &arena_->pool) {
+    arena_->text.assign(message);
+    document_.ParseInsitu(arena_->text.data());
+}
+
+bool Message::is_chat_frame(std::string_view frame, std::string &room) {
+    return scan_frame(frame, false, room, nullptr);
+}
+
+bool Message::is_direct_frame(std::string_view frame, std::string &to,
+                              std::string &sender) {
+    return scan_frame(frame, true, to, &sender);
+}
+
+bool Message::scan_frame(std::string_view frame, bool direct,
+                         std::string &target, std::string *sender) {
+    if (frame.empty() || frame.size() > max_size) {
+        return false;
+    }
+
+    // The parse stack comes from the arena of the thread too
+    std::unique_ptr<Arena, ArenaRelease> const arena(Arena::acquire());
+    rapidjson::MemoryStream stream(frame.data(), frame.size());
+    ChatFrameHandler handler(direct);
+    rapidjson::GenericReader<rapidjson::UTF8<>, rapidjson::UTF8<>,
+                             rapidjson::MemoryPoolAllocator<>>
+        reader(&arena->pool);
+    if (!reader.Parse<rapidjson::kParseValidateEncodingFlag>(stream,
+                                                             handler)) {
+        return false;
+    }
+    if (!handler.complete()) {
+        return false;
+    }
+    target = std::move(handler.target());
+    if (sender != nullptr) {
+        *sender = std::move(handler.sender());
+    }
+    return true;
+}
+
+bool Message::to_cbor(std::string_view json, std::string &cbor) {
+    cbor.clear();
+    cbor.reserve(json.size());
+
+    rapidjson::MemoryStream stream(json.data(), json.size());
+    CborWriter writer(cbor);
+    rapidjson::Reader reader;
+    return static_cast<bool>(
+        reader.Parse<rapidjson::kParseValidateEncodingFlag>(stream, writer));
+}
+
+bool Message::from_cbor(std::string_view cbor, std::string &json) {
+    rapidjson::StringBuffer buffer;
+    CborReader::Writer writer(buffer);
+    CborReader reader(cbor);
+    if (!reader.parse(writer)) {
+        return false;
+    }
+    json.assign(buffer.GetString(), buffer.GetSize());
+    return true;
+}
+
+bool Message::is_valid_room(std::string_view room) {
+    if (room.empty() || room.size() > max_room_size) {
+        return false;
+    }
+    return std::all_of(room.begin(), room.end(), [](char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+               (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.';
+    });
 }
 
 std::string Message::stringify() const {
@@ -27,17 +585,73 @@ std::string Message::stringify() const {
 }
 
 bool Message::is_login_info() const {
-    return document_["type"] == "login";
+    return has_type("login");
 }
 
 bool Message::is_chat_message() const {
-    return document_["type"] == "message";
+    return has_type("message");
+}
+
+bool Message::is_join_request() const {
+    return has_type("join");
+}
+
+bool Message::is_leave_request() const {
+    return has_type("leave");
+}
+
+bool Message::is_subscribe_request() const {
+    return has_type("subscribe");
+}
+
+bool Message::is_user_list_request() const {
+    return has_type("user_list");
+}
+
+bool Message::has_type(const char *type) const {
+    if (document_.HasParseError() || !document_.IsObject()) {
+        return false;
+    }
+    auto const it = document_.FindMember("type");
+    return it != document_.MemberEnd() && it->value.IsString() &&
+           it->value == type;
 }
 
 std::string Message::get_username() const {
-    return document_["username"].GetString();
+    auto const it = document_.FindMember("username");
+    if (it == document_.MemberEnd() || !it->value.IsString()) {
+        return {};
+    }
+    return {it->value.GetString(), it->value.GetStringLength()};
 }
 
 std::string Message::get_message() const {
     return document_["text"].GetString();
+}
+
+std::string Message::get_room() const {
+    auto const it = document_.FindMember("room");
+    if (it == document_.MemberEnd() || !it->value.IsString()) {
+        return {};
+    }
+    std::string room(it->value.GetString(), it->value.GetStringLength());
+    return is_valid_room(room) ? room : std::string();
+}
+
+std::vector<std::string> Message::get_rooms() const {
+    std::vector<std::string> rooms;
+    auto const it = document_.FindMember("rooms");
+    if (it == document_.MemberEnd() || !it->value.IsArray()) {
+        return rooms;
+    }
+    for (const auto &value : it->value.GetArray()) {
+        if (!value.IsString()) {
+            continue;
+        }
+        std::string room(value.GetString(), value.GetStringLength());
+        if (is_valid_room(room)) {
+            rooms.push_back(std::move(room));
+        }
+    }
+    return rooms;
 }
\ No newline at end of file
@@ -11,24 +11,52 @@
 
 #pragma once
 
+#include <memory>
+#include <rapidjson/allocators.h>
 #include <rapidjson/document.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 #include <string>
+#include <string_view>
+#include <vector>
 
 /**
  * @brief Message class. Parse and stringify message.
  * @details Message class. Parse and stringify message. Message is a JSON
- * string. Message class use rapidjson to parse and stringify message.
+ * string. Message class use rapidjson to parse and stringify message. Clients
+ * that negotiated the binary protocol send and receive the same messages as
+ * CBOR, which is transcoded to and from JSON at the edge.
+ *
+ * A message parses in place, in a per-thread arena: a copy of the text and a
+ * memory pool that are reset and reused when the message is destroyed, so
+ * parsing does not allocate in the steady state.
+ * @see Message::to_cbor
+ * @see Message::from_cbor
  */
 class Message {
   public:
+    /**
+     * @brief The maximum size of a message received from a client, in bytes.
+     */
+    static constexpr std::size_t max_size = 64 * 1024;
+    /**
+     * @brief The maximum length of a room name, in bytes.
+     */
+    static constexpr std::size_t max_room_size = 64;
+    /**
+     * @brief The maximum nesting of a CBOR message received from a client.
+     */
+    static constexpr int max_depth = 32;
+
     /**
      * @brief Construct a new Message object
+     * @details Copy the message to the arena of the thread, and parse it in
+     * place. If the arena of the thread is taken by another message, the
+     * message gets an arena of its own.
      *
      * @param message Message string, in JSON format.
      */
-    explicit Message(const std::string &message);
+    explicit Message(std::string_view message);
 
     /**
      * @brief Stringify message.
@@ -52,10 +80,114 @@ class Message {
      */
     [[nodiscard]] bool is_chat_message() const;
 
+    /**
+     * @brief Check if a raw frame is a well-formed chat message.
+     * @details Validate the frame without building a document. The frame must
+     * be a flat JSON object holding exactly the string fields "type",
+     * "sender" and "text", with "type" equal to "message", and optionally a
+     * valid "room" field. The frame must be valid UTF-8 and must not exceed
+     * max_size. A frame that passes this check can be forwarded to the other
+     * clients unchanged.
+     * @see Message::is_valid_room
+     *
+     * @param frame The raw frame received from a client.
+     * @param room Receive the room of the message, or an empty string if the
+     * message is for everyone.
+     * @return true The frame is a chat message, and it can be forwarded as is.
+     * @return false The frame needs a full parse.
+     */
+    [[nodiscard]] static bool is_chat_frame(std::string_view frame,
+                                            std::string &room);
+    /**
+     * @brief Check if a raw frame is a well-formed direct message.
+     * @details Validate the frame as is_chat_frame() does. The frame must
+     * hold exactly the string fields "type", "sender", "text" and "to", with
+     * "type" equal to "direct" and a non-empty "to". A frame that passes this
+     * check can be forwarded to its recipient unchanged.
+     * @see State::send_to_user
+     *
+     * @param frame The raw frame received from a client.
+     * @param to Receive the name of the recipient.
+     * @param sender Receive the name of the sender, as the client wrote it.
+     * @return true The frame is a direct message, and it can be forwarded as
+     * is.
+     * @return false The frame needs a full parse.
+     */
+    [[nodiscard]] static bool is_direct_frame(std::string_view frame,
+                                              std::string &to,
+                                              std::string &sender);
+    /**
+     * @brief Check if a room name is valid.
+     * @details A room name is 1 to max_room_size characters among letters,
+     * digits, '-', '_' and '.', so it never needs escaping in JSON.
+     *
+     * @param room The room name.
+     * @return true The room name is valid.
+     * @return false The room name is invalid.
+     */
+    [[nodiscard]] static bool is_valid_room(std::string_view room);
+
+    /**
+     * @brief Transcode a JSON message to CBOR.
+     * @details Stream the JSON text to CBOR without building a document. Maps
+     * and arrays of fewer than 24 entries get a definite length, larger ones
+     * an indefinite length.
+     * @see https://www.rfc-editor.org/rfc/rfc8949
+     *
+     * @param json The JSON message.
+     * @param cbor Receive the CBOR message.
+     * @return true The message was transcoded.
+     * @return false The JSON text is invalid.
+     */
+    [[nodiscard]] static bool to_cbor(std::string_view json, std::string &cbor);
+    /**
+     * @brief Transcode a CBOR message to compact JSON.
+     * @details Only the CBOR data items that have a JSON equivalent are
+     * accepted: integers, text strings, arrays, maps with text string keys,
+     * booleans, null and single or double precision floats. Strings must be
+     * valid UTF-8, and nesting is limited to max_depth.
+     *
+     * @param cbor The CBOR message.
+     * @param json Receive the JSON message.
+     * @return true The message was transcoded.
+     * @return false The CBOR data is invalid, or has no JSON equivalent.
+     */
+    [[nodiscard]] static bool from_cbor(std::string_view cbor,
+                                        std::string &json);
+
+    /**
+     * @brief Check if message is a request to join a room.
+     *
+     * @return true Message is a join request.
+     * @return false Message is not a join request.
+     */
+    [[nodiscard]] bool is_join_request() const;
+    /**
+     * @brief Check if message is a request to leave a room.
+     *
+     * @return true Message is a leave request.
+     * @return false Message is not a leave request.
+     */
+    [[nodiscard]] bool is_leave_request() const;
+    /**
+     * @brief Check if message is a request to join several rooms at once.
+     *
+     * @return true Message is a subscribe request.
+     * @return false Message is not a subscribe request.
+     */
+    [[nodiscard]] bool is_subscribe_request() const;
+    /**
+     * @brief Check if message is a request for the list of online users.
+     *
+     * @return true Message is a user list request.
+     * @return false Message is not a user list request.
+     */
+    [[nodiscard]] bool is_user_list_request() const;
+
     /**
      * @brief Get username from login info.
      *
-     * @return std::string Username.
+     * @return std::string Username, or an empty string if it is missing.
      */
     [[nodiscard]] std::string get_username() const;
     /**
@@ -64,10 +196,73 @@ class Message {
      * @return std::string Message.
      */
     [[nodiscard]] std::string get_message() const;
+    /**
+     * @brief Get room from a join or leave request.
+     *
+     * @return std::string Room, or an empty string if it is missing or
+     * invalid.
+     */
+    [[nodiscard]] std::string get_room() const;
+    /**
+     * @brief Get rooms from a subscribe request.
+     * @details Invalid room names are skipped.
+     *
+     * @return std::vector<std::string> Rooms.
+     */
+    [[nodiscard]] std::vector<std::string> get_rooms() const;
 
   private:
+    /**
+     * @brief The text and the memory a message is parsed into.
+     */
+    class Arena;
+    /**
+     * @brief Validate a chat or a direct message without building a document.
+     * @see Message::is_chat_frame
+     * @see Message::is_direct_frame
+     *
+     * @param frame The raw frame received from a client.
+     * @param direct Whether a direct message is expected.
+     * @param target Receive the room, or the recipient.
+     * @param sender Receive the sender of a direct message, if not null.
+     * @return true The frame is the expected message.
+     * @return false The frame needs a full parse.
+     */
+    static bool scan_frame(std::string_view frame, bool direct,
+                           std::string &target, std::string *sender);
+    /**
+     * @brief Return an arena to its thread, or delete it.
+     */
+    struct ArenaRelease {
+        void operator()(Arena *arena) const;
+    };
+    /**
+     * @brief A document that allocates its values and its parse stack from
+     * an arena.
+     */
+    using Document =
+        rapidjson::GenericDocument<rapidjson::UTF8<>,
+                                   rapidjson::MemoryPoolAllocator<>,
+                                   rapidjson::MemoryPoolAllocator<>>;
+
+    /**
+     * @brief Check the type field of the message.
+     * @details A message that failed to parse, or has no string "type" field,
+     * has no type.
+     *
+     * @param type The expected type.
+     * @return true The message has the given type.
+     * @return false The message has another type, or no type at all.
+     */
+    [[nodiscard]] bool has_type(const char *type) const;
+
+    /**
+     * @brief The arena of the message.
+     * @details Declared before the document, which points into it.
+     */
+    std::unique_ptr<Arena, ArenaRelease> arena_;
     /**
      * @brief Rapidjson document.
      */
-    rapidjson::Document document_;
+    Document document_;
 };
\ No newline at end of file
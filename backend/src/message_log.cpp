@@ -0,0 +1,606 @@
+/**
+ * @file message_log.cpp
+ * @brief MessageLog class implementation.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-17
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#include "message_log.h"
+#include "frame.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <boost/crc.hpp>
+#include <cerrno>
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+/**
+ * @brief The size of a record header.
+ * @details crc32 (4), payload size (4), sequence (8), timestamp (8), room size
+ * (2) and padding (2), little-endian. The checksum covers the rest of the
+ * record.
+ */
+constexpr std::uint64_t header_size = 28;
+/**
+ * @brief The size of an index entry: sequence, timestamp and offset.
+ */
+constexpr std::uint64_t index_entry_size = 24;
+
+/**
+ * @brief A record read from a segment.
+ */
+struct Record {
+    std::uint64_t sequence;
+    std::string_view room;
+    std::string_view payload;
+};
+
+/**
+ * @brief Get the error of the last system call.
+ *
+ * @return beast::error_code The error.
+ */
+beast::error_code last_error() {
+    return {errno, boost::system::system_category()};
+}
+
+/**
+ * @brief Append an unsigned integer, little-endian.
+ *
+ * @param out The buffer.
+ * @param value The value.
+ */
+template <typename T> void put(std::string &out, T value) {
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+/**
+ * @brief Read an unsigned integer, little-endian.
+ *
+ * @param in The bytes.
+ * @return T The value.
+ */
+template <typename T> T get(const unsigned char *in) {
+    T value = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        value |= static_cast<T>(in[i]) << (8 * i);
+    }
+    return value;
+}
+
+/**
+ * @brief Checksum the end of a record.
+ *
+ * @param data The record, after its checksum.
+ * @param size The size of the record, without its checksum.
+ * @return std::uint32_t The checksum.
+ */
+std::uint32_t checksum(const void *data, std::size_t size) {
+    boost::crc_32_type crc;
+    crc.process_bytes(data, size);
+    return crc.checksum();
+}
+
+/**
+ * @brief Parse the record at an offset.
+ *
+ * @param data The segment.
+ * @param size The size of the segment.
+ * @param offset The offset of the record.
+ * @param record Receive the record.
+ * @return std::uint64_t The offset after the record, or 0 if there is no
+ * valid record at the offset.
+ */
+std::uint64_t parse(const unsigned char *data, std::uint64_t size,
+                    std::uint64_t offset, Record &record) {
+    if (size - offset < header_size) {
+        return 0;
+    }
+    auto const *header = data + offset;
+    auto const payload_size = get<std::uint32_t>(header + 4);
+    auto const room_size = get<std::uint16_t>(header + 24);
+    auto const end = offset + header_size + room_size + payload_size;
+    if (end > size ||
+        checksum(header + 4, end - offset - 4) != get<std::uint32_t>(header)) {
+        return 0;
+    }
+    auto const *room = reinterpret_cast<const char *>(header + header_size);
+    record.sequence = get<std::uint64_t>(header + 8);
+    record.room = {room, room_size};
+    record.payload = {room + room_size, payload_size};
+    return end;
+}
+
+/**
+ * @brief Write a whole buffer.
+ *
+ * @param fd The file descriptor.
+ * @param data The buffer.
+ * @param ec Receive the error, if any.
+ */
+void write_all(int fd, const std::string &data, beast::error_code &ec) {
+    const char *next = data.data();
+    std::size_t left = data.size();
+    while (left > 0) {
+        auto const written = ::write(fd, next, left);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ec = last_error();
+            return;
+        }
+        next += written;
+        left -= static_cast<std::size_t>(written);
+    }
+}
+
+/**
+ * @brief A file opened for reading, closed on destruction.
+ */
+class ReadFile {
+  public:
+    explicit ReadFile(const std::filesystem::path &path)
+        : fd_(::open(path.c_str(), O_RDONLY | O_CLOEXEC)) {}
+    ReadFile(const ReadFile &) = delete;
+    ReadFile &operator=(const ReadFile &) = delete;
+    ~ReadFile() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    [[nodiscard]] int fd() const {
+        return fd_;
+    }
+
+  private:
+    int fd_;
+};
+
+/**
+ * @brief A read-only mapping of a file, unmapped on destruction.
+ */
+class Mapping {
+  public:
+    Mapping(int fd, std::uint64_t size)
+        : size_(size),
+          data_(size == 0 ? MAP_FAILED
+                          : ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd,
+                                   0)) {}
+    Mapping(const Mapping &) = delete;
+    Mapping &operator=(const Mapping &) = delete;
+    ~Mapping() {
+        if (data_ != MAP_FAILED) {
+            ::munmap(data_, size_);
+        }
+    }
+
+    [[nodiscard]] const unsigned char *data() const {
+        return data_ == MAP_FAILED ? nullptr
+                                   : static_cast<const unsigned char *>(data_);
+    }
+
+  private:
+    std::uint64_t size_;
+    void *data_;
+};
+
+/**
+ * @brief Get the path of the records of a segment.
+ *
+ * @param directory The log directory.
+ * @param first The sequence number of the first record.
+ * @return std::filesystem::path The path.
+ */
+std::filesystem::path segment_path(const std::filesystem::path &directory,
+                                   std::uint64_t first) {
+    return directory / fmt::format("{:020}.log", first);
+}
+
+/**
+ * @brief Get the path of the index of a segment.
+ *
+ * @param path The path of the records.
+ * @return std::filesystem::path The path.
+ */
+std::filesystem::path index_path(std::filesystem::path path) {
+    return path.replace_extension(".idx");
+}
+
+} // namespace
+
+std::shared_ptr<MessageLog> MessageLog::open(const Config &config,
+                                             beast::error_code &ec) {
+    std::shared_ptr<MessageLog> log(new MessageLog(config));
+    log->recover(ec);
+    if (ec) {
+        return nullptr;
+    }
+    log->thread_ = std::thread([log = log.get()] { log->run(); });
+    return log;
+}
+
+MessageLog::MessageLog(const Config &config)
+    : directory_(config.log_dir), segment_size_(config.log_segment_size),
+      sync_interval_(config.log_sync_interval) {}
+
+MessageLog::~MessageLog() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_one();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+
+    if (index_fd_ >= 0) {
+        ::fsync(index_fd_);
+        ::close(index_fd_);
+    }
+    if (log_fd_ >= 0) {
+        ::close(log_fd_);
+    }
+}
+
+void MessageLog::append(PassFrame frame) {
+    auto const timestamp =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch());
+
+    bool full = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.push_back(
+            {frame, static_cast<std::uint64_t>(timestamp.count())});
+        full = pending_.size() == max_pending;
+    }
+    if (full) {
+        wake_.notify_one();
+    }
+}
+
+Replay MessageLog::recent(std::size_t count) const {
+    std::vector<Segment> segments;
+    std::uint64_t next = 0;
+    std::uint64_t committed = 0;
+    {
+        std::lock_guard<std::mutex> lock(segments_mutex_);
+        segments = segments_;
+        next = next_;
+        committed = committed_;
+    }
+
+    Replay frames;
+    auto const from = next > count ? next - count : 0;
+    // Start with the segment that holds the first frame
+    auto first = segments.size();
+    while (first > 1 && segments[first - 1].first > from) {
+        --first;
+    }
+    for (auto i = first - 1; i < segments.size(); ++i) {
+        auto const end = i + 1 < segments.size() ? segments[i + 1].first : next;
+        if (end <= segments[i].first || end <= from) {
+            continue;
+        }
+
+        std::uint64_t size = committed;
+        if (i + 1 < segments.size()) {
+            std::error_code code;
+            size = std::filesystem::file_size(segments[i].path, code);
+            if (code) {
+                continue;
+            }
+        }
+        read(segments[i], end - 1, size, std::max(from, segments[i].first),
+             frames);
+    }
+    return frames;
+}
+
+void MessageLog::recover(beast::error_code &ec) {
+    std::error_code code;
+    std::filesystem::create_directories(directory_, code);
+    for (const auto &entry :
+         std::filesystem::directory_iterator(directory_, code)) {
+        auto const &path = entry.path();
+        auto const stem = path.stem().string();
+        if (path.extension() != ".log" || stem.empty() ||
+            !std::all_of(stem.begin(), stem.end(),
+                         [](char c) { return c >= '0' && c <= '9'; })) {
+            continue;
+        }
+        segments_.push_back({std::stoull(stem), path});
+    }
+    if (code) {
+        ec = {code.value(), boost::system::system_category()};
+        return;
+    }
+    std::sort(segments_.begin(), segments_.end(),
+              [](const Segment &a, const Segment &b) {
+                  return a.first < b.first;
+              });
+    if (segments_.empty()) {
+        segments_.push_back({0, segment_path(directory_, 0)});
+    }
+
+    auto const &last = segments_.back();
+    open_segment(last, ec);
+    if (ec) {
+        return;
+    }
+
+    struct stat status {};
+    if (::fstat(log_fd_, &status) != 0) {
+        ec = last_error();
+        return;
+    }
+    auto const size = static_cast<std::uint64_t>(status.st_size);
+
+    // Only the records after the last index entry need checking
+    auto entries = read_index(last);
+    while (!entries.empty() && entries.back().offset >= size) {
+        entries.pop_back();
+    }
+    std::uint64_t offset = entries.empty() ? 0 : entries.back().offset;
+    next_ = entries.empty() ? last.first : entries.back().sequence;
+    {
+        Mapping const mapping(log_fd_, size);
+        Record record{};
+        while (mapping.data() != nullptr && offset < size) {
+            auto const end = parse(mapping.data(), size, offset, record);
+            if (end == 0 || record.sequence != next_) {
+                break;
+            }
+            offset = end;
+            ++next_;
+        }
+    }
+
+    // Drop a torn record, and the index entries past it
+    if ((offset < size &&
+         ::ftruncate(log_fd_, static_cast<off_t>(offset)) != 0) ||
+        ::ftruncate(index_fd_, static_cast<off_t>(entries.size() *
+                                                  index_entry_size)) != 0 ||
+        ::lseek(log_fd_, 0, SEEK_END) < 0 ||
+        ::lseek(index_fd_, 0, SEEK_END) < 0) {
+        ec = last_error();
+        return;
+    }
+    sequence_ = next_;
+    size_ = committed_ = offset;
+    indexed_ = index_written_ = entries.empty() ? 0 : entries.back().offset;
+}
+
+void MessageLog::open_segment(const Segment &segment, beast::error_code &ec) {
+    log_fd_ = ::open(segment.path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (log_fd_ < 0) {
+        ec = last_error();
+        return;
+    }
+    index_fd_ = ::open(index_path(segment.path).c_str(),
+                       O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (index_fd_ < 0) {
+        ec = last_error();
+    }
+}
+
+void MessageLog::roll(beast::error_code &ec) {
+    flush(ec);
+    if (ec) {
+        return;
+    }
+    // The index of a closed segment is never written again
+    ::fsync(index_fd_);
+    ::close(index_fd_);
+    ::close(log_fd_);
+
+    Segment const segment{sequence_, segment_path(directory_, sequence_)};
+    open_segment(segment, ec);
+    if (ec) {
+        return;
+    }
+    // Make the new files durable
+    ReadFile const directory(directory_);
+    ::fsync(directory.fd());
+
+    size_ = 0;
+    indexed_ = index_written_ = 0;
+    std::lock_guard<std::mutex> lock(segments_mutex_);
+    segments_.push_back(segment);
+    committed_ = 0;
+}
+
+void MessageLog::run() {
+    std::vector<Pending> batch;
+    for (;;) {
+        bool stop = false;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait_for(lock, sync_interval_, [this] {
+                return stop_ || pending_.size() >= max_pending;
+            });
+            batch.swap(pending_);
+            stop = stop_;
+        }
+
+        if (!batch.empty()) {
+            beast::error_code ec;
+            commit(batch, ec);
+            if (ec) {
+                fail(ec, "log");
+            }
+            batch.clear();
+        }
+        if (stop) {
+            return;
+        }
+    }
+}
+
+void MessageLog::commit(const std::vector<Pending> &batch,
+                        beast::error_code &ec) {
+    for (const auto &pending : batch) {
+        auto const &frame = *pending.frame;
+        auto const record_size =
+            header_size + frame.room().size() + frame.size();
+        if (size_ > 0 && size_ + record_size > segment_size_) {
+            roll(ec);
+            if (ec) {
+                return;
+            }
+        }
+
+        if (size_ >= indexed_ + index_interval) {
+            put(index_, sequence_);
+            put(index_, pending.timestamp);
+            put(index_, size_);
+            indexed_ = size_;
+        }
+
+        auto const start = records_.size();
+        put(records_, std::uint32_t{0});
+        put(records_, static_cast<std::uint32_t>(frame.size()));
+        put(records_, sequence_);
+        put(records_, pending.timestamp);
+        put(records_, static_cast<std::uint16_t>(frame.room().size()));
+        put(records_, std::uint16_t{0});
+        records_.append(frame.room());
+        records_.append(frame.payload());
+        auto const crc = checksum(records_.data() + start + 4,
+                                  records_.size() - start - 4);
+        for (std::size_t i = 0; i < 4; ++i) {
+            records_[start + i] = static_cast<char>(crc >> (8 * i));
+        }
+
+        size_ += record_size;
+        ++sequence_;
+    }
+    flush(ec);
+    if (!ec) {
+        bump(metrics().log_records, batch.size());
+    }
+}
+
+void MessageLog::flush(beast::error_code &ec) {
+    if (records_.empty()) {
+        return;
+    }
+
+    write_all(log_fd_, records_, ec);
+    if (!ec && ::fdatasync(log_fd_) != 0) {
+        ec = last_error();
+    }
+    records_.clear();
+    if (ec) {
+        // Forget the batch, and whatever part of it reached the segment. Its
+        // index entries were not written.
+        index_.clear();
+        size_ = committed_;
+        sequence_ = next_;
+        indexed_ = index_written_;
+        if (::ftruncate(log_fd_, static_cast<off_t>(size_)) == 0) {
+            ::lseek(log_fd_, 0, SEEK_END);
+        }
+        return;
+    }
+
+    // The records are durable. A lost index entry only makes the next
+    // recovery scan longer, but a torn one would be read as an entry.
+    beast::error_code index_ec;
+    write_all(index_fd_, index_, index_ec);
+    index_.clear();
+    if (index_ec) {
+        fail(index_ec, "log index");
+        struct stat status {};
+        if (::fstat(index_fd_, &status) == 0) {
+            auto const whole = static_cast<std::uint64_t>(status.st_size) /
+                               index_entry_size * index_entry_size;
+            if (::ftruncate(index_fd_, static_cast<off_t>(whole)) == 0) {
+                ::lseek(index_fd_, 0, SEEK_END);
+            }
+        }
+    }
+    index_written_ = indexed_;
+
+    bump(metrics().log_commits);
+    std::lock_guard<std::mutex> lock(segments_mutex_);
+    next_ = sequence_;
+    committed_ = size_;
+}
+
+void MessageLog::read(const Segment &segment, std::uint64_t last,
+                      std::uint64_t size, std::uint64_t from, Replay &frames) {
+    // Start at the last index entry before the first frame
+    auto const entries = read_index(segment);
+    auto it = std::upper_bound(
+        entries.begin(), entries.end(), from,
+        [](std::uint64_t sequence, const IndexEntry &entry) {
+            return sequence < entry.sequence;
+        });
+    std::uint64_t offset = 0;
+    std::uint64_t sequence = segment.first;
+    if (it != entries.begin() && std::prev(it)->offset < size) {
+        offset = std::prev(it)->offset;
+        sequence = std::prev(it)->sequence;
+    }
+
+    ReadFile const file(segment.path);
+    Mapping const mapping(file.fd(), size);
+    if (mapping.data() == nullptr) {
+        return;
+    }
+    Record record{};
+    while (sequence <= last && offset < size) {
+        auto const end = parse(mapping.data(), size, offset, record);
+        if (end == 0 || record.sequence != sequence) {
+            return;
+        }
+        if (sequence >= from) {
+            frames.push_back(std::make_shared<const Frame>(
+                std::string(record.payload), std::string(record.room)));
+        }
+        offset = end;
+        ++sequence;
+    }
+}
+
+std::vector<MessageLog::IndexEntry>
+MessageLog::read_index(const Segment &segment) {
+    std::vector<IndexEntry> entries;
+    ReadFile const file(index_path(segment.path));
+    struct stat status {};
+    if (file.fd() < 0 || ::fstat(file.fd(), &status) != 0) {
+        return entries;
+    }
+
+    std::string data(static_cast<std::size_t>(status.st_size), '\0');
+    auto const bytes = ::pread(file.fd(), data.data(), data.size(), 0);
+    if (bytes < 0) {
+        return entries;
+    }
+    auto const *in = reinterpret_cast<const unsigned char *>(data.data());
+    auto const count = static_cast<std::uint64_t>(bytes) / index_entry_size;
+    entries.reserve(count);
+    for (std::uint64_t i = 0; i < count; ++i) {
+        auto const *entry = in + i * index_entry_size;
+        entries.push_back({get<std::uint64_t>(entry),
+                           get<std::uint64_t>(entry + 8),
+                           get<std::uint64_t>(entry + 16)});
+    }
+    return entries;
+}
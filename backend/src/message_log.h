@@ -0,0 +1,294 @@
+/**
+ * @file message_log.h
+ * @brief MessageLog class definition. A durable, segmented, append-only log of
+ * chat messages.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-17
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#pragma once
+
+#include "base.h"
+#include "config.h"
+#include "state.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief MessageLog class, the durable log of chat messages.
+ * @details The log is a directory of segments. A segment is a file of
+ * records named after the sequence number of its first record, and a sparse
+ * index of (sequence, timestamp, offset) entries, one every index_interval
+ * bytes of records. A record is a checksummed header followed by the room and
+ * the payload of a frame.
+ *
+ * Frames are appended by the io threads to a pending list, without any system
+ * call. A log thread writes the pending frames with one write, and makes them
+ * durable with one fdatasync, every sync interval: a group commit. A frame is
+ * broadcast before it is durable.
+ *
+ * On startup, only the last segment is checked, from its last index entry,
+ * and a torn record at its end is truncated. Reads map the segments, so they
+ * never touch the io threads or the log thread.
+ * @see State::set_log
+ */
+class MessageLog {
+  public:
+    /**
+     * @brief Open the log, and start its thread.
+     * @details Create the directory if needed, and recover the last segment.
+     *
+     * @param config The server settings. The log directory must be set.
+     * @param ec Receive the error, if any.
+     * @return std::shared_ptr<MessageLog> The log, or nullptr on error.
+     */
+    static std::shared_ptr<MessageLog> open(const Config &config,
+                                            beast::error_code &ec);
+
+    MessageLog(const MessageLog &) = delete;
+    MessageLog &operator=(const MessageLog &) = delete;
+    /**
+     * @brief Destroy the MessageLog object.
+     * @details Commit the pending frames, stop the thread and close the
+     * segment.
+     */
+    ~MessageLog();
+
+    /**
+     * @brief Append a frame to the log.
+     * @details This method is thread-safe. It only stamps the frame and adds
+     * it to the pending list. The log thread is woken up early only when the
+     * pending list is full.
+     *
+     * @param frame The frame to be appended.
+     */
+    void append(PassFrame frame);
+    /**
+     * @brief Read the most recent frames.
+     * @details This method is thread-safe. Only the committed records are
+     * read. The index of each segment locates the first record to read, so
+     * only the records that are returned are visited.
+     *
+     * @param count The maximum number of frames.
+     * @return Replay The frames, oldest first.
+     */
+    [[nodiscard]] Replay recent(std::size_t count) const;
+
+  private:
+    /**
+     * @brief The number of bytes of records between two index entries.
+     */
+    static constexpr std::uint64_t index_interval = 4096;
+    /**
+     * @brief The number of pending frames that wakes the log thread early.
+     */
+    static constexpr std::size_t max_pending = 4096;
+
+    /**
+     * @brief A segment of the log.
+     */
+    struct Segment {
+        /**
+         * @brief The sequence number of the first record.
+         */
+        std::uint64_t first;
+        /**
+         * @brief The path of the records, the index has the same stem.
+         */
+        std::filesystem::path path;
+    };
+
+    /**
+     * @brief An entry of the sparse index.
+     */
+    struct IndexEntry {
+        std::uint64_t sequence;
+        std::uint64_t timestamp;
+        std::uint64_t offset;
+    };
+
+    /**
+     * @brief A frame waiting for the log thread.
+     */
+    struct Pending {
+        std::shared_ptr<const Frame> frame;
+        /**
+         * @brief The time the frame was appended, in microseconds since the
+         * epoch.
+         */
+        std::uint64_t timestamp;
+    };
+
+    /**
+     * @brief Construct a new MessageLog object.
+     *
+     * @param config The server settings.
+     */
+    explicit MessageLog(const Config &config);
+
+    /**
+     * @brief Find the segments, and recover the last one.
+     * @details Scan the last segment from its last index entry, truncate it
+     * after the last valid record, and open it for writing.
+     *
+     * @param ec Receive the error, if any.
+     */
+    void recover(beast::error_code &ec);
+    /**
+     * @brief Open a segment for writing.
+     *
+     * @param segment The segment.
+     * @param ec Receive the error, if any.
+     */
+    void open_segment(const Segment &segment, beast::error_code &ec);
+    /**
+     * @brief Make the active segment durable, and start a new one.
+     *
+     * @param ec Receive the error, if any.
+     */
+    void roll(beast::error_code &ec);
+    /**
+     * @brief Run the log thread.
+     * @details Wait for a sync interval, or for the pending list to fill up,
+     * then commit the pending frames.
+     */
+    void run();
+    /**
+     * @brief Write a batch of frames, and make them durable.
+     *
+     * @param batch The frames.
+     * @param ec Receive the error, if any.
+     */
+    void commit(const std::vector<Pending> &batch, beast::error_code &ec);
+    /**
+     * @brief Write and sync the buffered records and index entries.
+     * @details If the records cannot be made durable, the batch is dropped
+     * and the segment truncated back to the last commit. A failed index
+     * write is only logged: the index is cut back to its last whole entry,
+     * and the records stay committed.
+     *
+     * @param ec Receive the error of the records, if any.
+     */
+    void flush(beast::error_code &ec);
+    /**
+     * @brief Read the frames of a segment.
+     *
+     * @param segment The segment.
+     * @param last The sequence number of the last committed record of the
+     * segment.
+     * @param size The committed size of the segment.
+     * @param from The sequence number of the first frame to read.
+     * @param frames Receive the frames, in order.
+     */
+    static void read(const Segment &segment, std::uint64_t last,
+                     std::uint64_t size, std::uint64_t from, Replay &frames);
+    /**
+     * @brief Read the index of a segment.
+     *
+     * @param segment The segment.
+     * @return std::vector<IndexEntry> The entries, a partial last entry is
+     * ignored.
+     */
+    static std::vector<IndexEntry> read_index(const Segment &segment);
+
+    /**
+     * @brief The log directory.
+     */
+    const std::filesystem::path directory_;
+    /**
+     * @brief The size of a segment before a new one is started.
+     */
+    const std::uint64_t segment_size_;
+    /**
+     * @brief The time between two commits.
+     */
+    const std::chrono::milliseconds sync_interval_;
+
+    /**
+     * @brief The mutex of the pending list.
+     */
+    std::mutex mutex_;
+    /**
+     * @brief Wake the log thread when the pending list is full, or on stop.
+     */
+    std::condition_variable wake_;
+    /**
+     * @brief The frames appended since the last commit.
+     */
+    std::vector<Pending> pending_;
+    /**
+     * @brief Whether the log thread must stop.
+     */
+    bool stop_ = false;
+
+    /**
+     * @brief The mutex of the segment list, for readers.
+     */
+    mutable std::mutex segments_mutex_;
+    /**
+     * @brief The segments, oldest first. The last one is active.
+     */
+    std::vector<Segment> segments_;
+    /**
+     * @brief The sequence number after the last committed record.
+     * @details Written by the log thread, under segments_mutex_.
+     */
+    std::uint64_t next_ = 0;
+    /**
+     * @brief The committed size of the active segment.
+     * @details Written by the log thread, under segments_mutex_.
+     */
+    std::uint64_t committed_ = 0;
+
+    /**
+     * @brief The file descriptor of the records of the active segment.
+     */
+    int log_fd_ = -1;
+    /**
+     * @brief The file descriptor of the index of the active segment.
+     */
+    int index_fd_ = -1;
+    /**
+     * @brief The sequence number of the next record.
+     */
+    std::uint64_t sequence_ = 0;
+    /**
+     * @brief The size of the active segment, including buffered records.
+     */
+    std::uint64_t size_ = 0;
+    /**
+     * @brief The offset of the last index entry of the active segment.
+     */
+    std::uint64_t indexed_ = 0;
+    /**
+     * @brief The value of indexed_ after the last commit.
+     * @details A failed commit goes back to it, since the index entries of
+     * the batch are dropped with its records.
+     */
+    std::uint64_t index_written_ = 0;
+    /**
+     * @brief The records not written yet. Reused from one commit to the next.
+     */
+    std::string records_;
+    /**
+     * @brief The index entries not written yet.
+     */
+    std::string index_;
+    /**
+     * @brief The log thread.
+     */
+    std::thread thread_;
+};
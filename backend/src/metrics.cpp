@@ -0,0 +1,381 @@
+/**
+ * @file metrics.cpp
+ * @brief Metrics struct implementation.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-18
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#include "metrics.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fmt/core.h>
+#include <fmt/format.h>
+#include <iterator>
+#include <mutex>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+/**
+ * @brief The counters of every thread.
+ */
+struct Registry {
+    /**
+     * @brief The mutex of the registry, never taken to bump a counter.
+     */
+    std::mutex mutex;
+    /**
+     * @brief The counters of the running threads.
+     */
+    std::vector<const Metrics *> threads;
+    /**
+     * @brief The sums of the counters of the threads that exited.
+     */
+    Metrics retired;
+};
+
+/**
+ * @brief Get the registry.
+ *
+ * @return Registry& The registry.
+ */
+Registry &registry() {
+    static Registry instance;
+    return instance;
+}
+
+/**
+ * @brief The counters of a thread, registered while the thread runs.
+ */
+struct Registration {
+    Registration() : registry_(registry()) {
+        std::lock_guard<std::mutex> const lock(registry_.mutex);
+        registry_.threads.push_back(&metrics);
+    }
+
+    Registration(const Registration &) = delete;
+    Registration &operator=(const Registration &) = delete;
+
+    /**
+     * @brief Keep the counters of the thread in the sums.
+     */
+    ~Registration() {
+        std::lock_guard<std::mutex> const lock(registry_.mutex);
+        registry_.retired.merge(metrics);
+        registry_.threads.erase(std::find(registry_.threads.begin(),
+                                          registry_.threads.end(), &metrics));
+    }
+
+    Registry &registry_;
+    Metrics metrics;
+};
+
+/**
+ * @brief A counter, its name and its description.
+ */
+struct CounterInfo {
+    Counter Metrics::*counter;
+    const char *name;
+    const char *help;
+};
+
+/**
+ * @brief The counters, in the order they are reported.
+ */
+const CounterInfo counters[] = {
+    {&Metrics::connections_accepted, "connections_accepted",
+     "Connections accepted."},
+    {&Metrics::connections_closed, "connections_closed", "Sessions destroyed."},
+    {&Metrics::logins, "logins", "Clients that logged in."},
+    {&Metrics::messages_in, "messages_in", "WebSocket messages received."},
+    {&Metrics::bytes_in, "bytes_in", "Payload bytes received."},
+    {&Metrics::messages_out, "messages_out", "Frames written to a client."},
+    {&Metrics::bytes_out, "bytes_out",
+     "Payload bytes written to a client, before compression."},
+    {&Metrics::errors, "errors", "Errors reported by the server."},
+    {&Metrics::scrapes, "scrapes", "Requests for the metrics."},
+    {&Metrics::queue_overflows, "queue_overflows",
+     "Times a session queue went over its limits."},
+    {&Metrics::dropped_oldest, "dropped_oldest",
+     "Queued frames dropped by the drop-oldest policy."},
+    {&Metrics::dropped_newest, "dropped_newest",
+     "Incoming frames dropped by the drop-newest and disconnect policies."},
+    {&Metrics::coalesced, "coalesced",
+     "Queued frames replaced by a newer frame with the same key."},
+    {&Metrics::slow_consumers_disconnected, "slow_consumers_disconnected",
+     "Sessions closed for staying over their limits."},
+    {&Metrics::deflate_frames, "deflate_frames", "Frames compressed."},
+    {&Metrics::deflate_nanoseconds, "deflate_nanoseconds",
+     "Time spent compressing frames."},
+    {&Metrics::deflate_bytes_saved, "deflate_bytes_saved",
+     "Bytes not written thanks to compression."},
+    {&Metrics::log_records, "log_records",
+     "Chat messages written to the log."},
+    {&Metrics::log_commits, "log_commits", "Group commits of the log."},
+    {&Metrics::session_pool_hits, "session_pool_hits",
+     "Sessions allocated in a recycled slot."},
+    {&Metrics::session_pool_misses, "session_pool_misses",
+     "Sessions allocated from the heap."},
+    {&Metrics::buffer_pool_hits, "buffer_pool_hits",
+     "Sessions that got a recycled read buffer."},
+    {&Metrics::buffer_pool_misses, "buffer_pool_misses",
+     "Sessions that got a new read buffer."},
+    {&Metrics::sessions_idled, "sessions_idled",
+     "Sessions that went idle and freed their buffers."},
+    {&Metrics::sessions_woken, "sessions_woken",
+     "Idle sessions that received a message or were destroyed."},
+    {&Metrics::session_bytes_allocated, "session_bytes_allocated",
+     "Memory accounted to sessions."},
+    {&Metrics::session_bytes_released, "session_bytes_released",
+     "Memory given back by sessions."},
+    {&Metrics::timers_fired, "timers_fired",
+     "Timers that expired on a timer wheel."},
+    {&Metrics::heartbeat_timeouts, "heartbeat_timeouts",
+     "Connections closed because a keep-alive ping got no answer."},
+    {&Metrics::session_throttles, "session_throttles",
+     "Reads paused because a session was over its rate."},
+    {&Metrics::ip_throttles, "ip_throttles",
+     "Reads paused because a client address was over its rate."},
+    {&Metrics::presence_digests, "presence_digests",
+     "Presence deltas published."},
+    {&Metrics::user_lists_built, "user_lists_built",
+     "User lists serialized, once per version that was asked for."},
+    {&Metrics::direct_messages, "direct_messages",
+     "Direct messages routed to their recipient."},
+    {&Metrics::direct_misses, "direct_misses",
+     "Direct messages dropped because their recipient was unknown."},
+    {&Metrics::direct_forgeries, "direct_forgeries",
+     "Direct messages dropped because their sender was not the user."},
+    {&Metrics::login_conflicts, "login_conflicts",
+     "Logins refused because the name belonged to another session."},
+    {&Metrics::relay_overflows, "relay_overflows",
+     "Frames parked because the ring to another shard was full."},
+};
+
+/**
+ * @brief The names of the stages.
+ */
+const char *const stage_names[stage_count] = {"parse", "send_to_all",
+                                              "queue_wait", "write", "total"};
+
+/**
+ * @brief A percentile reported for the stages, and its Prometheus quantile.
+ */
+struct Quantile {
+    double percentile;
+    const char *label;
+};
+
+/**
+ * @brief The percentiles reported for the stages.
+ */
+constexpr Quantile stage_quantiles[] = {
+    {50, "0.5"}, {90, "0.9"}, {99, "0.99"}, {99.9, "0.999"}};
+
+/**
+ * @brief Get the difference of two counters that only grow together.
+ *
+ * @param up The larger counter.
+ * @param down The smaller counter, read after the larger one.
+ * @return std::uint64_t The difference, or 0 if a racing update made it
+ * negative.
+ */
+std::uint64_t gauge(const Counter &up, const Counter &down) {
+    return up.get() - std::min(up.get(), down.get());
+}
+
+/**
+ * @brief Get the resident memory of the process.
+ *
+ * @return std::uint64_t The resident set size in bytes, or 0 if it is not
+ * known.
+ */
+std::uint64_t resident_bytes() {
+    std::uint64_t pages = 0;
+    if (auto *file = std::fopen("/proc/self/statm", "r")) {
+        unsigned long long size = 0;
+        unsigned long long resident = 0;
+        if (std::fscanf(file, "%llu %llu", &size, &resident) == 2) {
+            pages = resident;
+        }
+        std::fclose(file);
+    }
+    return pages * static_cast<std::uint64_t>(sysconf(_SC_PAGESIZE));
+}
+
+/**
+ * @brief Format a histogram for Prometheus.
+ *
+ * @tparam Histogram The type of the histogram.
+ * @param out The output.
+ * @param name The name of the histogram, without the prefix.
+ * @param help The description of the histogram.
+ * @param histogram The histogram.
+ */
+template <typename Histogram>
+void format_histogram(fmt::memory_buffer &out, const char *name,
+                      const char *help, const Histogram &histogram) {
+    fmt::format_to(std::back_inserter(out),
+                   "# HELP message_{0} {1}\n# TYPE message_{0} histogram\n",
+                   name, help);
+    std::uint64_t cumulative = 0;
+    for (std::size_t i = 0; i + 1 < Histogram::size; ++i) {
+        cumulative += histogram.count(i);
+        fmt::format_to(std::back_inserter(out),
+                       "message_{}_bucket{{le=\"{}\"}} {}\n", name,
+                       std::uint64_t{1} << i, cumulative);
+    }
+    cumulative += histogram.count(Histogram::size - 1);
+    fmt::format_to(std::back_inserter(out),
+                   "message_{0}_bucket{{le=\"+Inf\"}} {1}\n"
+                   "message_{0}_sum {2}\nmessage_{0}_count {1}\n",
+                   name, cumulative, histogram.sum());
+}
+
+} // namespace
+
+Metrics &metrics() {
+    thread_local Registration registration;
+    return registration.metrics;
+}
+
+void Metrics::merge(const Metrics &other) {
+    for (const auto &info : counters) {
+        (this->*info.counter).add((other.*info.counter).get());
+    }
+    queue_depth.merge(other.queue_depth);
+    fanout_microseconds.merge(other.fanout_microseconds);
+    for (std::size_t i = 0; i < stage_count; ++i) {
+        stages[i].merge(other.stages[i]);
+    }
+}
+
+void Metrics::collect(Metrics &total) {
+    auto &instance = registry();
+    std::lock_guard<std::mutex> const lock(instance.mutex);
+    total.merge(instance.retired);
+    for (const auto *thread : instance.threads) {
+        total.merge(*thread);
+    }
+}
+
+std::string Metrics::scrape() {
+    Metrics total;
+    collect(total);
+
+    fmt::memory_buffer out;
+    for (const auto &info : counters) {
+        fmt::format_to(std::back_inserter(out),
+                       "# HELP message_{0}_total {1}\n"
+                       "# TYPE message_{0}_total counter\n"
+                       "message_{0}_total {2}\n",
+                       info.name, info.help, (total.*info.counter).get());
+    }
+    fmt::format_to(
+        std::back_inserter(out),
+        "# HELP message_connections Open connections.\n"
+        "# TYPE message_connections gauge\n"
+        "message_connections {}\n"
+        "# HELP message_idle_sessions Sessions that are idle.\n"
+        "# TYPE message_idle_sessions gauge\n"
+        "message_idle_sessions {}\n"
+        "# HELP message_session_bytes Memory held by the open sessions.\n"
+        "# TYPE message_session_bytes gauge\n"
+        "message_session_bytes {}\n"
+        "# HELP message_resident_bytes Resident memory of the process.\n"
+        "# TYPE message_resident_bytes gauge\n"
+        "message_resident_bytes {}\n",
+        gauge(total.connections_accepted, total.connections_closed),
+        gauge(total.sessions_idled, total.sessions_woken),
+        gauge(total.session_bytes_allocated, total.session_bytes_released),
+        resident_bytes());
+    format_histogram(out, "queue_depth",
+                     "Depth of a session queue after a frame is queued.",
+                     total.queue_depth);
+    format_histogram(out, "fanout_microseconds",
+                     "Time to queue a broadcast for its local recipients.",
+                     total.fanout_microseconds);
+
+    fmt::format_to(std::back_inserter(out),
+                   "# HELP message_stage_nanoseconds Stages of the traced chat "
+                   "messages.\n"
+                   "# TYPE message_stage_nanoseconds summary\n");
+    for (std::size_t i = 0; i < stage_count; ++i) {
+        auto const &stage = total.stages[i];
+        for (auto const &quantile : stage_quantiles) {
+            fmt::format_to(std::back_inserter(out),
+                           "message_stage_nanoseconds{{stage=\"{}\","
+                           "quantile=\"{}\"}} {}\n",
+                           stage_names[i], quantile.label,
+                           stage.percentile(quantile.percentile));
+        }
+        fmt::format_to(std::back_inserter(out),
+                       "message_stage_nanoseconds_count{{stage=\"{}\"}} {}\n",
+                       stage_names[i], stage.count());
+    }
+    return fmt::to_string(out);
+}
+
+void Metrics::report() {
+    Metrics total;
+    collect(total);
+
+    for (const auto &info : counters) {
+        fmt::print(stderr, "{} {}\n", info.name, (total.*info.counter).get());
+    }
+    auto const rate = [](const Counter &hits, const Counter &misses) {
+        auto const sum = hits.get() + misses.get();
+        return sum == 0 ? 0.0 : static_cast<double>(hits.get()) / sum;
+    };
+    fmt::print(stderr,
+               "session_pool_hit_rate {:.3f}\n"
+               "buffer_pool_hit_rate {:.3f}\n",
+               rate(total.session_pool_hits, total.session_pool_misses),
+               rate(total.buffer_pool_hits, total.buffer_pool_misses));
+}
+
+void Metrics::report_stages() {
+    Metrics total;
+    collect(total);
+
+    fmt::print(stderr, "{:<12} {:>10} {:>10} {:>10} {:>10} {:>10}\n", "stage",
+               "count", "p50 us", "p90 us", "p99 us", "p999 us");
+    for (std::size_t i = 0; i < stage_count; ++i) {
+        auto const &stage = total.stages[i];
+        auto const us = [&stage](double percentile) {
+            return static_cast<double>(stage.percentile(percentile)) / 1000.0;
+        };
+        fmt::print(stderr,
+                   "{:<12} {:>10} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f}\n",
+                   stage_names[i], stage.count(), us(50), us(90), us(99),
+                   us(99.9));
+    }
+}
+
+void Metrics::report_memory() {
+    Metrics total;
+    collect(total);
+
+    auto const connections =
+        gauge(total.connections_accepted, total.connections_closed);
+    auto const per_connection = [connections](std::uint64_t bytes) {
+        return connections == 0 ? 0 : bytes / connections;
+    };
+    auto const session_bytes =
+        gauge(total.session_bytes_allocated, total.session_bytes_released);
+    auto const resident = resident_bytes();
+    fmt::print(stderr,
+               "connections {}\n"
+               "idle_sessions {}\n"
+               "session_bytes {} ({} per connection)\n"
+               "resident_bytes {} ({} per connection)\n",
+               connections, gauge(total.sessions_idled, total.sessions_woken),
+               session_bytes, per_connection(session_bytes), resident,
+               per_connection(resident));
+}
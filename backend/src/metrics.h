@@ -0,0 +1,539 @@
+/**
+ * @file metrics.h
+ * @brief Metrics struct definition. Metrics counts the events of the server.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-18
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief Counter class, a counter written by a single thread.
+ * @details The owner adds with a relaxed load and store, which is not a
+ * locked instruction. Other threads only read it, when the counters are
+ * scraped.
+ */
+class Counter {
+  public:
+    /**
+     * @brief Add to the counter. Only the owning thread may call it.
+     *
+     * @param value The increment.
+     */
+    void add(std::uint64_t value = 1) {
+        value_.store(value_.load(std::memory_order_relaxed) + value,
+                     std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Get the value of the counter. Any thread may call it.
+     *
+     * @return std::uint64_t The value.
+     */
+    [[nodiscard]] std::uint64_t get() const {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    /**
+     * @brief The value.
+     */
+    std::atomic<std::uint64_t> value_{0};
+};
+
+/**
+ * @brief Log2Histogram class, a histogram with power of two buckets, written
+ * by a single thread.
+ * @details Bucket i counts the values up to 2^i, the last one counts the
+ * values above. The counts are not cumulative, the scrape sums them.
+ *
+ * @tparam Buckets The number of buckets, the last one is unbounded.
+ */
+template <std::size_t Buckets> class Log2Histogram {
+  public:
+    /**
+     * @brief The number of buckets.
+     */
+    static constexpr std::size_t size = Buckets;
+
+    /**
+     * @brief Record a value. Only the owning thread may call it.
+     *
+     * @param value The value.
+     */
+    void observe(std::uint64_t value) {
+        std::size_t bucket = 0;
+        for (auto v = value > 0 ? value - 1 : 0; v != 0; v >>= 1U) {
+            ++bucket;
+        }
+        buckets_[bucket < Buckets ? bucket : Buckets - 1].add();
+        sum_.add(value);
+    }
+
+    /**
+     * @brief Add the values of another histogram.
+     *
+     * @param other The other histogram.
+     */
+    void merge(const Log2Histogram &other) {
+        for (std::size_t i = 0; i < Buckets; ++i) {
+            buckets_[i].add(other.buckets_[i].get());
+        }
+        sum_.add(other.sum_.get());
+    }
+
+    /**
+     * @brief Get the count of a bucket.
+     *
+     * @param bucket The bucket.
+     * @return std::uint64_t The number of values in the bucket.
+     */
+    [[nodiscard]] std::uint64_t count(std::size_t bucket) const {
+        return buckets_[bucket].get();
+    }
+
+    /**
+     * @brief Get the sum of the values.
+     *
+     * @return std::uint64_t The sum.
+     */
+    [[nodiscard]] std::uint64_t sum() const {
+        return sum_.get();
+    }
+
+  private:
+    /**
+     * @brief The counts of the buckets.
+     */
+    std::array<Counter, Buckets> buckets_;
+    /**
+     * @brief The sum of the values.
+     */
+    Counter sum_;
+};
+
+/**
+ * @brief LatencyHistogram class, a log-linear histogram of durations, written
+ * by a single thread.
+ * @details Like HdrHistogram: below 2^sub_bits nanoseconds every value has a
+ * bucket, above, every power of two is split into 2^(sub_bits - 1) buckets,
+ * so a duration is known within about 3%. Durations from 2^max_bits
+ * nanoseconds, about 69 seconds, fall in the last bucket.
+ */
+class LatencyHistogram {
+  public:
+    /**
+     * @brief Record a duration. Only the owning thread may call it.
+     *
+     * @param nanoseconds The duration, negative durations count as 0.
+     */
+    void record(std::int64_t nanoseconds) {
+        auto value = static_cast<std::uint64_t>(nanoseconds > 0 ? nanoseconds
+                                                                : 0);
+        value = value < (std::uint64_t{1} << max_bits)
+                    ? value
+                    : (std::uint64_t{1} << max_bits) - 1;
+        unsigned width = 0;
+        for (auto v = value; v != 0; v >>= 1U) {
+            ++width;
+        }
+        unsigned const shift = width > sub_bits ? width - sub_bits : 0;
+        buckets_[(static_cast<std::size_t>(shift) << (sub_bits - 1)) +
+                 static_cast<std::size_t>(value >> shift)]
+            .add();
+        count_.add();
+    }
+
+    /**
+     * @brief Add the durations of another histogram.
+     *
+     * @param other The other histogram.
+     */
+    void merge(const LatencyHistogram &other) {
+        for (std::size_t i = 0; i < size; ++i) {
+            buckets_[i].add(other.buckets_[i].get());
+        }
+        count_.add(other.count_.get());
+    }
+
+    /**
+     * @brief Get the number of durations.
+     *
+     * @return std::uint64_t The number of durations.
+     */
+    [[nodiscard]] std::uint64_t count() const {
+        return count_.get();
+    }
+
+    /**
+     * @brief Get a percentile.
+     *
+     * @param percentile The percentile, between 0 and 100.
+     * @return std::uint64_t The highest duration of the bucket of the
+     * percentile, in nanoseconds, or 0 if there is none.
+     */
+    [[nodiscard]] std::uint64_t percentile(double percentile) const {
+        auto const total = count_.get();
+        if (total == 0) {
+            return 0;
+        }
+        auto rank = static_cast<std::uint64_t>(
+            percentile / 100.0 * static_cast<double>(total) + 0.5);
+        rank = rank == 0 ? 1 : rank;
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < size; ++i) {
+            seen += buckets_[i].get();
+            if (seen >= rank) {
+                return highest(i);
+            }
+        }
+        return highest(size - 1);
+    }
+
+  private:
+    /**
+     * @brief The number of bits of a duration kept exactly.
+     */
+    static constexpr unsigned sub_bits = 6;
+    /**
+     * @brief The number of bits of the longest duration.
+     */
+    static constexpr unsigned max_bits = 36;
+    /**
+     * @brief The number of buckets.
+     */
+    static constexpr std::size_t size =
+        ((max_bits - sub_bits) << (sub_bits - 1)) + (1U << sub_bits);
+
+    /**
+     * @brief Get the highest duration of a bucket.
+     *
+     * @param index The bucket.
+     * @return std::uint64_t The highest duration that falls in the bucket.
+     */
+    static std::uint64_t highest(std::size_t index) {
+        if (index < (1U << sub_bits)) {
+            return index;
+        }
+        auto const shift = (index >> (sub_bits - 1)) - 1;
+        auto const base = index - (shift << (sub_bits - 1));
+        return ((static_cast<std::uint64_t>(base) + 1) << shift) - 1;
+    }
+
+    /**
+     * @brief The counts of the buckets.
+     */
+    std::array<Counter, size> buckets_;
+    /**
+     * @brief The number of durations.
+     */
+    Counter count_;
+};
+
+/**
+ * @brief The stages of a traced chat message.
+ * @see Config::trace
+ */
+enum class Stage {
+    /**
+     * @brief From the end of the read to the frame being built.
+     */
+    parse,
+    /**
+     * @brief The call to State::send: log, fan-out and relay.
+     */
+    send_to_all,
+    /**
+     * @brief From the start of the fan-out to the write of the frame, per
+     * recipient.
+     */
+    queue_wait,
+    /**
+     * @brief From the start of the write to its completion, per recipient.
+     */
+    write,
+    /**
+     * @brief From the end of the read to the completion of the write, per
+     * recipient.
+     */
+    total,
+};
+
+/**
+ * @brief The number of stages.
+ */
+constexpr std::size_t stage_count = 5;
+
+/**
+ * @brief Get the time for the stage timestamps.
+ *
+ * @return std::int64_t The time, in nanoseconds of the steady clock.
+ */
+inline std::int64_t trace_clock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/**
+ * @brief Metrics struct, the counters of the server.
+ * @details Every thread has its own counters, so bumping one is a plain add
+ * to a cache line no other thread writes. The counters of all the threads,
+ * and of the threads that exited, are only summed when they are scraped or
+ * reported.
+ * @see metrics
+ */
+struct Metrics {
+    /**
+     * @brief Connections accepted.
+     */
+    Counter connections_accepted;
+    /**
+     * @brief Sessions destroyed.
+     */
+    Counter connections_closed;
+    /**
+     * @brief Clients that logged in.
+     */
+    Counter logins;
+    /**
+     * @brief WebSocket messages received.
+     */
+    Counter messages_in;
+    /**
+     * @brief Payload bytes received.
+     */
+    Counter bytes_in;
+    /**
+     * @brief Frames written to a client.
+     */
+    Counter messages_out;
+    /**
+     * @brief Payload bytes written to a client, before compression.
+     */
+    Counter bytes_out;
+    /**
+     * @brief Errors reported by fail().
+     */
+    Counter errors;
+    /**
+     * @brief Requests for the metrics.
+     */
+    Counter scrapes;
+    /**
+     * @brief Times a session queue went over its limits.
+     */
+    Counter queue_overflows;
+    /**
+     * @brief Queued frames dropped by the drop-oldest policy.
+     */
+    Counter dropped_oldest;
+    /**
+     * @brief Incoming frames dropped by the drop-newest and disconnect
+     * policies.
+     */
+    Counter dropped_newest;
+    /**
+     * @brief Queued frames replaced by a newer frame with the same key.
+     */
+    Counter coalesced;
+    /**
+     * @brief Sessions closed because they stayed over their limits for the
+     * whole grace period.
+     */
+    Counter slow_consumers_disconnected;
+    /**
+     * @brief Frames compressed for permessage-deflate, once per broadcast.
+     */
+    Counter deflate_frames;
+    /**
+     * @brief Time spent compressing frames, in nanoseconds.
+     */
+    Counter deflate_nanoseconds;
+    /**
+     * @brief Bytes not written thanks to compression, summed over every
+     * recipient.
+     */
+    Counter deflate_bytes_saved;
+    /**
+     * @brief Chat messages written to the log.
+     */
+    Counter log_records;
+    /**
+     * @brief Group commits of the log, one fdatasync each.
+     */
+    Counter log_commits;
+    /**
+     * @brief Sessions allocated in a recycled slot.
+     */
+    Counter session_pool_hits;
+    /**
+     * @brief Sessions allocated from the heap.
+     */
+    Counter session_pool_misses;
+    /**
+     * @brief Sessions that got a recycled read buffer.
+     */
+    Counter buffer_pool_hits;
+    /**
+     * @brief Sessions that got a new read buffer.
+     */
+    Counter buffer_pool_misses;
+    /**
+     * @brief Sessions that went idle and freed their buffers.
+     */
+    Counter sessions_idled;
+    /**
+     * @brief Idle sessions that received a message or were destroyed.
+     */
+    Counter sessions_woken;
+    /**
+     * @brief Memory accounted to sessions, in bytes.
+     * @details Together with session_bytes_released, the memory held by the
+     * open sessions: the session itself, its read buffer, its queue, its
+     * names and its scratch state.
+     * @see Session::footprint
+     */
+    Counter session_bytes_allocated;
+    /**
+     * @brief Memory given back by sessions, in bytes.
+     */
+    Counter session_bytes_released;
+    /**
+     * @brief Timers that expired on a timer wheel.
+     * @see TimerWheel
+     */
+    Counter timers_fired;
+    /**
+     * @brief Connections closed because a keep-alive ping got no answer.
+     */
+    Counter heartbeat_timeouts;
+    /**
+     * @brief Reads paused because a session was over its rate.
+     * @see RateLimiter
+     */
+    Counter session_throttles;
+    /**
+     * @brief Reads paused because a client address was over its rate.
+     */
+    Counter ip_throttles;
+    /**
+     * @brief Presence deltas published.
+     * @see Presence
+     */
+    Counter presence_digests;
+    /**
+     * @brief User lists serialized, once per version that was asked for.
+     */
+    Counter user_lists_built;
+    /**
+     * @brief Direct messages routed to their recipient.
+     * @see State::send_to_user
+     */
+    Counter direct_messages;
+    /**
+     * @brief Direct messages dropped because their recipient was unknown.
+     */
+    Counter direct_misses;
+    /**
+     * @brief Direct messages dropped because their sender was not the user
+     * of the session.
+     */
+    Counter direct_forgeries;
+    /**
+     * @brief Logins refused because the name belonged to another session.
+     */
+    Counter login_conflicts;
+    /**
+     * @brief Frames parked because the ring to another shard was full.
+     * @see Shard::relay
+     */
+    Counter relay_overflows;
+    /**
+     * @brief The depth of a session queue after a frame is queued, up to
+     * 1024 frames.
+     */
+    Log2Histogram<12> queue_depth;
+    /**
+     * @brief The time a broadcast takes to reach every local recipient
+     * queue, in microseconds, up to about half a second.
+     */
+    Log2Histogram<21> fanout_microseconds;
+    /**
+     * @brief The durations of the stages of the traced chat messages.
+     */
+    std::array<LatencyHistogram, stage_count> stages;
+
+    /**
+     * @brief Record the duration of a stage.
+     *
+     * @param stage The stage.
+     * @param nanoseconds The duration.
+     */
+    void record(Stage stage, std::int64_t nanoseconds) {
+        stages[static_cast<std::size_t>(stage)].record(nanoseconds);
+    }
+
+    /**
+     * @brief Add the counters of another thread.
+     *
+     * @param other The counters of the other thread.
+     */
+    void merge(const Metrics &other);
+
+    /**
+     * @brief Sum the counters of every thread.
+     *
+     * @param total Receive the sums. It must be a fresh object.
+     */
+    static void collect(Metrics &total);
+    /**
+     * @brief Format the sums of the counters for Prometheus.
+     *
+     * @return std::string The metrics, in the Prometheus text format.
+     */
+    static std::string scrape();
+    /**
+     * @brief Print the sums of the counters, and the hit rates of the pools,
+     * to stderr.
+     */
+    static void report();
+    /**
+     * @brief Print the percentiles of the stages to stderr.
+     */
+    static void report_stages();
+    /**
+     * @brief Print the memory per open connection to stderr.
+     * @details The memory accounted to the sessions, and the resident memory
+     * of the whole process, divided by the open connections.
+     */
+    static void report_memory();
+};
+
+/**
+ * @brief Get the counters of the calling thread.
+ *
+ * @return Metrics& The counters.
+ */
+Metrics &metrics();
+
+/**
+ * @brief Bump a counter of the calling thread.
+ *
+ * @param counter The counter, from metrics().
+ * @param value The increment.
+ */
+inline void bump(Counter &counter, std::uint64_t value = 1) {
+    counter.add(value);
+}
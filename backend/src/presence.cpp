@@ -0,0 +1,155 @@
+/**
+ * @file presence.cpp
+ * @brief Presence class implementation.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-23
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#include "presence.h"
+#include "frame.h"
+#include "metrics.h"
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+namespace {
+
+/**
+ * @brief The writer of the presence messages.
+ */
+using Writer = rapidjson::Writer<rapidjson::StringBuffer>;
+
+/**
+ * @brief Write an array of names.
+ *
+ * @param writer The writer.
+ * @param key The key of the array.
+ * @param names The names.
+ */
+void write_names(Writer &writer, const char *key,
+                 const std::vector<const std::string *> &names) {
+    writer.Key(key);
+    writer.StartArray();
+    for (const auto *name : names) {
+        writer.String(name->data(),
+                      static_cast<rapidjson::SizeType>(name->size()));
+    }
+    writer.EndArray();
+}
+
+} // namespace
+
+void Presence::join(const Username &username) {
+    std::lock_guard<std::mutex> const lock(mutex_);
+    update(username, 1);
+}
+
+void Presence::leave(const Username &username) {
+    std::lock_guard<std::mutex> const lock(mutex_);
+    update(username, -1);
+}
+
+void Presence::update(const Username &username, int sessions) {
+    auto it = users_.find(*username);
+    if (it == users_.end()) {
+        if (sessions < 0) {
+            return;
+        }
+        Entry entry;
+        entry.name = username;
+        it = users_.emplace(*username, std::move(entry)).first;
+    }
+
+    auto &entry = it->second;
+    if (sessions < 0 && entry.sessions == 0) {
+        return;
+    }
+    entry.sessions += sessions;
+    if (!entry.changed) {
+        entry.changed = true;
+        changed_.push_back(entry.name.get());
+    }
+}
+
+std::shared_ptr<const Frame> Presence::list() {
+    std::lock_guard<std::mutex> const lock(mutex_);
+    if (list_) {
+        return list_;
+    }
+
+    rapidjson::StringBuffer buffer;
+    Writer writer(buffer);
+    writer.StartObject();
+    writer.Key("type");
+    writer.String("user_list");
+    writer.Key("version");
+    writer.Uint64(version_);
+    writer.Key("users");
+    writer.StartArray();
+    for (const auto &[username, entry] : users_) {
+        if (entry.published) {
+            writer.String(username.data(),
+                          static_cast<rapidjson::SizeType>(username.size()));
+        }
+    }
+    writer.EndArray();
+    writer.EndObject();
+
+    // Only the client that asked gets the list, it is never coalesced
+    list_ = std::make_shared<const Frame>(
+        std::string(buffer.GetString(), buffer.GetSize()));
+    bump(metrics().user_lists_built);
+    return list_;
+}
+
+std::shared_ptr<const Frame> Presence::digest() {
+    std::lock_guard<std::mutex> const lock(mutex_);
+    std::vector<const std::string *> joined;
+    std::vector<const std::string *> left;
+    std::vector<const std::string *> offline;
+    for (const auto *username : changed_) {
+        auto &entry = users_.find(*username)->second;
+        entry.changed = false;
+        bool const online = entry.sessions > 0;
+        if (online != entry.published) {
+            entry.published = online;
+            (online ? joined : left).push_back(username);
+        }
+        if (!online) {
+            offline.push_back(username);
+        }
+    }
+    changed_.clear();
+
+    std::shared_ptr<const Frame> frame;
+    if (!joined.empty() || !left.empty()) {
+        ++version_;
+        list_.reset();
+
+        rapidjson::StringBuffer buffer;
+        Writer writer(buffer);
+        writer.StartObject();
+        writer.Key("type");
+        writer.String("presence");
+        writer.Key("version");
+        writer.Uint64(version_);
+        write_names(writer, "joined", joined);
+        write_names(writer, "left", left);
+        writer.EndObject();
+        frame = std::make_shared<const Frame>(
+            std::string(buffer.GetString(), buffer.GetSize()), std::string(),
+            key);
+        bump(metrics().presence_digests);
+    }
+
+    // The users that went offline are no longer needed, the names in the
+    // delta were copied into it
+    for (const auto *username : offline) {
+        users_.erase(users_.find(*username));
+    }
+    return frame;
+}
@@ -0,0 +1,141 @@
+/**
+ * @file presence.h
+ * @brief Presence class definition. The online users, published as versioned
+ * lists and deltas.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-23
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#pragma once
+
+#include "user_index.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class Frame;
+
+/**
+ * @brief Presence class, the index of the online users.
+ * @details Joins and leaves are only recorded. Every publish interval, the
+ * users whose presence changed since the last digest are compared with the
+ * last published list, and a delta goes out to everyone with the next
+ * version: a user that joined and left within the interval is never
+ * announced. The full list of a version is serialized once, when it is first
+ * asked for, and shared by every client that asks for it until the next
+ * version.
+ *
+ * A client fetches the list once, then applies the delta of version v + 1 to
+ * the list of version v. A client that misses a delta, for instance because
+ * the coalesce policy replaced it, fetches the list again.
+ *
+ * A user with several sessions is online until its last session leaves. The
+ * index may be shared by the states of several shards.
+ * @see State::publish_presence_on
+ */
+class Presence {
+  public:
+    /**
+     * @brief The coalescing key of the deltas.
+     * @see Frame::key
+     */
+    static constexpr const char *key = "presence";
+
+    /**
+     * @brief Record a session of a user. This method is thread-safe.
+     *
+     * @param username The name of the user.
+     */
+    void join(const Username &username);
+    /**
+     * @brief Record the end of a session of a user. This method is
+     * thread-safe.
+     *
+     * @param username The name of the user.
+     */
+    void leave(const Username &username);
+    /**
+     * @brief Get the list of the current version. This method is
+     * thread-safe.
+     * @details The user_list message, with its version and the users, is
+     * built by the first call after a new version is published.
+     *
+     * @return std::shared_ptr<const Frame> The user_list frame.
+     */
+    std::shared_ptr<const Frame> list();
+    /**
+     * @brief Publish the changes since the last digest. This method is
+     * thread-safe.
+     * @details Build the presence message of the next version, with the users
+     * that joined and the users that left.
+     *
+     * @return std::shared_ptr<const Frame> The presence frame, or nullptr if
+     * the list did not change.
+     */
+    std::shared_ptr<const Frame> digest();
+
+  private:
+    /**
+     * @brief The presence of a user.
+     */
+    struct Entry {
+        /**
+         * @brief The interned name, which the key of the entry views.
+         */
+        Username name;
+        /**
+         * @brief The sessions of the user.
+         */
+        std::size_t sessions = 0;
+        /**
+         * @brief Whether the user is in the published list.
+         */
+        bool published = false;
+        /**
+         * @brief Whether the user is in changed_.
+         */
+        bool changed = false;
+    };
+
+    /**
+     * @brief Record a change of the sessions of a user.
+     * @details The mutex must be held.
+     *
+     * @param username The name of the user.
+     * @param sessions The number of sessions to add, 1 or -1.
+     */
+    void update(const Username &username, int sessions);
+
+    /**
+     * @brief The mutex of the index.
+     */
+    std::mutex mutex_;
+    /**
+     * @brief The users that are online or published, by name.
+     */
+    std::unordered_map<std::string_view, Entry> users_;
+    /**
+     * @brief The users whose sessions changed since the last digest.
+     * @details They point to the names of the entries of users_, which are
+     * not erased before the digest.
+     */
+    std::vector<const std::string *> changed_;
+    /**
+     * @brief The version of the published list.
+     */
+    std::uint64_t version_ = 0;
+    /**
+     * @brief The list of the current version, if it was asked for.
+     */
+    std::shared_ptr<const Frame> list_;
+};
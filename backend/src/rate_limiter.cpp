@@ -0,0 +1,73 @@
+/**
+ * @file rate_limiter.cpp
+ * @brief RateLimiter class implementation.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-22
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#include "rate_limiter.h"
+
+#include <algorithm>
+#include <chrono>
+
+RateLimit::RateLimit(std::size_t rate, std::size_t burst) {
+    if (rate == 0) {
+        return;
+    }
+    interval = std::chrono::nanoseconds(std::chrono::seconds(1)).count() /
+               static_cast<std::int64_t>(rate);
+    interval = std::max<std::int64_t>(interval, 1);
+    capacity =
+        interval * static_cast<std::int64_t>(std::max<std::size_t>(burst, 1));
+}
+
+std::int64_t TokenBucket::take(const RateLimit &limit, std::int64_t now) {
+    auto full_at = full_at_.load(std::memory_order_relaxed);
+    std::int64_t next = 0;
+    do {
+        // A bucket that has been full for a while holds no more than its
+        // capacity
+        next = std::max(full_at, now) + limit.interval;
+    } while (!full_at_.compare_exchange_weak(full_at, next,
+                                             std::memory_order_relaxed));
+    return std::max<std::int64_t>(next - now - limit.capacity, 0);
+}
+
+RateLimiter &rate_limiter() {
+    static RateLimiter instance;
+    return instance;
+}
+
+void RateLimiter::configure(const Config &config) {
+    session_limit_ = RateLimit(config.rate_limit, config.rate_burst);
+    address_limit_ = RateLimit(config.ip_rate_limit, config.ip_rate_burst);
+    if (address_limit_.enabled()) {
+        buckets_ = std::make_unique<TokenBucket[]>(address_buckets);
+    }
+}
+
+TokenBucket *RateLimiter::bucket(const asio::ip::address &address) {
+    if (!buckets_) {
+        return nullptr;
+    }
+
+    // FNV-1a over the bytes of the address
+    std::uint64_t hash = 14695981039346656037ULL;
+    auto const mix = [&hash](unsigned char byte) {
+        hash = (hash ^ byte) * 1099511628211ULL;
+    };
+    if (address.is_v4()) {
+        for (auto const byte : address.to_v4().to_bytes()) {
+            mix(byte);
+        }
+    } else {
+        for (auto const byte : address.to_v6().to_bytes()) {
+            mix(byte);
+        }
+    }
+    return &buckets_[hash % address_buckets];
+}
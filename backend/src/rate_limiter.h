@@ -0,0 +1,163 @@
+/**
+ * @file rate_limiter.h
+ * @brief RateLimiter class definition. Token buckets that limit the messages
+ * read from each session and from each client address.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-22
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#pragma once
+
+#include "base.h"
+#include "config.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/**
+ * @brief A sustained rate and a burst.
+ * @details Kept as the time between two tokens and the time a full bucket
+ * covers, in nanoseconds of the steady clock.
+ */
+struct RateLimit {
+    /**
+     * @brief Construct a disabled RateLimit object.
+     */
+    RateLimit() = default;
+    /**
+     * @brief Construct a new RateLimit object.
+     *
+     * @param rate The sustained rate, in messages per second. Zero disables
+     * the limit.
+     * @param burst The messages that can be taken at once, at least 1.
+     */
+    RateLimit(std::size_t rate, std::size_t burst);
+
+    /**
+     * @brief Whether the limit is enabled.
+     *
+     * @return true Tokens must be taken.
+     */
+    [[nodiscard]] bool enabled() const {
+        return interval > 0;
+    }
+
+    /**
+     * @brief The time between two tokens.
+     */
+    std::int64_t interval = 0;
+    /**
+     * @brief The time covered by a full bucket, burst times interval.
+     */
+    std::int64_t capacity = 0;
+};
+
+/**
+ * @brief TokenBucket class, a lock-free token bucket.
+ * @details The bucket only stores the time at which it will be full again,
+ * as in the generic cell rate algorithm, so taking a token is a single
+ * compare and swap. A token is always taken: a bucket that is empty goes
+ * into debt, and the taker is told how long to wait for it to be paid back.
+ * The rate is not stored, so one RateLimit serves many buckets.
+ */
+class TokenBucket {
+  public:
+    /**
+     * @brief Take a token. This method is thread-safe.
+     *
+     * @param limit The rate of the bucket.
+     * @param now The current time, from trace_clock().
+     * @return std::int64_t The time to wait before the next token, in
+     * nanoseconds, or 0 if the bucket was not empty.
+     */
+    std::int64_t take(const RateLimit &limit, std::int64_t now);
+
+  private:
+    /**
+     * @brief The time at which the bucket is full again.
+     */
+    std::atomic<std::int64_t> full_at_{0};
+};
+
+/**
+ * @brief RateLimiter class, the limits of the sessions and the buckets of
+ * the client addresses.
+ * @details Every session has its own bucket. The buckets of the addresses
+ * are a fixed table indexed by a hash of the address, so they are shared by
+ * every thread and shard without a lock and without growing. Two addresses
+ * that hash to the same bucket share its rate, which only makes the limit
+ * stricter for them.
+ * @see Session::throttle
+ */
+class RateLimiter {
+  public:
+    /**
+     * @brief The number of buckets of the client addresses.
+     */
+    static constexpr std::size_t address_buckets = 1 << 16;
+
+    RateLimiter() = default;
+    RateLimiter(const RateLimiter &) = delete;
+    RateLimiter &operator=(const RateLimiter &) = delete;
+
+    /**
+     * @brief Set the limits.
+     * @details It must be called before any session is created.
+     *
+     * @param config The server settings.
+     */
+    void configure(const Config &config);
+
+    /**
+     * @brief Get the limit of every session.
+     *
+     * @return const RateLimit& The limit, maybe disabled.
+     */
+    [[nodiscard]] const RateLimit &session_limit() const {
+        return session_limit_;
+    }
+    /**
+     * @brief Get the limit of every client address.
+     *
+     * @return const RateLimit& The limit, maybe disabled.
+     */
+    [[nodiscard]] const RateLimit &address_limit() const {
+        return address_limit_;
+    }
+    /**
+     * @brief Get the bucket of a client address.
+     *
+     * @param address The address.
+     * @return TokenBucket* The bucket, or nullptr if addresses are not
+     * limited.
+     */
+    TokenBucket *bucket(const asio::ip::address &address);
+
+  private:
+    /**
+     * @brief The limit of every session.
+     */
+    RateLimit session_limit_;
+    /**
+     * @brief The limit of every client address.
+     */
+    RateLimit address_limit_;
+    /**
+     * @brief The buckets of the client addresses.
+     * @details Null if addresses are not limited.
+     */
+    std::unique_ptr<TokenBucket[]> buckets_;
+};
+
+/**
+ * @brief Get the rate limiter of the server.
+ *
+ * @return RateLimiter& The rate limiter.
+ */
+RateLimiter &rate_limiter();
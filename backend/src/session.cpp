@@ -11,99 +11,794 @@
 
 #include "session.h"
 #include "message.h"
+#include "metrics.h"
+#include "session_pool.h"
 #include "state.h"
 #include "websocket.h"
 
+#include <algorithm>
+#ifdef MESSAGE_COROUTINE_ENGINE
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#endif
 #include <fmt/format.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <memory>
+#include <string_view>
 #include <utility>
 
+namespace {
+
+#ifdef TCP_CORK
+/**
+ * @brief The TCP_CORK socket option.
+ */
+using cork_option = asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_CORK>;
+#endif
+
+/**
+ * @brief The reply to a successful login, shared by every session.
+ */
+const auto login_success =
+    std::make_shared<const Frame>(R"({"type": "login", "success": true})");
+/**
+ * @brief The reply to a login with a name that is already in use.
+ */
+const auto login_taken = std::make_shared<const Frame>(
+    R"({"type": "login", "success": false, "reason": "username taken"})");
+
+} // namespace
+
 Session::Session(tcp::socket &&socket, std::shared_ptr<State> state)
-    : ws_(std::move(socket)), state_(std::move(state)),
-      buffer_(std::make_shared<beast::flat_buffer>()) {}
+    : ws_(std::move(socket)), write_signal_(ws_.get_executor()),
+      buffer_(session_pool().acquire_buffer()), state_(std::move(state)) {}
 
 Session::~Session() {
-    state_->leave({this->shared_from_this(), username_});
-    state_->send_to_all(std::make_shared<Message>(fmt::format(
-        R"({{"type": "user_left", "username": "{}"}})", username_)));
+    // Unlink the timers before they are freed. An expiry already posted
+    // holds the session, so none can be pending.
+    if (wheel_ != nullptr) {
+        wheel_->cancel(deadline_);
+        wheel_->cancel(heartbeat_);
+        wheel_->cancel(grace_timer_);
+    }
+
+    auto &counters = metrics();
+    bump(counters.connections_closed);
+    bump(counters.session_bytes_released, accounted_);
+    if (idle_) {
+        bump(counters.sessions_woken);
+    }
+    session_pool().release_buffer(std::move(buffer_));
 }
 
 void Session::run() {
+    wheel_ = state_->timer_wheel();
+    beast::error_code ec;
+    auto const remote =
+        beast::get_lowest_layer(ws_).socket().remote_endpoint(ec);
+    if (!ec) {
+        ip_bucket_ = rate_limiter().bucket(remote.address());
+    }
+
+#ifdef MESSAGE_COROUTINE_ENGINE
+    if (state_->config().engine == Engine::coroutine) {
+        asio::co_spawn(
+            ws_.get_executor(),
+            [self = shared_from_this()] { return self->co_run(); },
+            asio::detached);
+        return;
+    }
+#endif
+
     asio::dispatch(
         ws_.get_executor(),
         beast::bind_front_handler(&Session::on_run, shared_from_this()));
 }
 
 void Session::on_run() {
-    ws_.run();
+    ws_.run(state_->config());
+
+    // Read the upgrade request ourselves, to see the offered subprotocols
+    arm(deadline_, &Session::on_deadline, handshake_timeout);
+    http::async_read(
+        ws_.next_layer(), buffer_, scratch().request,
+        beast::bind_front_handler(&Session::on_request, shared_from_this()));
+}
+
+void Session::on_request(beast::error_code ec, std::size_t bytes_transferred) {
+    boost::ignore_unused(bytes_transferred);
+
+    if (ec == http::error::end_of_stream) {
+        return;
+    }
+
+    if (ec) {
+        return fail(ec, "request");
+    }
+
+    if (serve_http()) {
+        return;
+    }
+    negotiate();
 
     // Accept the websocket handshake
     ws_.async_accept(
+        scratch_->request,
         beast::bind_front_handler(&Session::on_accept, shared_from_this()));
 }
 
+bool Session::serve_http() {
+    auto const &request = scratch_->request;
+    if (websocket::is_upgrade(request)) {
+        return false;
+    }
+
+    // The metrics are the only resource, anything else is not found
+    auto const &path = state_->config().metrics_path;
+    auto status = http::status::bad_request;
+    if (request.method() == http::verb::get) {
+        status = !path.empty() && request.target() == path
+                     ? http::status::ok
+                     : http::status::not_found;
+    }
+
+    auto response = std::make_shared<http::response<http::string_body>>(
+        status, request.version());
+    response->keep_alive(false);
+    if (status == http::status::ok) {
+        bump(metrics().scrapes);
+        response->set(http::field::content_type, "text/plain; version=0.0.4");
+        response->body() = Metrics::scrape();
+    }
+    response->prepare_payload();
+    scratch_.reset();
+
+    // The handshake deadline still runs, and bounds the write
+    http::async_write(ws_.next_layer(), *response,
+                      beast::bind_front_handler(&Session::on_http_response,
+                                                shared_from_this(), response));
+    return true;
+}
+
+void Session::on_http_response(
+    const std::shared_ptr<http::response<http::string_body>> &response,
+    beast::error_code ec, std::size_t bytes_transferred) {
+    boost::ignore_unused(response, bytes_transferred);
+
+    if (ec) {
+        return fail(ec, "response");
+    }
+
+    beast::error_code ignored;
+    beast::get_lowest_layer(ws_).socket().shutdown(tcp::socket::shutdown_send,
+                                                   ignored);
+}
+
+void Session::negotiate() {
+    ws_.negotiate(scratch_->request);
+}
+
 void Session::on_accept(beast::error_code ec) {
+    // The scratch state is allocated again if the session needs it
+    scratch_.reset();
+    account();
     if (ec)
         return fail(ec, "accept");
 
-    username_ = ws_.login();
+    start_login_deadline();
+    start_heartbeat();
+    do_login();
+}
+
+void Session::start_login_deadline() {
+    // A client that never logs in must not hold the session forever
+    arm(deadline_, &Session::on_deadline, login_timeout);
+}
+
+void Session::start_heartbeat() {
+    // A pong is a sign of life, even if no message follows
+    ws_.control_callback(
+        [this](websocket::frame_type /*kind*/, beast::string_view /*payload*/) {
+            heard_ = true;
+        });
+    arm(heartbeat_, &Session::on_heartbeat, keepalive_interval);
+}
 
-    state_->send_to_all(std::make_shared<Message>(fmt::format(
-        R"({{"type": "user_joined", "username": "{}"}})", username_)));
+void Session::on_heartbeat() {
+    if (heard_) {
+        heard_ = false;
+        pinged_ = false;
+    } else if (pinged_) {
+        // Closing the socket completes the pending read with an error
+        bump(metrics().heartbeat_timeouts);
+        beast::get_lowest_layer(ws_).close();
+        return;
+    } else {
+        pinged_ = true;
+        ws_.async_ping({}, [self = shared_from_this()](beast::error_code ec) {
+            boost::ignore_unused(ec);
+        });
+    }
+    arm(heartbeat_, &Session::on_heartbeat, keepalive_interval);
+}
 
-    state_->join({this->shared_from_this(), username_});
+void Session::arm(WheelTimer &timer, void (Session::*handler)(),
+                  std::chrono::steady_clock::duration after) {
+    timer.handler = handler;
+    wheel_->arm(timer, after);
+}
 
-    ws_.login_success();
+void Session::cancel(WheelTimer &timer) {
+    wheel_->cancel(timer);
+}
+
+void Session::WheelTimer::expire(std::uint64_t generation) {
+    // The session may be on its way out, its destructor then waits for the
+    // wheel to cancel the timer
+    auto self = session_.weak_from_this().lock();
+    if (!self) {
+        return;
+    }
+    asio::post(session_.ws_.get_executor(),
+               [self = std::move(self), this, generation] {
+                   if (generation == this->generation()) {
+                       (self.get()->*handler)();
+                   }
+               });
+}
+
+void Session::do_login() {
+    // Read a message into our buffer
+    ws_.async_read(buffer_, beast::bind_front_handler(&Session::on_login,
+                                                       shared_from_this()));
+}
+
+void Session::on_login(beast::error_code ec, std::size_t bytes_transferred) {
+    boost::ignore_unused(bytes_transferred);
+
+    if (ec == websocket::error::closed || ec == asio::error::eof ||
+        ec == asio::error::operation_aborted) {
+        return;
+    }
+
+    if (ec) {
+        return fail(ec, "login");
+    }
+
+    if (!handle_login()) {
+        return do_login();
+    }
 
     // Read a message
     do_read();
 }
 
+bool Session::handle_login() {
+    Message const message(received());
+    buffer_.consume(buffer_.size());
+    if (!message.is_login_info() || message.get_username().empty()) {
+        return false;
+    }
+
+    // A name belongs to one session, the client may try another one
+    auto username =
+        state_->users().claim(message.get_username(), this->shared_from_this());
+    if (!username) {
+        bump(metrics().login_conflicts);
+        on_send(login_taken);
+        return false;
+    }
+
+    cancel(deadline_);
+    username_ = std::move(username);
+    bump(metrics().logins);
+    if (state_->config().trace) {
+        trace_since_ = trace_clock();
+    }
+    if (idle_mode()) {
+        last_active_ = std::chrono::steady_clock::now();
+        start_idle_check(state_->config().idle_after);
+    }
+
+    // The other clients learn about the user from the next presence delta
+    auto const backlog = state_->join({this->shared_from_this(), username_});
+    joined_ = true;
+
+    // Queued before any broadcast, which can only reach the strand later,
+    // and written together
+    enqueue(login_success);
+    replay({}, backlog);
+    start_write();
+    account();
+    return true;
+}
+
+void Session::on_deadline() {
+    if (joined_) {
+        return;
+    }
+
+    // Closing the socket completes the pending read with an error
+    beast::get_lowest_layer(ws_).close();
+}
+
 void Session::do_read() {
+    // In idle mode, wait for the next message with a small read into the
+    // session, so that the read buffer can be released meanwhile
+    if (idle_mode()) {
+        peeking_ = true;
+        ws_.async_read_some(
+            asio::buffer(peek_),
+            beast::bind_front_handler(&Session::on_peek, shared_from_this()));
+        return;
+    }
+
     // Read a message into our buffer
-    ws_.async_read(*buffer_, beast::bind_front_handler(&Session::on_read,
+    ws_.async_read(buffer_, beast::bind_front_handler(&Session::on_read,
                                                        shared_from_this()));
 }
 
+void Session::on_peek(beast::error_code ec, std::size_t bytes_transferred) {
+    peeking_ = false;
+    if (ec || peeked(bytes_transferred)) {
+        return on_read(ec, bytes_transferred);
+    }
+
+    // Read the rest of the message after the peeked bytes
+    ws_.async_read(buffer_, beast::bind_front_handler(&Session::on_read,
+                                                       shared_from_this()));
+}
+
+bool Session::peeked(std::size_t bytes) {
+    last_active_ = std::chrono::steady_clock::now();
+    if (idle_) {
+        wake();
+    }
+    buffer_.commit(asio::buffer_copy(buffer_.prepare(bytes),
+                                     asio::buffer(peek_.data(), bytes)));
+    return ws_.is_message_done();
+}
+
+void Session::start_idle_check(std::chrono::steady_clock::duration after) {
+    arm(deadline_, &Session::on_idle_check, after);
+}
+
+void Session::on_idle_check() {
+    if (!joined_) {
+        return;
+    }
+
+    auto const idle_after = state_->config().idle_after;
+    auto const now = std::chrono::steady_clock::now();
+    if (now < last_active_ + idle_after) {
+        return start_idle_check(last_active_ + idle_after - now);
+    }
+
+    // The buffers are in use while a message is read or written
+    if (!peeking_ || writing_ > 0 || !queue_.empty()) {
+        return start_idle_check(idle_after);
+    }
+
+    // The next message wakes the session up and restarts the checks
+    go_idle();
+}
+
+void Session::go_idle() {
+    idle_ = true;
+    bump(metrics().sessions_idled);
+    session_pool().release_buffer(std::move(buffer_));
+    buffer_ = beast::flat_buffer();
+    scratch_.reset();
+    queue_.shrink_to_fit();
+    rooms_.shrink_to_fit();
+    replayed_.shrink_to_fit();
+    account();
+}
+
+void Session::wake() {
+    idle_ = false;
+    bump(metrics().sessions_woken);
+    buffer_ = session_pool().acquire_buffer();
+    account();
+    start_idle_check(state_->config().idle_after);
+}
+
+Session::Scratch &Session::scratch() {
+    if (!scratch_) {
+        scratch_ = std::make_unique<Scratch>();
+    }
+    return *scratch_;
+}
+
+std::size_t Session::footprint() const {
+    // A short string lives in the string itself
+    auto const heap = [](const std::string &text) -> std::size_t {
+        return text.capacity() > std::string().capacity() ? text.capacity() + 1
+                                                          : 0;
+    };
+    auto bytes = sizeof(Session) + buffer_.capacity() + queue_.memory() +
+                 rooms_.capacity() * sizeof(std::string);
+    for (const auto &room : rooms_) {
+        bytes += heap(room);
+    }
+    if (username_) {
+        // Interned, but no other session shares it
+        bytes += sizeof(std::string) + heap(*username_);
+    }
+    bytes += replayed_.capacity() * sizeof(Replayed);
+    for (const auto &replayed : replayed_) {
+        bytes += heap(replayed.room);
+    }
+    if (scratch_) {
+        bytes += sizeof(Scratch) + heap(scratch_->decoded) +
+                 scratch_->write_buffers.capacity() *
+                     sizeof(asio::const_buffer);
+    }
+    return bytes;
+}
+
+void Session::account() {
+    auto const bytes = footprint();
+    if (bytes > accounted_) {
+        bump(metrics().session_bytes_allocated, bytes - accounted_);
+    } else if (bytes < accounted_) {
+        bump(metrics().session_bytes_released, accounted_ - bytes);
+    }
+    accounted_ = bytes;
+}
+
 void Session::on_read(beast::error_code ec, std::size_t bytes_transferred) {
     boost::ignore_unused(bytes_transferred);
 
     // This indicates that the session was closed
     if (ec == websocket::error::closed || ec == asio::error::eof) {
-        return;
+        return leave();
     }
 
     if (ec) {
-        return fail(ec, "read");
+        fail(ec, "read");
+        return leave();
     }
 
-    state_->send_to_all(
-        std::make_shared<Message>(beast::buffers_to_string(buffer_->data())));
-    buffer_->consume(buffer_->size());
+    handle_message();
+
+    // The wheel would round the pause up to a tick, which is longer than
+    // the gap between two tokens at most rates. Pauses are rare, so a timer
+    // of their own is cheap, as in the coroutine engine.
+    auto const wait = throttle();
+    if (wait.count() > 0) {
+        auto pause = std::make_shared<asio::steady_timer>(ws_.get_executor(),
+                                                          wait);
+        pause->async_wait(
+            [self = shared_from_this(), pause](beast::error_code ec) {
+                boost::ignore_unused(ec);
+                self->do_read();
+            });
+        return;
+    }
     do_read();
 }
 
-void Session::send(PassMsg msg) {
+std::chrono::nanoseconds Session::throttle() {
+    auto &limiter = rate_limiter();
+    auto const now = trace_clock();
+    std::int64_t wait = 0;
+    if (limiter.session_limit().enabled()) {
+        wait = bucket_.take(limiter.session_limit(), now);
+        if (wait > 0) {
+            bump(metrics().session_throttles);
+        }
+    }
+    if (ip_bucket_ != nullptr) {
+        auto const ip_wait = ip_bucket_->take(limiter.address_limit(), now);
+        if (ip_wait > 0) {
+            bump(metrics().ip_throttles);
+            wait = std::max(wait, ip_wait);
+        }
+    }
+    return std::chrono::nanoseconds(wait);
+}
+
+std::string_view Session::received() {
+    auto const data = buffer_.cdata();
+    std::string_view const message(static_cast<const char *>(data.data()),
+                                   data.size());
+    bump(metrics().messages_in);
+    bump(metrics().bytes_in, message.size());
+    heard_ = true;
+    if (!ws_.got_binary()) {
+        return message;
+    }
+    auto &decoded = scratch().decoded;
+    if (!Message::from_cbor(message, decoded)) {
+        decoded.clear();
+    }
+    return decoded;
+}
+
+void Session::handle_message() {
+    // Chat and direct messages are forwarded as received, without building a
+    // document. Anything else is parsed as a control message.
+    auto const read = state_->config().trace ? trace_clock() : 0;
+    auto const frame = received();
+    std::string room;
+    if (!Message::is_chat_frame(frame, room)) {
+        // Direct messages skip the snapshots, the history and the relay
+        std::string to;
+        std::string sender;
+        if (Message::is_direct_frame(frame, to, sender)) {
+            // Forwarded as is, so the sender must be the user
+            if (sender != *username_) {
+                bump(metrics().direct_forgeries);
+            } else {
+                state_->send_to_user(
+                    to, std::make_shared<const Frame>(std::string(frame)));
+            }
+        } else {
+            on_control(Message(frame));
+        }
+    } else if (room.empty() ||
+               std::find(rooms_.begin(), rooms_.end(), room) != rooms_.end()) {
+        auto chat =
+            std::make_shared<Frame>(std::string(frame), std::move(room));
+        if (read != 0) {
+            chat->set_received(read);
+            metrics().record(Stage::parse, trace_clock() - read);
+        }
+        state_->send(chat);
+    }
+    buffer_.consume(buffer_.size());
+}
+
+void Session::on_control(const Message &message) {
+    if (message.is_join_request()) {
+        join_room(message.get_room());
+    } else if (message.is_leave_request()) {
+        leave_room(message.get_room());
+    } else if (message.is_subscribe_request()) {
+        for (const auto &room : message.get_rooms()) {
+            join_room(room);
+        }
+    } else if (message.is_user_list_request()) {
+        // The list of a version is serialized once, and shared
+        on_send(state_->presence().list());
+        return;
+    } else {
+        return;
+    }
+    account();
+}
+
+void Session::join_room(const std::string &room) {
+    if (room.empty() || rooms_.size() >= max_rooms ||
+        std::find(rooms_.begin(), rooms_.end(), room) != rooms_.end()) {
+        return;
+    }
+    rooms_.push_back(room);
+    if (state_->config().trace) {
+        trace_since_ = trace_clock();
+    }
+    auto const backlog =
+        state_->join_room(room, {this->shared_from_this(), username_});
+
+    // Room names never need escaping
+    enqueue(std::make_shared<const Frame>(
+        fmt::format(R"({{"type": "join", "room": "{}"}})", room)));
+    replay(room, backlog);
+    start_write();
+}
+
+void Session::replay(const std::string &room, const Backlog &backlog) {
+    for (const auto &frame : backlog.frames) {
+        enqueue(frame);
+    }
+    if (!backlog.frames.empty()) {
+        replayed_.push_back({room, backlog.first, backlog.last});
+    }
+}
+
+void Session::leave_room(const std::string &room) {
+    auto const it = std::find(rooms_.begin(), rooms_.end(), room);
+    if (it == rooms_.end()) {
+        return;
+    }
+    *it = std::move(rooms_.back());
+    rooms_.pop_back();
+    state_->leave_rooms({room}, {this->shared_from_this(), username_});
+    replayed_.erase(std::remove_if(replayed_.begin(), replayed_.end(),
+                                   [&room](const Replayed &replayed) {
+                                       return replayed.room == room;
+                                   }),
+                    replayed_.end());
+
+    on_send(std::make_shared<const Frame>(
+        fmt::format(R"({{"type": "leave", "room": "{}"}})", room)));
+}
+
+void Session::leave() {
+    if (!joined_) {
+        return;
+    }
+    joined_ = false;
+
+    state_->leave_rooms(rooms_, {this->shared_from_this(), username_});
+    rooms_.clear();
+    replayed_.clear();
+    state_->leave({this->shared_from_this(), username_});
+
+    // Let the coroutine writer, if any, see that the session is over
+    write_signal_.cancel();
+    cancel(grace_timer_);
+    cancel(deadline_);
+    cancel(heartbeat_);
+}
+
+void Session::send(PassFrame frame) {
 
     // Post our work to the strand, this ensures
     asio::post(ws_.get_executor(),
                beast::bind_front_handler(&Session::on_send, shared_from_this(),
-                                         msg->stringify()));
+                                         frame));
 }
 
-void Session::on_send(const std::string msg) {
-    queue_.push(msg);
+void Session::deliver(PassFrame frame, std::uint64_t seq) {
+    asio::post(ws_.get_executor(),
+               beast::bind_front_handler(&Session::on_deliver,
+                                         shared_from_this(), frame, seq));
+}
+
+void Session::on_deliver(PassFrame frame, std::uint64_t seq) {
+    // Loaded the snapshot after the join, but pushed before the history was
+    // read
+    for (const auto &replayed : replayed_) {
+        if (seq >= replayed.first && seq <= replayed.last &&
+            replayed.room == frame->room()) {
+            return;
+        }
+    }
+    on_send(frame);
+}
+
+void Session::on_send(PassFrame frame) {
+    if (!enqueue(frame)) {
+        return;
+    }
+
+    start_write();
+}
+
+void Session::start_write() {
+    // The coroutine engine has its own writer, wake it up
+    if (state_->config().engine == Engine::coroutine) {
+        write_signal_.cancel_one();
+        return;
+    }
 
     // Are we already writing?
-    if (queue_.size() > 1) {
+    if (writing_ > 0 || queue_.empty()) {
+        return;
+    }
+
+    do_write();
+}
+
+void Session::do_write() {
+    if (!prebuilt_writes()) {
+        writing_ = 1;
+        trace_write();
+        ws_.async_write(
+            queue_.front()->encoded(ws_.encoding()).buffer(),
+            beast::bind_front_handler(&Session::on_write, shared_from_this()));
         return;
     }
 
-    ws_.async_write(
-        asio::buffer(queue_.front()),
+    // Beast may be writing a pong or a close frame, the stream parks the
+    // batch until it is done
+    prepare_batch();
+    ws_.next_layer().async_write_batch(
+        scratch_->write_buffers,
         beast::bind_front_handler(&Session::on_write, shared_from_this()));
 }
 
+void Session::prepare_batch() {
+    writing_ = std::min(queue_.size(),
+                        state_->config().batch_writes ? max_batch : 1);
+    auto &write_buffers = scratch().write_buffers;
+    write_buffers.clear();
+    auto const encoding = ws_.encoding();
+    if (ws_.deflate()) {
+        auto const min_size = state_->config().deflate_min_size;
+        std::uint64_t saved = 0;
+        for (std::size_t i = 0; i < writing_; ++i) {
+            auto const &frame = queue_[i]->encoded(encoding);
+            auto const buffers = frame.deflated(min_size);
+            saved += frame.header().size() + frame.size() -
+                     buffers[0].size() - buffers[1].size();
+            write_buffers.insert(write_buffers.end(), buffers.begin(),
+                                 buffers.end());
+        }
+        if (saved != 0) {
+            bump(metrics().deflate_bytes_saved, saved);
+        }
+    } else {
+        for (std::size_t i = 0; i < writing_; ++i) {
+            auto const &frame = queue_[i]->encoded(encoding);
+            write_buffers.push_back(frame.header());
+            write_buffers.push_back(frame.buffer());
+        }
+    }
+
+#ifdef TCP_CORK
+    // Same condition as the uncork of complete_write()
+    if (state_->config().batch_writes && state_->config().tcp_cork) {
+        beast::error_code ec;
+        beast::get_lowest_layer(ws_).socket().set_option(cork_option(true),
+                                                         ec);
+    }
+#endif
+    trace_write();
+}
+
+bool Session::traced(const Frame &frame) const {
+    // A replayed frame was fanned out before the session joined
+    return frame.received() != 0 && frame.fanout() >= trace_since_;
+}
+
+void Session::trace_write() {
+    if (!state_->config().trace) {
+        return;
+    }
+    write_started_ = trace_clock();
+    for (std::size_t i = 0; i < writing_; ++i) {
+        if (traced(*queue_[i])) {
+            metrics().record(Stage::queue_wait,
+                             write_started_ - queue_[i]->fanout());
+        }
+    }
+}
+
+void Session::complete_write() {
+#ifdef TCP_CORK
+    if (state_->config().batch_writes && state_->config().tcp_cork) {
+        // Uncorking flushes the partial segment at the end of the batch
+        beast::error_code ec;
+        beast::get_lowest_layer(ws_).socket().set_option(cork_option(false),
+                                                         ec);
+    }
+#endif
+
+    auto &counters = metrics();
+    if (write_started_ != 0) {
+        auto const now = trace_clock();
+        for (std::size_t i = 0; i < writing_; ++i) {
+            if (traced(*queue_[i])) {
+                counters.record(Stage::write, now - write_started_);
+                counters.record(Stage::total, now - queue_[i]->received());
+            }
+        }
+        write_started_ = 0;
+    }
+    bump(counters.messages_out, writing_);
+    for (; writing_ > 0; --writing_) {
+        bump(counters.bytes_out, queue_.front()->size());
+        queued_bytes_ -= queue_.front()->size();
+        queue_.pop_front();
+    }
+
+    if (in_grace_ && !over_limits(0)) {
+        in_grace_ = false;
+        cancel(grace_timer_);
+    }
+
+    // An idle session only holds write memory while it writes
+    if (idle_ && queue_.empty()) {
+        scratch_.reset();
+        queue_.shrink_to_fit();
+        account();
+    }
+}
+
 void Session::on_write(beast::error_code ec, std::size_t bytes_transferred) {
     boost::ignore_unused(bytes_transferred);
 
@@ -115,11 +810,83 @@ void Session::on_write(beast::error_code ec, std::size_t bytes_transferred) {
         return fail(ec, "write");
     }
 
-    queue_.pop();
+    complete_write();
 
     if (!queue_.empty()) {
-        ws_.async_write(
-            asio::buffer(queue_.front()),
-            beast::bind_front_handler(&Session::on_write, shared_from_this()));
+        do_write();
     }
+}
+
+bool Session::enqueue(PassFrame frame) {
+    if (!queue_.empty() && over_limits(frame->size())) {
+        bump(metrics().queue_overflows);
+
+        switch (state_->config().slow_consumer) {
+        case SlowConsumerPolicy::drop_newest:
+            bump(metrics().dropped_newest);
+            return false;
+
+        case SlowConsumerPolicy::disconnect:
+            if (!in_grace_) {
+                in_grace_ = true;
+                arm(grace_timer_, &Session::on_grace_timeout,
+                    state_->config().slow_consumer_grace);
+            }
+            bump(metrics().dropped_newest);
+            return false;
+
+        case SlowConsumerPolicy::coalesce:
+            if (!frame->key().empty()) {
+                for (auto it = droppable(); it != queue_.end();) {
+                    if ((*it)->key() == frame->key()) {
+                        bump(metrics().coalesced);
+                        it = drop(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+            [[fallthrough]];
+
+        case SlowConsumerPolicy::drop_oldest:
+            while (droppable() != queue_.end() &&
+                   over_limits(frame->size())) {
+                bump(metrics().dropped_oldest);
+                drop(droppable());
+            }
+            break;
+        }
+    }
+
+    queued_bytes_ += frame->size();
+    queue_.push_back(frame);
+    metrics().queue_depth.observe(queue_.size());
+    return true;
+}
+
+bool Session::over_limits(std::size_t bytes) const {
+    auto const &config = state_->config();
+    return queue_.size() >= config.queue_max_messages ||
+           queued_bytes_ + bytes > config.queue_max_bytes;
+}
+
+FrameQueue::iterator Session::droppable() {
+    // The front frame is about to be written even if no write has started
+    auto const busy = std::max<std::size_t>(writing_, 1);
+    return queue_.size() <= busy ? queue_.end()
+                                 : std::next(queue_.begin(), busy);
+}
+
+FrameQueue::iterator Session::drop(FrameQueue::iterator it) {
+    queued_bytes_ -= (*it)->size();
+    return queue_.erase(it);
+}
+
+void Session::on_grace_timeout() {
+    if (!in_grace_) {
+        return;
+    }
+
+    bump(metrics().slow_consumers_disconnected);
+    beast::get_lowest_layer(ws_).close();
 }
\ No newline at end of file
@@ -13,11 +13,27 @@
 #pragma once
 
 #include "base.h"
+#include "config.h"
+#include "frame.h"
+#include "frame_queue.h"
+#include "rate_limiter.h"
 #include "state.h"
+#include "timer_wheel.h"
 #include "websocket.h"
 
+#include <array>
+#include <boost/asio/steady_timer.hpp>
+#ifdef MESSAGE_COROUTINE_ENGINE
+#include <boost/asio/awaitable.hpp>
+#endif
+#include <boost/beast/http.hpp>
+#include <chrono>
 #include <memory>
-#include <queue>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Message;
 
 /**
  * @brief Session class, handle a single connection.
@@ -38,12 +54,14 @@ class Session : public std::enable_shared_from_this<Session> {
      * state of the server.
      */
     Session(tcp::socket &&socket, std::shared_ptr<State> state);
+    Session(const Session &) = delete;
+    Session &operator=(const Session &) = delete;
     /**
      * @brief Destroy the Session object.
-     * @details Destroy the Session object, and close the connection.
+     * @details Cancel the timers, give the read buffer back to the session
+     * pool, and release the accounted memory.
      */
     ~Session();
-
     /**
      * @brief Run the session.
      * @details Run the session, start handling the connection.
@@ -53,11 +71,126 @@ class Session : public std::enable_shared_from_this<Session> {
      * @brief Send a message to the client.
      * @details Send a message to the client.
      *
-     * @param msg The message to be sent.
+     * @param frame The frame to be sent. The frame is shared with the other
+     * recipients, and it is never copied.
      */
-    void send(PassMsg msg);
+    void send(PassFrame frame);
+    /**
+     * @brief Send a broadcast frame to the client.
+     * @details Like send(), but the frame is dropped if it was already
+     * replayed to the client when it joined.
+     * @see State::join
+     *
+     * @param frame The frame to be sent.
+     * @param seq The sequence number of the frame in the history of its
+     * room, or 0 if it was not recorded.
+     */
+    void deliver(PassFrame frame, std::uint64_t seq);
 
   private:
+    /**
+     * @brief The maximum number of rooms a session can join.
+     */
+    static constexpr std::size_t max_rooms = 256;
+    /**
+     * @brief The time a client has to log in after the handshake.
+     */
+    static constexpr std::chrono::seconds login_timeout{10};
+    /**
+     * @brief The time a client has to send its upgrade request.
+     */
+    static constexpr std::chrono::seconds handshake_timeout{30};
+    /**
+     * @brief The silence after which the client is pinged, and the time it
+     * then has to answer.
+     * @details Half of the idle timeout Beast suggests for servers.
+     */
+    static constexpr std::chrono::seconds keepalive_interval{150};
+    /**
+     * @brief The maximum number of frames in one batch write.
+     * @details Two buffers per frame, so that the batch fits in the 64 buffers
+     * asio hands to a single writev call.
+     */
+    static constexpr std::size_t max_batch = 32;
+    /**
+     * @brief The size of the read that waits for a message in idle mode.
+     */
+    static constexpr std::size_t peek_size = 16;
+
+    /**
+     * @brief The scratch state of a session.
+     * @details Kept out of the session and allocated on first use, since most
+     * sessions only need it for a while: the upgrade request during the
+     * handshake, the JSON text of CBOR messages and the buffers of batch
+     * writes. It is freed after the handshake and when the session goes idle.
+     */
+    struct Scratch {
+        /**
+         * @brief The upgrade request of the client.
+         * @details Read before the handshake to negotiate the subprotocol.
+         */
+        http::request<http::string_body> request;
+        /**
+         * @brief The JSON text of the last binary message.
+         * @details Reused from one message to the next.
+         * @see Session::received
+         */
+        std::string decoded;
+        /**
+         * @brief The buffers of the batch being written.
+         * @details Reused from one batch to the next.
+         */
+        std::vector<asio::const_buffer> write_buffers;
+    };
+
+    /**
+     * @brief The sequence numbers of the frames replayed from a history.
+     */
+    struct Replayed {
+        /**
+         * @brief The room of the history, empty for the state.
+         */
+        std::string room;
+        /**
+         * @brief The sequence number of the oldest frame replayed.
+         */
+        std::uint64_t first;
+        /**
+         * @brief The sequence number of the newest frame replayed.
+         */
+        std::uint64_t last;
+    };
+
+    /**
+     * @brief WheelTimer class, a timer of the session on its timer wheel.
+     * @details An expiry posts the handler to the strand of the session, and
+     * holds the session until then. A stale expiry, from before the last arm
+     * or cancel, is ignored there. A pending timer does not keep the session
+     * alive.
+     */
+    class WheelTimer final : public TimerWheel::Timer {
+      public:
+        /**
+         * @brief Construct a new WheelTimer object.
+         *
+         * @param session The session that owns the timer.
+         */
+        explicit WheelTimer(Session &session) : session_(session) {}
+
+        /**
+         * @brief The handler called on the strand when the timer expires.
+         */
+        void (Session::*handler)() = nullptr;
+
+      private:
+        void expire(std::uint64_t generation) override;
+
+        /**
+         * @brief The session that owns the timer.
+         */
+        Session &session_;
+    };
+
     /**
      * @brief The websocket object.
      * @details The websocket object, which is used to communicate with the
@@ -66,13 +199,90 @@ class Session : public std::enable_shared_from_this<Session> {
      * the connection alive, and send and receive messages.
      */
     WebSocket ws_;
-    std::string username_;
+    /**
+     * @brief The timer wheel of the session.
+     * @details Picked from the state when the session runs. It is shared with
+     * the other sessions of its stripe, which may run on any io thread of the
+     * io_context.
+     * @see State::timer_wheel
+     */
+    TimerWheel *wheel_ = nullptr;
+    /**
+     * @brief The handshake and login deadline, then the idle checks.
+     * @details Armed when the session runs, re-armed when the handshake
+     * completes, and cancelled when the client logs in. In idle mode, it is
+     * then armed to check whether the client has gone silent.
+     */
+    WheelTimer deadline_{*this};
+    /**
+     * @brief The keep-alive timer.
+     * @details Armed once the handshake completes, and every
+     * keepalive_interval after that.
+     * @see Session::on_heartbeat
+     */
+    WheelTimer heartbeat_{*this};
+    /**
+     * @brief The wake-up signal of the coroutine writer.
+     * @details The writer waits on it while the queue is empty. on_send()
+     * and leave() cancel the wait. Unused by the callback engine.
+     */
+    asio::steady_timer write_signal_;
+    /**
+     * @brief The slow consumer grace period.
+     * @details Armed when the queue goes over its limits under the disconnect
+     * policy, and cancelled when it drains back under them.
+     */
+    WheelTimer grace_timer_{*this};
+    /**
+     * @brief The rate of the session.
+     */
+    TokenBucket bucket_;
+    /**
+     * @brief The rate of the client address, shared with its other sessions.
+     * @details Null if client addresses are not limited.
+     */
+    TokenBucket *ip_bucket_ = nullptr;
+    /**
+     * @brief Whether the grace period is running.
+     */
+    bool in_grace_ = false;
+    /**
+     * @brief The name of the user, interned by the user index at login.
+     * @details Null until the client logs in.
+     */
+    Username username_;
+    /**
+     * @brief Whether the session has joined the state.
+     * @details The state holds a reference to a joined session, so a joined
+     * session must leave explicitly before it can be destroyed.
+     */
+    bool joined_ = false;
+    /**
+     * @brief The rooms the session has joined.
+     * @details Only touched on the strand of the session. A session can only
+     * send to the rooms it has joined.
+     */
+    std::vector<std::string> rooms_;
+    /**
+     * @brief The frames replayed when the session joined the state and its
+     * rooms.
+     * @details A broadcast that raced with the join may also be delivered,
+     * it is dropped. Kept until the session leaves the room.
+     * @see Session::on_deliver
+     */
+    std::vector<Replayed> replayed_;
     /**
      * @brief The buffer object.
      * @details The buffer object, which is used to store the data received from
-     * the client.
+     * the client. Taken from the session pool, and given back to it.
+     * @see SessionPool
      */
-    std::shared_ptr<beast::flat_buffer> buffer_;
+    beast::flat_buffer buffer_;
+    /**
+     * @brief The scratch state, if allocated.
+     * @see Session::scratch
+     */
+    std::unique_ptr<Scratch> scratch_;
     /**
      * @brief The state object.
      * @details The state object, which is used to store the state of the
@@ -81,34 +291,269 @@ class Session : public std::enable_shared_from_this<Session> {
     std::shared_ptr<State> state_;
     /**
      * @brief The queue object.
-     * @details The queue object, which is used to store the messages to be
-     * sent to the client.
+     * @details The queue object, which is used to store the frames to be
+     * sent to the client. The frames at the front are the ones being
+     * written, so the slow consumer policies never drop them.
+     */
+    FrameQueue queue_;
+    /**
+     * @brief The number of frames being written, at the front of the queue.
+     */
+    std::size_t writing_ = 0;
+    /**
+     * @brief The number of bytes in the queue.
+     */
+    std::size_t queued_bytes_ = 0;
+    /**
+     * @brief The time the last login or room join, when tracing.
+     * @details Frames fanned out before were replayed, and are not traced.
+     */
+    std::int64_t trace_since_ = 0;
+    /**
+     * @brief The start of the write in progress, when tracing.
      */
-    std::queue<std::string> queue_;
+    std::int64_t write_started_ = 0;
+    /**
+     * @brief The bytes received by the waiting read in idle mode.
+     */
+    std::array<char, peek_size> peek_{};
+    /**
+     * @brief The time the client last sent a message, in idle mode.
+     */
+    std::chrono::steady_clock::time_point last_active_;
+    /**
+     * @brief The memory accounted to the session in the metrics.
+     * @see Session::account
+     */
+    std::size_t accounted_ = 0;
+    /**
+     * @brief Whether the waiting read of idle mode is in progress.
+     * @details The read buffer is unused meanwhile.
+     */
+    bool peeking_ = false;
+    /**
+     * @brief Whether the session is idle, and has freed its buffers.
+     */
+    bool idle_ = false;
+    /**
+     * @brief Whether anything was received since the last heartbeat.
+     */
+    bool heard_ = false;
+    /**
+     * @brief Whether the last heartbeat pinged the client.
+     */
+    bool pinged_ = false;
 
     /**
      * @brief Read a message from the client.
-     * @details Read a message from the client.
+     * @details Read a message from the client. In idle mode, wait for it with
+     * a small read into peek_ first.
      */
     void do_read();
+    /**
+     * @brief Handle the waiting read of idle mode.
+     * @details Read the rest of the message into the buffer, unless it was
+     * complete.
+     *
+     * @param ec Error code.
+     * @param bytes_transferred The number of bytes read into peek_.
+     */
+    void on_peek(beast::error_code ec, std::size_t bytes_transferred);
+    /**
+     * @brief Move the bytes of the waiting read to the buffer.
+     * @details Mark the client active, and wake the session up if it was
+     * idle.
+     *
+     * @param bytes The number of bytes read into peek_.
+     * @return true The message is complete.
+     * @return false The rest of the message must still be read.
+     */
+    bool peeked(std::size_t bytes);
+    /**
+     * @brief Check whether the session is in idle mode.
+     *
+     * @return true Sessions go idle after Config::idle_after.
+     */
+    [[nodiscard]] bool idle_mode() const {
+        return state_->config().idle_after.count() > 0;
+    }
+    /**
+     * @brief Check whether the session writes prebuilt frames below Beast.
+     * @details With batch writes, or once the client negotiated
+     * permessage-deflate, since compressed frames are shared. Both go
+     * through the write gate of the stream.
+     * @see GatedStream
+     *
+     * @return true The frames are written by prepare_batch().
+     */
+    [[nodiscard]] bool prebuilt_writes() const {
+        return state_->config().batch_writes || ws_.deflate();
+    }
+    /**
+     * @brief Arm a timer of the session on its wheel.
+     *
+     * @param timer The timer.
+     * @param handler The handler called on the strand when it expires.
+     * @param after The time until it expires.
+     */
+    void arm(WheelTimer &timer, void (Session::*handler)(),
+             std::chrono::steady_clock::duration after);
+    /**
+     * @brief Cancel a timer of the session.
+     *
+     * @param timer The timer.
+     */
+    void cancel(WheelTimer &timer);
+    /**
+     * @brief Arm the idle check.
+     *
+     * @param after The time until the check.
+     */
+    void start_idle_check(std::chrono::steady_clock::duration after);
+    /**
+     * @brief Handle the idle check.
+     * @details Make the session idle if the client has been silent long
+     * enough and no message is being read or written. Otherwise check again
+     * later.
+     */
+    void on_idle_check();
+    /**
+     * @brief Make the session idle.
+     * @details Give the read buffer back to the pool, free the scratch state
+     * and shrink the queue and the rooms. The checks stop until the session
+     * wakes up.
+     */
+    void go_idle();
+    /**
+     * @brief Wake an idle session up.
+     * @details Take a read buffer from the pool, and restart the idle checks.
+     */
+    void wake();
+    /**
+     * @brief Get the scratch state, allocating it if needed.
+     *
+     * @return Scratch& The scratch state.
+     */
+    Scratch &scratch();
+    /**
+     * @brief Get the memory held by the session.
+     * @details The session itself, its read buffer, its queue, its names and
+     * its scratch state. The state of the Beast stream and the frames, which
+     * are shared, are not counted.
+     *
+     * @return std::size_t The memory, in bytes.
+     */
+    [[nodiscard]] std::size_t footprint() const;
+    /**
+     * @brief Update the memory accounted to the session in the metrics.
+     * @details Called when the footprint may have changed: after the
+     * handshake, the login, a control message, and when the session goes
+     * idle or wakes up.
+     */
+    void account();
     /**
      * @brief Dispatch a function to handle the message.
      * @details It can avoid the blocking of the main thread. It can also avoid
      * the blocking of the websocket object.
      */
     void on_run();
+    /**
+     * @brief Handle the upgrade request.
+     * @details Negotiate the subprotocol and accept the websocket handshake.
+     * A request that is not an upgrade is answered as plain HTTP.
+     *
+     * @param ec Error code.
+     * @param bytes_transferred The number of bytes transferred.
+     */
+    void on_request(beast::error_code ec, std::size_t bytes_transferred);
+    /**
+     * @brief Answer a request that is not a websocket upgrade.
+     * @details A plain GET of the metrics path gets the metrics, any other GET
+     * gets 404 and any other request 400. The response carries
+     * Connection: close, and the connection is shut down once it is written.
+     *
+     * @return true The request was answered.
+     * @return false The request is a websocket upgrade.
+     */
+    bool serve_http();
+    /**
+     * @brief Handle the end of a plain HTTP response.
+     *
+     * @param response The response, kept alive until it is written.
+     * @param ec Error code.
+     * @param bytes_transferred The number of bytes transferred.
+     */
+    void on_http_response(
+        const std::shared_ptr<http::response<http::string_body>> &response,
+        beast::error_code ec, std::size_t bytes_transferred);
+    /**
+     * @brief Negotiate the subprotocol of the upgrade request.
+     * @details The handshake deadline keeps running until the login deadline
+     * replaces it.
+     * @see WebSocket::negotiate
+     */
+    void negotiate();
     /**
      * @brief Begin to accept a message from the client.
      * @details Begin to accept a message from the client. It is called by
-     * on_run(). It can do some preparation work before accepting a message.
-     * Meanwhile, it will call on_read() to handle the message.
+     * on_request(). It arms the login deadline and waits for the login message.
      *
      * @param ec Error code.
      */
     void on_accept(beast::error_code ec);
+    /**
+     * @brief Arm the login deadline.
+     * @see Session::on_deadline
+     */
+    void start_login_deadline();
+    /**
+     * @brief Start the keep-alive pings.
+     * @details Count every frame received from the client as a sign of life,
+     * pongs included. With prebuilt writes, the pings wait for the batch in
+     * flight at the write gate.
+     * @see GatedStream
+     * @see Session::on_heartbeat
+     */
+    void start_heartbeat();
+    /**
+     * @brief Handle the keep-alive timer.
+     * @details If the client was silent since the last heartbeat, ping it, or
+     * close the connection if it was already pinged. Then re-arm the timer.
+     */
+    void on_heartbeat();
+    /**
+     * @brief Read the login message from the client.
+     * @details Read a message asynchronously, so that a client that does not
+     * log in never blocks an io thread.
+     */
+    void do_login();
+    /**
+     * @brief Handle the login message.
+     * @details If the message is login info, join the state, reply to the
+     * client and call do_read(). Otherwise, call do_login() again.
+     *
+     * @param ec Error code.
+     * @param bytes_transferred The number of bytes transferred.
+     */
+    void on_login(beast::error_code ec, std::size_t bytes_transferred);
+    /**
+     * @brief Handle the message in the buffer as a login message.
+     * @details If the message is login info, cancel the login deadline, join
+     * the state and queue the reply to the client, followed by the replay of
+     * the recent chat messages. The buffer is consumed.
+     *
+     * @return true The client is logged in.
+     * @return false The message is not login info.
+     */
+    bool handle_login();
+    /**
+     * @brief Handle the handshake or login deadline.
+     * @details Close the connection if the client has not logged in yet.
+     */
+    void on_deadline();
     /**
      * @brief Handle the message.
-     * @details Handle the message. It is called by on_accept(). It can do some
+     * @details Handle the message. It is called by on_login(). It can do some
      * post-processing work after accepting a message. Meanwhile, it will call
      * on_write() to send a message to the client.
      *
@@ -116,6 +561,67 @@ class Session : public std::enable_shared_from_this<Session> {
      * @param bytes_transferred The number of bytes transferred.
      */
     void on_read(beast::error_code ec, std::size_t bytes_transferred);
+    /**
+     * @brief Take a token for the message read.
+     * @details Take a token from the bucket of the session and from the bucket
+     * of its client address, if they are limited. The message is handled
+     * either way, but the next read waits until the buckets are paid back.
+     * Meanwhile the socket is not read, so TCP pushes back on the client.
+     * @see RateLimiter
+     *
+     * @return std::chrono::nanoseconds The time to wait before the next read.
+     */
+    std::chrono::nanoseconds throttle();
+    /**
+     * @brief Get the JSON text of the message in the buffer.
+     * @details A text message is returned as is. A binary message is CBOR,
+     * and it is transcoded to the scratch state, whatever the negotiated
+     * encoding.
+     *
+     * @return std::string_view The JSON text, or an empty string if the
+     * binary message is invalid. It lives until the buffer is consumed.
+     */
+    std::string_view received();
+    /**
+     * @brief Handle the message in the buffer.
+     * @details Relay a chat message, or handle a control message. The buffer
+     * is consumed.
+     */
+    void handle_message();
+    /**
+     * @brief Handle a control message.
+     * @details Handle the messages that are not relayed: join, leave,
+     * subscribe and user_list. Unknown messages are ignored.
+     *
+     * @param message The control message.
+     */
+    void on_control(const Message &message);
+    /**
+     * @brief Join a room.
+     * @details Add the session to the room, acknowledge it to the client and
+     * replay the recent chat messages of the room. It does nothing if the
+     * room is invalid, already joined, or if the session has joined too many
+     * rooms.
+     *
+     * @param room The room name.
+     */
+    void join_room(const std::string &room);
+    /**
+     * @brief Leave a room.
+     * @details Remove the session from the room, and acknowledge it to the
+     * client. It does nothing if the room was not joined.
+     *
+     * @param room The room name.
+     */
+    void leave_room(const std::string &room);
+    /**
+     * @brief Leave the state.
+     * @details Remove the session from the state and its rooms. The other
+     * clients learn about it from the next presence delta.
+     * It is called once the connection is closed. It does nothing if the
+     * session has not joined.
+     */
+    void leave();
     /**
      * @brief Send a message to the client.
      * @details Send a message to the client. It is called by send().
@@ -123,9 +629,105 @@ class Session : public std::enable_shared_from_this<Session> {
      * to the client. It can avoid the blocking of receiving multiple messages
      * at the same time.
      *
-     * @param msg The message to be sent.
+     * @param frame The frame to be sent.
      */
-    void on_send(const std::string msg);
+    void on_send(PassFrame frame);
+    /**
+     * @brief Send a broadcast frame to the client, unless it was replayed.
+     * @details It is called by deliver().
+     *
+     * @param frame The frame to be sent.
+     * @param seq The sequence number of the frame, or 0.
+     */
+    void on_deliver(PassFrame frame, std::uint64_t seq);
+    /**
+     * @brief Queue the frames replayed from a history, and remember their
+     * sequence numbers.
+     *
+     * @param room The room of the history, empty for the state.
+     * @param backlog The frames.
+     */
+    void replay(const std::string &room, const Backlog &backlog);
+    /**
+     * @brief Queue a frame, within the limits of the queue.
+     * @details If the queue is over its limits, apply the slow consumer
+     * policy. An empty queue always takes the frame.
+     * @see SlowConsumerPolicy
+     *
+     * @param frame The frame to be queued.
+     * @return true The frame was queued.
+     * @return false The frame was dropped.
+     */
+    bool enqueue(PassFrame frame);
+    /**
+     * @brief Start writing the queue.
+     * @details Wake the coroutine writer, or start a write if none is in
+     * progress.
+     */
+    void start_write();
+    /**
+     * @brief Check if the queue would be over its limits with more bytes.
+     *
+     * @param bytes The bytes to be added.
+     * @return true The queue would be over its limits.
+     * @return false The queue would be within its limits.
+     */
+    [[nodiscard]] bool over_limits(std::size_t bytes) const;
+    /**
+     * @brief Get the first queued frame that is not being written.
+     *
+     * @return FrameQueue::iterator The first frame that can be dropped.
+     */
+    FrameQueue::iterator droppable();
+    /**
+     * @brief Remove a queued frame that is not being written.
+     *
+     * @param it The frame to be removed. It must not be a frame being written.
+     * @return FrameQueue::iterator The frame after the removed one.
+     */
+    FrameQueue::iterator drop(FrameQueue::iterator it);
+    /**
+     * @brief Write the frames at the front of the queue.
+     * @details With batch writes, write up to max_batch frames with one gather
+     * write. A deflate session without batch writes writes its prebuilt
+     * frames one at a time. Otherwise, write the front frame with Beast. The
+     * queue must not be empty, and no write must be in progress.
+     */
+    void do_write();
+    /**
+     * @brief Fill the write buffers of the scratch state with the frames at
+     * the front of the queue.
+     * @details Mark the frames as being written, cork the socket if
+     * configured, and record the queue wait of the traced frames.
+     */
+    void prepare_batch();
+    /**
+     * @brief Check if the stages of a queued frame are recorded.
+     *
+     * @param frame The frame.
+     * @return true The frame is traced, and was fanned out to the session.
+     * @return false The frame is not traced, or it was replayed.
+     */
+    [[nodiscard]] bool traced(const Frame &frame) const;
+    /**
+     * @brief Record the queue wait of the frames being written, when
+     * tracing.
+     * @details Called when a write starts, once writing_ is set.
+     */
+    void trace_write();
+    /**
+     * @brief Remove the frames that were written.
+     * @details Record the write and total stages of the traced frames. Uncork
+     * the socket if configured. End the grace period if the
+     * queue is back within its limits. An idle session frees its write memory
+     * once the queue is empty.
+     */
+    void complete_write();
+    /**
+     * @brief Handle the end of the grace period.
+     * @details Close the connection if the queue is still over its limits.
+     */
+    void on_grace_timeout();
     /**
      * @brief Begin to send a message to the client.
      * @details Begin to send a message to the client. It is called by
@@ -135,4 +737,20 @@ class Session : public std::enable_shared_from_this<Session> {
      * @param ec Error code.
      */
     void on_write(beast::error_code ec, std::size_t bytes_transferred);
+
+#ifdef MESSAGE_COROUTINE_ENGINE
+    /**
+     * @brief Run the session as a coroutine.
+     * @details Accept the handshake, wait for the login message, start the
+     * writer, then read messages in a loop until the connection is closed.
+     */
+    asio::awaitable<void> co_run();
+    /**
+     * @brief Write the queued frames as a coroutine.
+     * @details Write the frames as do_write() does, and sleep on
+     * write_signal_ while the queue is empty. It returns when the session
+     * leaves.
+     */
+    asio::awaitable<void> co_write();
+#endif
 };
\ No newline at end of file
@@ -0,0 +1,158 @@
+/**
+ * @file session_coro.cpp
+ * @brief Session class implementation, coroutine engine.
+ * @details The coroutine engine drives a session with two C++20 coroutines:
+ * a straight-line reader and a separate writer. It is only built when
+ * MESSAGE_COROUTINE_ENGINE is defined, and it is selected at startup with
+ * --engine=coroutine.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-16
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#include "session.h"
+
+#ifdef MESSAGE_COROUTINE_ENGINE
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <chrono>
+
+asio::awaitable<void> Session::co_run() {
+    beast::error_code ec;
+    auto token = asio::redirect_error(asio::use_awaitable, ec);
+
+    ws_.run(state_->config());
+
+    // Read the upgrade request ourselves, to see the offered subprotocols
+    arm(deadline_, &Session::on_deadline, handshake_timeout);
+    co_await http::async_read(ws_.next_layer(), buffer_, scratch().request,
+                              token);
+    if (ec) {
+        if (ec != http::error::end_of_stream) {
+            fail(ec, "request");
+        }
+        co_return;
+    }
+    if (serve_http()) {
+        co_return;
+    }
+    negotiate();
+
+    // Accept the websocket handshake
+    co_await ws_.async_accept(scratch_->request, token);
+    scratch_.reset();
+    account();
+    if (ec) {
+        fail(ec, "accept");
+        co_return;
+    }
+
+    start_login_deadline();
+    start_heartbeat();
+    for (;;) {
+        co_await ws_.async_read(buffer_, token);
+        if (ec) {
+            if (ec != websocket::error::closed && ec != asio::error::eof &&
+                ec != asio::error::operation_aborted) {
+                fail(ec, "login");
+            }
+            co_return;
+        }
+        if (handle_login()) {
+            break;
+        }
+
+        // The writer only runs once the session joins, so a refused login
+        // is answered here
+        while (!queue_.empty()) {
+            writing_ = 1;
+            co_await ws_.async_write(
+                queue_.front()->encoded(ws_.encoding()).buffer(), token);
+            if (ec) {
+                fail(ec, "write");
+                co_return;
+            }
+            complete_write();
+        }
+    }
+
+    asio::co_spawn(
+        ws_.get_executor(),
+        [self = shared_from_this()] { return self->co_write(); },
+        asio::detached);
+
+    // The frame of this coroutine lives as long as the connection, and
+    // asio recycles the frames of the operations it awaits, so the loop
+    // itself does not allocate.
+    for (;;) {
+        if (idle_mode()) {
+            peeking_ = true;
+            auto const bytes =
+                co_await ws_.async_read_some(asio::buffer(peek_), token);
+            peeking_ = false;
+            if (!ec && !peeked(bytes)) {
+                co_await ws_.async_read(buffer_, token);
+            }
+        } else {
+            co_await ws_.async_read(buffer_, token);
+        }
+        if (ec) {
+            if (ec != websocket::error::closed && ec != asio::error::eof) {
+                fail(ec, "read");
+            }
+            break;
+        }
+        handle_message();
+
+        // The wheel calls handlers, not coroutines. Pauses are rare, so a
+        // timer on the frame of the reader is enough.
+        auto const wait = throttle();
+        if (wait.count() > 0) {
+            asio::steady_timer pause(ws_.get_executor(), wait);
+            co_await pause.async_wait(token);
+        }
+    }
+
+    leave();
+}
+
+asio::awaitable<void> Session::co_write() {
+    beast::error_code ec;
+    auto token = asio::redirect_error(asio::use_awaitable, ec);
+
+    while (joined_) {
+        if (queue_.empty()) {
+            // Sleep until on_send() or leave() cancels the wait
+            write_signal_.expires_at(
+                std::chrono::steady_clock::time_point::max());
+            co_await write_signal_.async_wait(token);
+            continue;
+        }
+
+        if (prebuilt_writes()) {
+            prepare_batch();
+            co_await ws_.next_layer().async_write_batch(
+                scratch_->write_buffers, token);
+        } else {
+            writing_ = 1;
+            trace_write();
+            co_await ws_.async_write(
+                queue_.front()->encoded(ws_.encoding()).buffer(), token);
+        }
+        if (ec) {
+            if (ec != websocket::error::closed && ec != asio::error::eof) {
+                fail(ec, "write");
+            }
+            co_return;
+        }
+        complete_write();
+    }
+}
+
+#endif
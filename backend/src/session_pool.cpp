@@ -0,0 +1,89 @@
+/**
+ * @file session_pool.cpp
+ * @brief SessionPool class implementation.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-18
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#include "session_pool.h"
+#include "metrics.h"
+
+#include <utility>
+
+SessionPool &session_pool() {
+    static SessionPool instance;
+    return instance;
+}
+
+SessionPool::~SessionPool() {
+    for (auto *slot : slots_) {
+        ::operator delete(slot);
+    }
+}
+
+void SessionPool::configure(const Config &config) {
+    std::lock_guard<std::mutex> const lock(mutex_);
+    size_ = config.pool_size;
+    buffer_capacity_ = config.pool_buffer_capacity;
+    slots_.reserve(size_);
+    buffers_.reserve(size_);
+}
+
+void *SessionPool::allocate(std::size_t size) {
+    {
+        std::lock_guard<std::mutex> const lock(mutex_);
+        if (size == slot_size_ && !slots_.empty()) {
+            auto *const slot = slots_.back();
+            slots_.pop_back();
+            bump(metrics().session_pool_hits);
+            return slot;
+        }
+        if (slot_size_ == 0) {
+            slot_size_ = size;
+        }
+    }
+    bump(metrics().session_pool_misses);
+    return ::operator new(size);
+}
+
+void SessionPool::deallocate(void *slot, std::size_t size) noexcept {
+    {
+        std::lock_guard<std::mutex> const lock(mutex_);
+        if (size == slot_size_ && slots_.size() < size_) {
+            slots_.push_back(slot);
+            return;
+        }
+    }
+    ::operator delete(slot);
+}
+
+beast::flat_buffer SessionPool::acquire_buffer() {
+    {
+        std::lock_guard<std::mutex> const lock(mutex_);
+        if (!buffers_.empty()) {
+            auto buffer = std::move(buffers_.back());
+            buffers_.pop_back();
+            bump(metrics().buffer_pool_hits);
+            return buffer;
+        }
+    }
+    bump(metrics().buffer_pool_misses);
+    return beast::flat_buffer();
+}
+
+void SessionPool::release_buffer(beast::flat_buffer &&buffer) noexcept {
+    // A buffer that grew for one huge message is not worth keeping
+    if (buffer.capacity() == 0 || buffer.capacity() > buffer_capacity_) {
+        return;
+    }
+    buffer.clear();
+
+    std::lock_guard<std::mutex> const lock(mutex_);
+    if (buffers_.size() < size_) {
+        buffers_.push_back(std::move(buffer));
+    }
+}
@@ -0,0 +1,170 @@
+/**
+ * @file session_pool.h
+ * @brief SessionPool class definition. Recycle the memory of closed sessions
+ * for the next connections.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-18
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#pragma once
+
+#include "base.h"
+#include "config.h"
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+/**
+ * @brief SessionPool class, the free lists of session slots and read buffers.
+ * @details A slot is the single block that holds a session and its shared_ptr
+ * control block. A read buffer keeps the capacity it grew to, up to a cap, so
+ * a reconnecting client reads into warm memory. Both free lists are bounded,
+ * and reserved up front, so the pool itself never allocates once configured.
+ *
+ * The pool is shared by every thread, and its mutex is only taken when a
+ * connection is accepted or a session is destroyed.
+ * @see SessionAllocator
+ */
+class SessionPool {
+  public:
+    SessionPool() = default;
+    SessionPool(const SessionPool &) = delete;
+    SessionPool &operator=(const SessionPool &) = delete;
+    /**
+     * @brief Destroy the SessionPool object, and free the retained slots.
+     */
+    ~SessionPool();
+
+    /**
+     * @brief Set the limits of the pool.
+     * @details It must be called before any session is created.
+     *
+     * @param config The server settings.
+     */
+    void configure(const Config &config);
+
+    /**
+     * @brief Allocate a session slot.
+     * @details A retained slot is reused if it has the same size.
+     *
+     * @param size The size of the slot.
+     * @return void* The slot.
+     */
+    void *allocate(std::size_t size);
+    /**
+     * @brief Free a session slot.
+     * @details The slot is retained, unless the free list is full.
+     *
+     * @param slot The slot.
+     * @param size The size of the slot.
+     */
+    void deallocate(void *slot, std::size_t size) noexcept;
+
+    /**
+     * @brief Get a read buffer.
+     *
+     * @return beast::flat_buffer An empty buffer, warm if one was retained.
+     */
+    beast::flat_buffer acquire_buffer();
+    /**
+     * @brief Give a read buffer back.
+     * @details The buffer is cleared and retained, unless the free list is
+     * full or the buffer grew over the capacity cap.
+     *
+     * @param buffer The buffer.
+     */
+    void release_buffer(beast::flat_buffer &&buffer) noexcept;
+
+  private:
+    /**
+     * @brief The mutex of the free lists.
+     */
+    std::mutex mutex_;
+    /**
+     * @brief The maximum number of slots, and of buffers, retained.
+     */
+    std::size_t size_ = 0;
+    /**
+     * @brief The maximum capacity of a retained buffer, in bytes.
+     */
+    std::size_t buffer_capacity_ = 0;
+    /**
+     * @brief The size of a slot.
+     * @details Set by the first allocation. Every session has the same type,
+     * so every slot has the same size.
+     */
+    std::size_t slot_size_ = 0;
+    /**
+     * @brief The retained slots.
+     */
+    std::vector<void *> slots_;
+    /**
+     * @brief The retained buffers.
+     */
+    std::vector<beast::flat_buffer> buffers_;
+};
+
+/**
+ * @brief Get the session pool of the server.
+ *
+ * @return SessionPool& The pool.
+ */
+SessionPool &session_pool();
+
+/**
+ * @brief SessionAllocator class, allocate sessions from the session pool.
+ * @details Meant for std::allocate_shared, which allocates the session and
+ * its control block as one object.
+ *
+ * @tparam T The type of the allocated objects.
+ */
+template <typename T> class SessionAllocator {
+  public:
+    using value_type = T;
+
+    SessionAllocator() = default;
+    template <typename U>
+    SessionAllocator(const SessionAllocator<U> & /*other*/) noexcept {}
+
+    /**
+     * @brief Allocate objects, from the pool if there is only one.
+     *
+     * @param n The number of objects.
+     * @return T* The storage of the objects.
+     */
+    T *allocate(std::size_t n) {
+        if (n != 1) {
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T *>(session_pool().allocate(sizeof(T)));
+    }
+
+    /**
+     * @brief Free objects allocated by allocate().
+     *
+     * @param p The storage of the objects.
+     * @param n The number of objects.
+     */
+    void deallocate(T *p, std::size_t n) noexcept {
+        if (n != 1) {
+            ::operator delete(p);
+            return;
+        }
+        session_pool().deallocate(p, sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const SessionAllocator<U> & /*other*/) const noexcept {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const SessionAllocator<U> & /*other*/) const noexcept {
+        return false;
+    }
+};
@@ -0,0 +1,165 @@
+/**
+ * @file shard.cpp
+ * @brief Shard and ShardGroup class implementation.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-14
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#include "shard.h"
+#include "frame.h"
+#include "listener.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+
+#include <boost/asio/signal_set.hpp>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+Shard::Shard(std::size_t index, std::size_t shards,
+             const std::shared_ptr<const Config> &config,
+             const std::shared_ptr<MessageLog> &log,
+             const std::shared_ptr<Presence> &presence,
+             const std::shared_ptr<UserIndex> &users)
+    : index_(index), ioc_(1), state_(std::make_shared<State>(config)) {
+    inboxes_.reserve(shards);
+    for (std::size_t i = 0; i < shards; ++i) {
+        inboxes_.push_back(std::make_unique<Inbox>(ring_capacity));
+    }
+
+    state_->set_relay([this](PassFrame frame) { relay(frame); });
+    if (log) {
+        state_->set_log(log);
+    }
+    state_->set_presence(presence);
+    state_->set_users(users);
+    state_->set_timer_wheels({TimerWheel::start(ioc_, config->timer_tick)});
+
+    std::make_shared<Listener>(
+        Listener::make_acceptor(ioc_, {config->address, config->port}, true),
+        ioc_, state_)
+        ->run();
+}
+
+void Shard::connect(const std::vector<std::unique_ptr<Shard>> &shards) {
+    for (const auto &shard : shards) {
+        if (shard.get() != this) {
+            peers_.push_back(shard.get());
+        }
+    }
+}
+
+void Shard::run() {
+    ioc_.run();
+}
+
+void Shard::stop() {
+    ioc_.stop();
+}
+
+void Shard::relay(PassFrame frame) {
+    for (auto *peer : peers_) {
+        auto &inbox = *peer->inboxes_[index_];
+        auto copy = frame;
+        // Only this thread parks frames, so a frame is never pushed to the
+        // ring while older ones wait in the overflow
+        if (inbox.parked.load(std::memory_order_relaxed) ||
+            !inbox.ring.try_push(std::move(copy))) {
+            // The peer is far behind. Park the frame rather than drop it.
+            std::lock_guard<std::mutex> const lock(inbox.overflow_mutex);
+            inbox.overflow.push_back(frame);
+            inbox.parked.store(true, std::memory_order_release);
+            bump(metrics().relay_overflows);
+        }
+        if (!inbox.scheduled.exchange(true, std::memory_order_acq_rel)) {
+            asio::post(peer->ioc_,
+                       [peer, from = index_] { peer->drain(from); });
+        }
+    }
+}
+
+void Shard::drain(std::size_t from) {
+    auto &inbox = *inboxes_[from];
+    // Clear the flag first, so that a frame pushed after the last pop below
+    // schedules another drain. A plain store could be reordered after the
+    // reads of the ring. The exchange is ordered with the one of relay(): if
+    // it comes after it, it sees its push, otherwise relay() sees false.
+    inbox.scheduled.exchange(false, std::memory_order_acq_rel);
+
+    // The frames in the ring when the overflow started are older than it
+    bool const parked = inbox.parked.load(std::memory_order_acquire);
+    std::shared_ptr<const Frame> frame;
+    while (inbox.ring.try_pop(frame)) {
+        state_->deliver(frame);
+    }
+    if (!parked) {
+        return;
+    }
+
+    std::deque<std::shared_ptr<const Frame>> overflow;
+    {
+        std::lock_guard<std::mutex> const lock(inbox.overflow_mutex);
+        overflow.swap(inbox.overflow);
+        inbox.parked.store(false, std::memory_order_relaxed);
+    }
+    for (const auto &parked_frame : overflow) {
+        state_->deliver(parked_frame);
+    }
+}
+
+ShardGroup::ShardGroup(const std::shared_ptr<const Config> &config,
+                       const std::shared_ptr<MessageLog> &log) {
+    auto const shards = static_cast<std::size_t>(config->threads);
+    auto const presence = std::make_shared<Presence>();
+    auto const users = std::make_shared<UserIndex>();
+    shards_.reserve(shards);
+    for (std::size_t i = 0; i < shards; ++i) {
+        shards_.push_back(
+            std::make_unique<Shard>(i, shards, config, log, presence, users));
+    }
+    for (const auto &shard : shards_) {
+        shard->connect(shards_);
+    }
+}
+
+void ShardGroup::run() {
+    // Capture SIGINT and SIGTERM to perform a clean shutdown
+    asio::signal_set signals(shards_.front()->context(), SIGINT, SIGTERM);
+    signals.async_wait([this](boost::system::error_code const &, int) {
+        for (const auto &shard : shards_) {
+            shard->stop();
+        }
+    });
+
+    // Capture SIGUSR1 to print the stage latencies and the memory
+    asio::signal_set dump(shards_.front()->context(), SIGUSR1);
+    report_on(dump);
+
+    // The first shard publishes the presence deltas, the relay reaches the
+    // clients of the others
+    asio::steady_timer presence(shards_.front()->context());
+    shards_.front()->state().publish_presence_on(presence);
+
+    auto const cores = std::max(1U, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    threads.reserve(shards_.size());
+    for (std::size_t i = 0; i < shards_.size(); ++i) {
+        threads.emplace_back([shard = shards_[i].get()] { shard->run(); });
+#ifdef __linux__
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(i % cores, &cpus);
+        pthread_setaffinity_np(threads.back().native_handle(), sizeof(cpus),
+                               &cpus);
+#endif
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
@@ -0,0 +1,197 @@
+/**
+ * @file shard.h
+ * @brief Shard and ShardGroup class definition. In sharded mode, every thread
+ * owns its own io_context, acceptor and state.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-14
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#pragma once
+
+#include "base.h"
+#include "config.h"
+#include "spsc_ring.h"
+#include "state.h"
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Shard class, one io_context with its acceptor and its sessions.
+ * @details A shard is run by a single thread. Its sessions, its state and its
+ * listener never see another thread. Broadcasts reach the other shards through
+ * one single producer, single consumer ring per pair of shards, so no lock is
+ * shared between shards.
+ * @see ShardGroup
+ */
+class Shard {
+  public:
+    /**
+     * @brief Construct a new Shard object.
+     * @details Construct a new Shard object, and start listening on its own
+     * acceptor. The acceptors of all shards share the port with SO_REUSEPORT.
+     *
+     * @param index The index of the shard in its group.
+     * @param shards The number of shards in the group.
+     * @param config The server settings.
+     * @param log The message log shared by the shards, or nullptr.
+     * @param presence The presence index shared by the shards.
+     * @param users The user index shared by the shards.
+     */
+    Shard(std::size_t index, std::size_t shards,
+          const std::shared_ptr<const Config> &config,
+          const std::shared_ptr<MessageLog> &log,
+          const std::shared_ptr<Presence> &presence,
+          const std::shared_ptr<UserIndex> &users);
+
+    /**
+     * @brief Set the other shards of the group.
+     * @details It must be called before the shard runs.
+     *
+     * @param shards All the shards of the group, this one included.
+     */
+    void connect(const std::vector<std::unique_ptr<Shard>> &shards);
+    /**
+     * @brief Run the io_context of the shard.
+     * @details Block until the shard is stopped.
+     */
+    void run();
+    /**
+     * @brief Stop the shard. This method is thread-safe.
+     */
+    void stop();
+    /**
+     * @brief Get the io_context of the shard.
+     *
+     * @return asio::io_context& The io_context.
+     */
+    asio::io_context &context() {
+        return ioc_;
+    }
+    /**
+     * @brief Get the state of the shard.
+     * @details Only used on the thread of the shard.
+     *
+     * @return State& The state.
+     */
+    State &state() {
+        return *state_;
+    }
+
+  private:
+    /**
+     * @brief The capacity of every ring between two shards.
+     */
+    static constexpr std::size_t ring_capacity = 4096;
+
+    /**
+     * @brief Frames coming from one other shard.
+     */
+    struct Inbox {
+        explicit Inbox(std::size_t capacity) : ring(capacity) {}
+
+        /**
+         * @brief The ring, written by the other shard and read by this one.
+         */
+        SpscRing<std::shared_ptr<const Frame>> ring;
+        /**
+         * @brief Whether a drain of the ring is already posted.
+         */
+        std::atomic<bool> scheduled{false};
+        /**
+         * @brief Whether frames are parked in the overflow.
+         * @details Only set by the producer, and only cleared by the consumer
+         * once it has taken the overflow. While it is set, the producer parks
+         * every frame, so the ring only holds frames older than the overflow.
+         */
+        std::atomic<bool> parked{false};
+        /**
+         * @brief The mutex of the overflow.
+         */
+        std::mutex overflow_mutex;
+        /**
+         * @brief The frames that did not fit in the ring, oldest first.
+         */
+        std::deque<std::shared_ptr<const Frame>> overflow;
+    };
+
+    /**
+     * @brief Relay a broadcast frame to the other shards.
+     * @details It runs on the thread of this shard, which is the only
+     * producer of its rings. A frame that does not fit in a ring is parked in
+     * the overflow of the peer, behind the ring, so that no frame is dropped
+     * or reordered.
+     *
+     * @param frame The frame to be relayed.
+     */
+    void relay(PassFrame frame);
+    /**
+     * @brief Deliver the frames queued by another shard.
+     * @details It runs on the thread of this shard, which is the only
+     * consumer of its inboxes. The ring is emptied before the overflow.
+     *
+     * @param from The index of the producer shard.
+     */
+    void drain(std::size_t from);
+
+    /**
+     * @brief The index of the shard in its group.
+     */
+    std::size_t index_;
+    /**
+     * @brief The io_context of the shard, run by a single thread.
+     */
+    asio::io_context ioc_;
+    /**
+     * @brief The state of the shard, holding only its own sessions.
+     */
+    std::shared_ptr<State> state_;
+    /**
+     * @brief The inboxes of the shard, indexed by producer shard.
+     * @details The inbox of the shard itself is never used.
+     */
+    std::vector<std::unique_ptr<Inbox>> inboxes_;
+    /**
+     * @brief The other shards of the group.
+     */
+    std::vector<Shard *> peers_;
+};
+
+/**
+ * @brief ShardGroup class, run one shard per thread.
+ * @details Each shard thread is pinned to a core when the platform allows it.
+ * @see Shard
+ */
+class ShardGroup {
+  public:
+    /**
+     * @brief Construct a new ShardGroup object.
+     * @details Build one shard per configured thread, and connect them. The
+     * shards share one presence index and one user index.
+     *
+     * @param config The server settings.
+     * @param log The message log shared by the shards, or nullptr.
+     */
+    ShardGroup(const std::shared_ptr<const Config> &config,
+               const std::shared_ptr<MessageLog> &log);
+
+    /**
+     * @brief Run the shards.
+     * @details Block until SIGINT or SIGTERM is received.
+     */
+    void run();
+
+  private:
+    /**
+     * @brief The shards of the group.
+     */
+    std::vector<std::unique_ptr<Shard>> shards_;
+};
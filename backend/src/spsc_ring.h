@@ -0,0 +1,98 @@
+/**
+ * @file spsc_ring.h
+ * @brief SpscRing class template. A bounded, lock-free, single producer and
+ * single consumer queue.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-14
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief SpscRing class, a bounded lock-free queue.
+ * @details A ring buffer with one producer thread and one consumer thread.
+ * The producer only writes the tail, and the consumer only writes the head,
+ * so neither side ever waits for the other. The indexes live on separate
+ * cache lines to avoid false sharing.
+ *
+ * @tparam T The element type. It must be default constructible and movable.
+ */
+template <typename T> class SpscRing {
+  public:
+    /**
+     * @brief Construct a new SpscRing object.
+     *
+     * @param capacity The capacity, rounded up to a power of two.
+     */
+    explicit SpscRing(std::size_t capacity) : slots_(round_up(capacity)) {}
+
+    SpscRing(const SpscRing &) = delete;
+    SpscRing &operator=(const SpscRing &) = delete;
+
+    /**
+     * @brief Push an element. Only the producer thread may call it.
+     *
+     * @param value The element to be pushed.
+     * @return true The element was pushed.
+     * @return false The ring is full, and the element is left untouched.
+     */
+    bool try_push(T &&value) {
+        auto const tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == slots_.size()) {
+            return false;
+        }
+        slots_[tail & (slots_.size() - 1)] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Pop an element. Only the consumer thread may call it.
+     *
+     * @param value Receive the popped element.
+     * @return true An element was popped.
+     * @return false The ring is empty.
+     */
+    bool try_pop(T &value) {
+        auto const head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        auto &slot = slots_[head & (slots_.size() - 1)];
+        value = std::move(slot);
+        slot = T();
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+  private:
+    static std::size_t round_up(std::size_t capacity) {
+        std::size_t size = 1;
+        while (size < capacity) {
+            size <<= 1U;
+        }
+        return size;
+    }
+
+    /**
+     * @brief The slots of the ring.
+     */
+    std::vector<T> slots_;
+    /**
+     * @brief The index of the next element to pop, written by the consumer.
+     */
+    alignas(64) std::atomic<std::size_t> head_{0};
+    /**
+     * @brief The index of the next slot to push, written by the producer.
+     */
+    alignas(64) std::atomic<std::size_t> tail_{0};
+};
@@ -10,21 +10,223 @@
  */
 
 #include "state.h"
+#include "frame.h"
+#include "message_log.h"
+#include "metrics.h"
 #include "session.h"
+#include "timer_wheel.h"
+
+#include <algorithm>
+#include <chrono>
 
 void State::send_to_all(PassMsg msg) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    for (const auto &session : sessions_) {
-        session.session->send(msg);
+    send_to_all(Frame::from_message(*msg));
+}
+
+void State::send(PassFrame frame) {
+    auto const start = frame->received() != 0 ? trace_clock() : 0;
+    log(frame);
+    deliver(frame);
+    if (relay_) {
+        relay_(frame);
+    }
+    if (start != 0) {
+        metrics().record(Stage::send_to_all, trace_clock() - start);
+    }
+}
+
+bool State::send_to_user(std::string_view username, PassFrame frame) {
+    auto const session = users_->find(username);
+    if (!session) {
+        bump(metrics().direct_misses);
+        return false;
+    }
+    session->send(frame);
+    bump(metrics().direct_messages);
+    return true;
+}
+
+void State::log(PassFrame frame) {
+    // Presence updates are not chat messages, see deliver()
+    if (log_ && frame->key().empty()) {
+        log_->append(frame);
+    }
+}
+
+void State::deliver(PassFrame frame) {
+    // Presence updates carry a coalescing key, they are not worth replaying
+    bool const chat = frame->key().empty();
+    std::uint64_t seq = 0;
+    std::shared_ptr<const Sessions> sessions;
+    if (frame->room().empty()) {
+        if (chat) {
+            seq = history_.push(frame);
+        }
+        sessions = std::atomic_load(&sessions_);
+    } else {
+        auto const rooms = std::atomic_load(&rooms_);
+        auto const it = rooms->find(frame->room());
+        if (it == rooms->end()) {
+            return;
+        }
+        auto &room = *it->second;
+        if (chat) {
+            seq = room.history.push(frame);
+        }
+        sessions = std::atomic_load(&room.sessions);
+    }
+
+    auto const start = std::chrono::steady_clock::now();
+    if (frame->received() != 0) {
+        frame->set_fanout(trace_clock());
+    }
+    for (const auto &session : *sessions) {
+        session.session->deliver(frame, seq);
+    }
+    metrics().fanout_microseconds.observe(static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count()));
+}
+
+void State::set_relay(std::function<void(PassFrame)> relay) {
+    relay_ = std::move(relay);
+}
+
+void State::set_log(std::shared_ptr<MessageLog> log) {
+    log_ = std::move(log);
+    if (!log_ || config_->history_size == 0) {
+        return;
+    }
+
+    auto rooms = std::make_shared<Rooms>(*rooms_);
+    for (const auto &frame : log_->recent(warm_records)) {
+        if (frame->room().empty()) {
+            history_.push(frame);
+            continue;
+        }
+        auto &room = (*rooms)[frame->room()];
+        if (!room) {
+            room = std::make_shared<Room>(config_->history_size);
+            room->sessions = std::make_shared<const Sessions>();
+        }
+        room->history.push(frame);
+    }
+    std::atomic_store(&rooms_, std::shared_ptr<const Rooms>(rooms));
+}
+
+void State::set_presence(std::shared_ptr<Presence> presence) {
+    presence_ = std::move(presence);
+}
+
+void State::publish_presence_on(asio::steady_timer &timer) {
+    timer.expires_after(config_->presence_interval);
+    timer.async_wait([this, &timer](beast::error_code ec) {
+        if (ec) {
+            return;
+        }
+        if (auto const delta = presence_->digest()) {
+            send_to_all(delta);
+        }
+        publish_presence_on(timer);
+    });
+}
+
+void State::set_users(std::shared_ptr<UserIndex> users) {
+    users_ = std::move(users);
+}
+
+void State::set_timer_wheels(std::vector<std::shared_ptr<TimerWheel>> wheels) {
+    timer_wheels_ = std::move(wheels);
+}
+
+TimerWheel *State::timer_wheel() {
+    if (timer_wheels_.empty()) {
+        return nullptr;
     }
+    auto const index = wheels_picked_.fetch_add(1, std::memory_order_relaxed);
+    return timer_wheels_[index % timer_wheels_.size()].get();
 }
 
-void State::join(SessionInfo session) {
+Backlog State::join(SessionInfo session) {
     std::lock_guard<std::mutex> lock(mutex_);
-    sessions_.insert(session);
+    auto next = std::make_shared<Sessions>(*sessions_);
+    presence_->join(session.username);
+    next->push_back(std::move(session));
+
+    // Publish first, see History::pushed
+    std::atomic_store(&sessions_, std::shared_ptr<const Sessions>(next));
+    return history_.frames(history_.pushed());
 }
 
 void State::leave(SessionInfo session) {
     std::lock_guard<std::mutex> lock(mutex_);
-    sessions_.erase(session);
+    auto next = std::make_shared<Sessions>(*sessions_);
+    auto const it = std::find(next->begin(), next->end(), session);
+    if (it == next->end()) {
+        return;
+    }
+    presence_->leave(session.username);
+    users_->release(*session.username, session.session.get());
+    *it = std::move(next->back());
+    next->pop_back();
+    std::atomic_store(&sessions_, std::shared_ptr<const Sessions>(next));
+}
+
+Backlog State::join_room(const std::string &room, SessionInfo session) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = rooms_->find(room);
+    if (it == rooms_->end()) {
+        // A new room has no history
+        auto next = std::make_shared<Rooms>(*rooms_);
+        auto created = std::make_shared<Room>(config_->history_size);
+        created->sessions =
+            std::make_shared<const Sessions>(1, std::move(session));
+        next->emplace(room, std::move(created));
+        std::atomic_store(&rooms_, std::shared_ptr<const Rooms>(next));
+        return {};
+    }
+
+    auto &joined = *it->second;
+    auto next = std::make_shared<Sessions>(*joined.sessions);
+    if (std::find(next->begin(), next->end(), session) != next->end()) {
+        return {};
+    }
+    next->push_back(std::move(session));
+
+    std::atomic_store(&joined.sessions, std::shared_ptr<const Sessions>(next));
+    return joined.history.frames(joined.history.pushed());
+}
+
+void State::leave_rooms(const std::vector<std::string> &rooms,
+                        const SessionInfo &session) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::shared_ptr<Rooms> next_rooms;
+    for (const auto &room : rooms) {
+        auto const it = rooms_->find(room);
+        if (it == rooms_->end()) {
+            continue;
+        }
+
+        auto &members = it->second->sessions;
+        auto next = std::make_shared<Sessions>(*members);
+        auto const member = std::find(next->begin(), next->end(), session);
+        if (member == next->end()) {
+            continue;
+        }
+        *member = std::move(next->back());
+        next->pop_back();
+
+        if (next->empty()) {
+            if (!next_rooms) {
+                next_rooms = std::make_shared<Rooms>(*rooms_);
+            }
+            next_rooms->erase(room);
+        }
+        std::atomic_store(&members, std::shared_ptr<const Sessions>(next));
+    }
+
+    if (next_rooms) {
+        std::atomic_store(&rooms_, std::shared_ptr<const Rooms>(next_rooms));
+    }
 }
\ No newline at end of file
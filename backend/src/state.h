@@ -13,30 +13,77 @@
 
 #pragma once
 
+#include "config.h"
+#include "history.h"
+#include "presence.h"
+#include "user_index.h"
+
+#include <atomic>
+#include <boost/asio/steady_timer.hpp>
+#include <functional>
 #include <memory>
 #include <mutex>
-#include <unordered_set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 class Session;
 class Message;
+class Frame;
+class MessageLog;
+class TimerWheel;
 
 using PassMsg = const std::shared_ptr<const Message>;
+using PassFrame = const std::shared_ptr<const Frame>;
 
 struct SessionInfo {
     std::shared_ptr<Session> session;
-    std::string username;
+    Username username;
 
     bool operator==(const SessionInfo &other) const {
         return session == other.session;
     }
+};
 
-    struct HashFunction {
-        size_t operator()(const SessionInfo &self) const {
-            return std::hash<std::shared_ptr<Session>>()(self.session);
-        }
-    };
+/**
+ * @brief An immutable snapshot of the joined sessions.
+ */
+using Sessions = std::vector<SessionInfo>;
+
+/**
+ * @brief A room and its members.
+ */
+struct Room {
+    /**
+     * @brief Construct a new Room object.
+     *
+     * @param history_size The number of frames kept in the history.
+     */
+    explicit Room(std::size_t history_size) : history(history_size) {}
+
+    /**
+     * @brief The snapshot of the members of the room.
+     * @details Loaded and stored atomically, like State::sessions_.
+     */
+    std::shared_ptr<const Sessions> sessions;
+    /**
+     * @brief The recent chat messages of the room.
+     * @details Lost when the room is removed.
+     */
+    History history;
 };
 
+/**
+ * @brief The frames replayed to a session that joins.
+ */
+using Replay = std::vector<std::shared_ptr<const Frame>>;
+
+/**
+ * @brief An immutable snapshot of the rooms, indexed by name.
+ */
+using Rooms = std::unordered_map<std::string, std::shared_ptr<Room>>;
+
 /**
  * @brief State class, store the state of the server.
  * @details State class is used to store the state of the server. It maintains a
@@ -48,47 +95,296 @@ class State : std::enable_shared_from_this<State> {
     /**
      * @brief Construct a new State object.
      * @details Construct a new State object.
+     *
+     * @param config The server settings, shared by the sessions of the state.
      */
-    State() = default;
+    explicit State(std::shared_ptr<const Config> config)
+        : config_(std::move(config)),
+          sessions_(std::make_shared<const Sessions>()),
+          rooms_(std::make_shared<const Rooms>()),
+          history_(config_->history_size),
+          presence_(std::make_shared<Presence>()),
+          users_(std::make_shared<UserIndex>()) {}
+
+    /**
+     * @brief Get the server settings.
+     *
+     * @return const Config& The server settings.
+     */
+    [[nodiscard]] const Config &config() const {
+        return *config_;
+    }
 
     /**
      * @brief Send a message to all sessions.
-     * @details Send a message to all sessions. This method is thread-safe.
+     * @details Send a message to all sessions. This method is thread-safe and
+     * does not take the lock. The message is serialized once, and the
+     * resulting frame is shared by every session.
      * @see Session::send
      *
      * @param msg The message to be sent.
      */
     void send_to_all(PassMsg msg);
+    /**
+     * @brief Send a frame to all sessions.
+     * @details The frame must have no room.
+     * @see State::send
+     *
+     * @param frame The frame to be sent.
+     */
+    void send_to_all(PassFrame frame) {
+        send(frame);
+    }
+    /**
+     * @brief Send a frame to its recipients.
+     * @details Send a frame to all sessions, or to the members of its room
+     * if it has one. This method is thread-safe and does not take the lock,
+     * it walks the snapshot published by the last join or leave, and only
+     * the members of the room are visited. Every session queues a reference
+     * to the same frame. The frame is logged, and relayed to the other
+     * states.
+     * @see Session::send
+     * @see Frame::room
+     *
+     * @param frame The frame to be sent.
+     */
+    void send(PassFrame frame);
+    /**
+     * @brief Send a frame to one user.
+     * @details Send a frame to the session of a user, found in the user
+     * index. This method is thread-safe. No snapshot is walked, and the frame
+     * is neither recorded in the history nor logged nor relayed: the index
+     * also holds the users of the other shards.
+     * @see UserIndex
+     *
+     * @param username The name of the user.
+     * @param frame The frame to be sent.
+     * @return true The user is logged in.
+     * @return false The user is unknown, and the frame was dropped.
+     */
+    bool send_to_user(std::string_view username, PassFrame frame);
+    /**
+     * @brief Deliver a frame to the local sessions only.
+     * @details Deliver a frame to the sessions of this state, or to the local
+     * members of its room, without relaying it. It is used by the relay to
+     * deliver frames that came from another state. A frame without a
+     * coalescing key is a chat message, and it is recorded in the history
+     * before the snapshot is loaded. Its sequence number in the history goes
+     * with it, so a session that joined meanwhile can drop it if it was
+     * replayed. No lock is taken.
+     * @see State::set_relay
+     * @see Session::deliver
+     *
+     * @param frame The frame to be delivered.
+     */
+    void deliver(PassFrame frame);
+    /**
+     * @brief Set the relay.
+     * @details The relay is called by send() with every broadcast frame, so
+     * that it can reach the sessions of the other states. It must be set
+     * before any session joins.
+     * @see ShardGroup
+     *
+     * @param relay The relay function.
+     */
+    void set_relay(std::function<void(PassFrame)> relay);
+    /**
+     * @brief Set the message log.
+     * @details send() appends the chat messages that originate from this
+     * state to the log. The history is warmed with
+     * the most recent messages of the log, which may create rooms that have
+     * no members yet. It must be called before any session joins.
+     * @see MessageLog
+     *
+     * @param log The message log.
+     */
+    void set_log(std::shared_ptr<MessageLog> log);
+    /**
+     * @brief Set the timer wheels of the sessions.
+     * @details The sessions are striped over the wheels, so that the arms and
+     * cancels of different sessions rarely wait on the same mutex. A wheel
+     * is not tied to a thread: the sessions of a shared io_context run on
+     * any of its threads. Only a shard has one wheel, on its own thread. The
+     * state keeps them alive as long as a session can use them. It must be
+     * called before any session runs.
+     * @see TimerWheel
+     *
+     * @param wheels The timer wheels.
+     */
+    void set_timer_wheels(std::vector<std::shared_ptr<TimerWheel>> wheels);
+    /**
+     * @brief Share the presence index with other states.
+     * @details The shards share one index, so that their clients see every
+     * user. It must be called before any session joins.
+     *
+     * @param presence The presence index.
+     */
+    void set_presence(std::shared_ptr<Presence> presence);
+    /**
+     * @brief Get the presence index.
+     *
+     * @return Presence& The presence index.
+     */
+    Presence &presence() {
+        return *presence_;
+    }
+    /**
+     * @brief Send the presence delta to everyone every interval.
+     * @details When the states of several shards share the presence index,
+     * only one of them publishes, and the relay reaches the others.
+     * @see Config::presence_interval
+     *
+     * @param timer The timer, on the io_context of the state. It must outlive
+     * the waits.
+     */
+    void publish_presence_on(asio::steady_timer &timer);
+    /**
+     * @brief Share the user index with other states.
+     * @details The shards share one index, so that a user of any shard can be
+     * reached. It must be called before any session logs in.
+     *
+     * @param users The user index.
+     */
+    void set_users(std::shared_ptr<UserIndex> users);
+    /**
+     * @brief Get the user index.
+     * @details A session claims the name of its user in it before it joins.
+     * leave() releases the name.
+     *
+     * @return UserIndex& The user index.
+     */
+    UserIndex &users() {
+        return *users_;
+    }
+    /**
+     * @brief Pick the timer wheel of a new session. This method is
+     * thread-safe.
+     * @details The sessions are spread over the wheels in turn.
+     *
+     * @return TimerWheel* The timer wheel, or nullptr if none was set.
+     */
+    TimerWheel *timer_wheel();
     /**
      * @brief Add a session to the state.
-     * @details Add a session to the state. This method is thread-safe. The
-     * session will be removed from the state when it is destroyed.
+     * @details Add a session to the state. This method is thread-safe. It
+     * copies the current snapshot, adds the session and publishes the new
+     * snapshot. The state keeps the session alive until it leaves. The
+     * history is read up to the last frame pushed once the snapshot is
+     * published: a later frame loads the new snapshot and is delivered, and
+     * the session drops the earlier ones that were delivered too, by their
+     * sequence numbers. So every chat message in the window reaches the
+     * session exactly once. The user is recorded in the presence index.
      * @see Session
      *
      * @param session A pointer to the session to be added.
+     * @return Backlog The recent chat messages, oldest first.
      */
-    void join(SessionInfo session);
+    Backlog join(SessionInfo session);
     /**
      * @brief Remove a session from the state.
-     * @details Remove a session from the state. This method is thread-safe. The
-     * session will be removed from the state when it is destroyed.
+     * @details Remove a session from the state. This method is thread-safe. It
+     * copies the current snapshot, removes the session and publishes the new
+     * snapshot. Broadcasts that still hold the old snapshot may deliver to
+     * the session once more. The end of the session is recorded in the
+     * presence index, and its name is released from the user index.
      * @see Session
      *
      * @param session A pointer to the session to be removed.
      */
     void leave(SessionInfo session);
+    /**
+     * @brief Add a session to a room.
+     * @details Add a session to a room, and create the room if needed. This
+     * method is thread-safe. It publishes a new snapshot of the members of the
+     * room, and a new snapshot of the rooms when the room is created. The
+     * history of the room is read as in join().
+     *
+     * @param room The room name.
+     * @param session The session to be added.
+     * @return Backlog The recent chat messages of the room, oldest first.
+     */
+    Backlog join_room(const std::string &room, SessionInfo session);
+    /**
+     * @brief Remove a session from some rooms.
+     * @details Remove a session from the rooms. This method is thread-safe.
+     * Rooms left empty are removed.
+     *
+     * @param rooms The room names.
+     * @param session The session to be removed.
+     */
+    void leave_rooms(const std::vector<std::string> &rooms,
+                     const SessionInfo &session);
 
   private:
     /**
-     * @brief The set of sessions.
-     * @details The set of sessions. This set is thread-safe. The session will
-     * be removed from the set when it is destroyed.
+     * @brief The number of log records read to warm the history.
      */
-    std::unordered_set<SessionInfo, SessionInfo::HashFunction> sessions_;
+    static constexpr std::size_t warm_records = 4096;
+
+    /**
+     * @brief Append a chat message to the log, if any.
+     *
+     * @param frame The frame sent by a session of this state.
+     */
+    void log(PassFrame frame);
+
+    /**
+     * @brief The server settings.
+     */
+    std::shared_ptr<const Config> config_;
     /**
-     * @brief The mutex used to protect the set of sessions.
-     * @details The mutex used to protect the set of sessions. This mutex is
-     * used to ensure thread-safety.
+     * @brief The snapshot of sessions.
+     * @details The current snapshot of sessions. A snapshot is never modified
+     * once published. It is loaded and stored atomically, so readers never
+     * wait for writers.
+     */
+    std::shared_ptr<const Sessions> sessions_;
+    /**
+     * @brief The snapshot of rooms.
+     * @details The current snapshot of rooms, loaded and stored atomically.
+     * Joining or leaving an existing room only publishes a new snapshot of its
+     * members. A new snapshot of rooms is only published when a room is
+     * created or removed.
+     */
+    std::shared_ptr<const Rooms> rooms_;
+    /**
+     * @brief The mutex used to serialize writers.
+     * @details The mutex used to serialize the updates of sessions and rooms,
+     * so that no update is lost between copying a snapshot and publishing the
+     * next one. Broadcasts never take it.
      */
     std::mutex mutex_;
+    /**
+     * @brief The recent chat messages sent to everyone.
+     */
+    History history_;
+    /**
+     * @brief The relay to the other states.
+     * @details Empty unless the server runs several shards.
+     */
+    std::function<void(PassFrame)> relay_;
+    /**
+     * @brief The message log.
+     * @details Null unless a log directory is set. It may be shared by the
+     * states of several shards.
+     */
+    std::shared_ptr<MessageLog> log_;
+    /**
+     * @brief The presence index.
+     * @details Owned by the state, unless it is shared with other states.
+     */
+    std::shared_ptr<Presence> presence_;
+    /**
+     * @brief The user index.
+     * @details Owned by the state, unless it is shared with other states.
+     */
+    std::shared_ptr<UserIndex> users_;
+    /**
+     * @brief The timer wheels of the sessions.
+     */
+    std::vector<std::shared_ptr<TimerWheel>> timer_wheels_;
+    /**
+     * @brief The number of wheels picked so far.
+     */
+    std::atomic<std::size_t> wheels_picked_{0};
 };
\ No newline at end of file
@@ -0,0 +1,113 @@
+/**
+ * @file timer_wheel.cpp
+ * @brief TimerWheel class implementation.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-21
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#include "timer_wheel.h"
+#include "metrics.h"
+
+#include <algorithm>
+
+TimerWheel::TimerWheel(asio::io_context &ioc, std::chrono::milliseconds tick)
+    : ticker_(ioc), tick_(std::max(tick, std::chrono::milliseconds(1))),
+      next_tick_(std::chrono::steady_clock::now() + tick_),
+      slots_(std::make_unique<Link[]>(slot_count)) {
+    for (std::size_t i = 0; i < slot_count; ++i) {
+        slots_[i].prev = &slots_[i];
+        slots_[i].next = &slots_[i];
+    }
+}
+
+std::shared_ptr<TimerWheel> TimerWheel::start(asio::io_context &ioc,
+                                              std::chrono::milliseconds tick) {
+    auto wheel = std::make_shared<TimerWheel>(ioc, tick);
+    wheel->schedule();
+    return wheel;
+}
+
+void TimerWheel::arm(Timer &timer, std::chrono::steady_clock::duration after) {
+    std::lock_guard<std::mutex> const lock(mutex_);
+    unlink(timer);
+    ++timer.generation_;
+
+    // The slot after the cursor expires at next_tick_, and every slot after
+    // it one tick later. Round up, so that the timer never fires early.
+    auto const wait = std::chrono::steady_clock::now() + after - next_tick_;
+    std::uint64_t ticks = 1;
+    if (wait > wait.zero()) {
+        ticks += static_cast<std::uint64_t>(
+            (wait + tick_ - std::chrono::steady_clock::duration(1)) / tick_);
+    }
+    timer.rounds_ = (ticks - 1) / slot_count;
+
+    auto &head = slots_[(cursor_ + ticks) % slot_count];
+    Link &link = timer;
+    link.prev = head.prev;
+    link.next = &head;
+    head.prev->next = &link;
+    head.prev = &link;
+}
+
+void TimerWheel::cancel(Timer &timer) {
+    std::lock_guard<std::mutex> const lock(mutex_);
+    unlink(timer);
+    ++timer.generation_;
+}
+
+void TimerWheel::unlink(Timer &timer) {
+    Link &link = timer;
+    if (link.next == nullptr) {
+        return;
+    }
+    link.prev->next = link.next;
+    link.next->prev = link.prev;
+    link.prev = nullptr;
+    link.next = nullptr;
+}
+
+void TimerWheel::schedule() {
+    ticker_.expires_at(next_tick_);
+    ticker_.async_wait(
+        beast::bind_front_handler(&TimerWheel::on_tick, shared_from_this()));
+}
+
+void TimerWheel::on_tick(beast::error_code ec) {
+    if (ec) {
+        return;
+    }
+
+    std::uint64_t fired = 0;
+    {
+        std::lock_guard<std::mutex> const lock(mutex_);
+        // Catch up with every slot passed, if the tick ran late
+        auto const now = std::chrono::steady_clock::now();
+        while (next_tick_ <= now) {
+            cursor_ = (cursor_ + 1) % slot_count;
+            next_tick_ += tick_;
+
+            auto &head = slots_[cursor_];
+            for (auto *link = head.next; link != &head;) {
+                auto &timer = static_cast<Timer &>(*link);
+                link = link->next;
+                if (timer.rounds_ > 0) {
+                    --timer.rounds_;
+                    continue;
+                }
+                unlink(timer);
+                timer.expire(timer.generation_);
+                ++fired;
+            }
+        }
+    }
+    if (fired != 0) {
+        bump(metrics().timers_fired, fired);
+    }
+
+    schedule();
+}
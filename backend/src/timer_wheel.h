@@ -0,0 +1,189 @@
+/**
+ * @file timer_wheel.h
+ * @brief TimerWheel class definition. A hashed timing wheel shared by a
+ * stripe of the sessions.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-21
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#pragma once
+
+#include "base.h"
+
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+/**
+ * @brief TimerWheel class, arm and cancel timers in constant time.
+ * @details The wheel has slot_count slots of one tick each, and a single
+ * steady_timer that advances it one slot per tick. A timer is linked into the
+ * slot of its deadline, with the number of full turns it must still wait, so
+ * arming and cancelling only link and unlink it. A tick only visits the timers
+ * of one slot. A timer never fires early, and fires at most one tick late.
+ *
+ * The timers are intrusive: they are owned by their users, and the wheel
+ * never allocates once constructed. The wheel is guarded by a mutex, only
+ * held for the link and unlink of a timer, and while a tick expires its slot.
+ * @see Session
+ */
+class TimerWheel : public std::enable_shared_from_this<TimerWheel> {
+  public:
+    /**
+     * @brief The number of slots.
+     * @details With the default tick of 100 ms, a turn is about 7 minutes, so
+     * the timers of the sessions expire in their first turn.
+     */
+    static constexpr std::size_t slot_count = 4096;
+
+    /**
+     * @brief A link of the list of a slot.
+     */
+    struct Link {
+        Link *prev = nullptr;
+        Link *next = nullptr;
+    };
+
+    /**
+     * @brief Timer class, a timer that can be linked into a wheel.
+     * @details Every arm and every cancel starts a new generation, so the
+     * owner can tell that an expiry it receives late is stale.
+     */
+    class Timer : private Link {
+      public:
+        Timer() = default;
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+
+        /**
+         * @brief Get the generation of the timer.
+         * @details Only read on the thread, or strand, that arms the timer.
+         *
+         * @return std::uint64_t The generation of the last arm or cancel.
+         */
+        [[nodiscard]] std::uint64_t generation() const {
+            return generation_;
+        }
+
+      protected:
+        ~Timer() = default;
+
+      private:
+        friend class TimerWheel;
+
+        /**
+         * @brief Handle the expiry of the timer.
+         * @details Called by the tick, with the wheel locked and the timer
+         * already unlinked. It must only post work, and must neither arm nor
+         * cancel a timer of the same wheel.
+         *
+         * @param generation The generation of the timer when it expired.
+         */
+        virtual void expire(std::uint64_t generation) = 0;
+
+        /**
+         * @brief The turns of the wheel left before the timer expires.
+         */
+        std::uint64_t rounds_ = 0;
+        /**
+         * @brief The generation of the timer.
+         */
+        std::uint64_t generation_ = 0;
+    };
+
+    /**
+     * @brief Construct a new TimerWheel object.
+     * @details The wheel does not tick until it is started.
+     * @see TimerWheel::start
+     *
+     * @param ioc The io_context that runs the ticks.
+     * @param tick The duration of a slot.
+     */
+    TimerWheel(asio::io_context &ioc, std::chrono::milliseconds tick);
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    /**
+     * @brief Create a wheel and start ticking.
+     * @details The pending tick keeps the wheel alive until the io_context
+     * is stopped.
+     *
+     * @param ioc The io_context that runs the ticks.
+     * @param tick The duration of a slot.
+     * @return std::shared_ptr<TimerWheel> The wheel.
+     */
+    static std::shared_ptr<TimerWheel> start(asio::io_context &ioc,
+                                             std::chrono::milliseconds tick);
+
+    /**
+     * @brief Arm a timer, or re-arm it if it is armed. This method is
+     * thread-safe.
+     *
+     * @param timer The timer. It must stay alive until it expires or is
+     * cancelled.
+     * @param after The time until the timer expires.
+     */
+    void arm(Timer &timer, std::chrono::steady_clock::duration after);
+    /**
+     * @brief Cancel a timer. This method is thread-safe.
+     * @details Once it returns, the timer does not expire, and an expiry
+     * already posted is stale. It does nothing but start a new generation if
+     * the timer is not armed.
+     *
+     * @param timer The timer.
+     */
+    void cancel(Timer &timer);
+
+  private:
+    /**
+     * @brief Wait for the next tick.
+     */
+    void schedule();
+    /**
+     * @brief Advance the wheel to the current time.
+     * @details Expire the timers of every slot passed, then wait for the next
+     * tick.
+     *
+     * @param ec Error code.
+     */
+    void on_tick(beast::error_code ec);
+    /**
+     * @brief Unlink a timer from its slot, if it is linked.
+     * @details The mutex must be held.
+     *
+     * @param timer The timer.
+     */
+    static void unlink(Timer &timer);
+
+    /**
+     * @brief The mutex of the slots and the cursor.
+     */
+    std::mutex mutex_;
+    /**
+     * @brief The timer that ticks.
+     */
+    asio::steady_timer ticker_;
+    /**
+     * @brief The duration of a slot.
+     */
+    std::chrono::steady_clock::duration tick_;
+    /**
+     * @brief The time of the next tick.
+     */
+    std::chrono::steady_clock::time_point next_tick_;
+    /**
+     * @brief The slot of the last tick.
+     */
+    std::size_t cursor_ = 0;
+    /**
+     * @brief The slots, each the head of a circular list of timers.
+     */
+    std::unique_ptr<Link[]> slots_;
+};
@@ -0,0 +1,56 @@
+/**
+ * @file user_index.cpp
+ * @brief UserIndex class implementation.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-24
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#include "user_index.h"
+#include "session.h"
+
+Username UserIndex::claim(std::string_view username,
+                         const std::shared_ptr<Session> &session) {
+    auto &part = stripe(username);
+    std::lock_guard<std::mutex> const lock(part.mutex);
+    auto const it = part.owners.find(username);
+    if (it == part.owners.end()) {
+        auto name = std::make_shared<const std::string>(username);
+        part.owners.emplace(*name, Owner{name, session});
+        return name;
+    }
+    // A session that is gone no longer owns its name, even if it did not
+    // leave
+    if (!it->second.session.expired()) {
+        return nullptr;
+    }
+    it->second.session = session;
+    return it->second.name;
+}
+
+void UserIndex::release(std::string_view username, const Session *session) {
+    auto &part = stripe(username);
+    std::lock_guard<std::mutex> const lock(part.mutex);
+    auto const it = part.owners.find(username);
+    if (it == part.owners.end()) {
+        return;
+    }
+    auto const owner = it->second.session.lock();
+    if (owner && owner.get() != session) {
+        return;
+    }
+    part.owners.erase(it);
+}
+
+std::shared_ptr<Session> UserIndex::find(std::string_view username) {
+    auto &part = stripe(username);
+    std::lock_guard<std::mutex> const lock(part.mutex);
+    auto const it = part.owners.find(username);
+    if (it == part.owners.end()) {
+        return nullptr;
+    }
+    return it->second.session.lock();
+}
@@ -0,0 +1,136 @@
+/**
+ * @file user_index.h
+ * @brief UserIndex class definition. The sessions of the logged in users,
+ * indexed by name, to route direct messages.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-24
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+class Session;
+
+/**
+ * @brief An interned user name.
+ * @details The index makes one copy of a name when it is claimed. The
+ * session, the snapshots of the state and of the rooms and the presence index
+ * all share that copy, so publishing a snapshot copies references, not names.
+ */
+using Username = std::shared_ptr<const std::string>;
+
+/**
+ * @brief UserIndex class, the session of every logged in user.
+ * @details A name belongs to at most one session, from its login until it
+ * leaves. The index is split into stripes by a hash of the name, each with
+ * its own mutex and table, so that logins and lookups on different names
+ * rarely wait for each other. The tables are keyed by views of the interned
+ * names, and a lookup hashes the name it is given without copying it.
+ *
+ * The sessions are not kept alive by the index: the state does that until
+ * they leave. The index may be shared by the states of several shards, since
+ * sending to a session is thread-safe.
+ * @see State::send_to_user
+ */
+class UserIndex {
+  public:
+    /**
+     * @brief The number of stripes.
+     */
+    static constexpr std::size_t stripes = 64;
+
+    /**
+     * @brief Give a name to a session. This method is thread-safe.
+     * @details The name is interned, or its interned copy is reused when the
+     * session that held it is gone without leaving.
+     *
+     * @param username The name of the user.
+     * @param session The session that logs in.
+     * @return Username The interned name, now the session's, or nullptr if
+     * the name belongs to another session.
+     */
+    Username claim(std::string_view username,
+                   const std::shared_ptr<Session> &session);
+    /**
+     * @brief Take a name back from a session. This method is thread-safe.
+     * @details Nothing happens if the name belongs to another session. The
+     * interned copy lives on as long as it is referenced.
+     *
+     * @param username The name of the user.
+     * @param session The session that leaves.
+     */
+    void release(std::string_view username, const Session *session);
+    /**
+     * @brief Find the session of a user. This method is thread-safe.
+     *
+     * @param username The name of the user.
+     * @return std::shared_ptr<Session> The session, or nullptr if the user is
+     * not logged in.
+     */
+    std::shared_ptr<Session> find(std::string_view username);
+
+  private:
+    /**
+     * @brief Hash names, the same way for the tables and for the stripes.
+     */
+    struct Hash {
+        std::size_t operator()(std::string_view name) const {
+            return std::hash<std::string_view>()(name);
+        }
+    };
+
+    /**
+     * @brief The owner of a name.
+     */
+    struct Owner {
+        /**
+         * @brief The interned name, which the key of the entry views.
+         */
+        Username name;
+        /**
+         * @brief The session.
+         */
+        std::weak_ptr<Session> session;
+    };
+
+    /**
+     * @brief A part of the index.
+     */
+    struct Stripe {
+        /**
+         * @brief The mutex of the stripe.
+         */
+        std::mutex mutex;
+        /**
+         * @brief The owners, by name.
+         */
+        std::unordered_map<std::string_view, Owner, Hash> owners;
+    };
+
+    /**
+     * @brief Get the stripe of a name.
+     *
+     * @param username The name of the user.
+     * @return Stripe& The stripe.
+     */
+    Stripe &stripe(std::string_view username) {
+        return stripes_[Hash()(username) % stripes];
+    }
+
+    /**
+     * @brief The stripes.
+     */
+    std::array<Stripe, stripes> stripes_;
+};
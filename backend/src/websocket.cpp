@@ -18,39 +18,70 @@
 #include <boost/beast/websocket.hpp>
 #include <memory>
 
-void WebSocket::run() {
-    // Set suggested timeout settings for the websocket
-    this->set_option(
-        websocket::stream_base::timeout::suggested(beast::role_type::server));
-
-    // Set a decorator to change the Server of the handshake
-    this->set_option(
-        websocket::stream_base::decorator([](websocket::response_type &res) {
+namespace {
+
+/**
+ * @brief The subprotocol of JSON text frames.
+ */
+constexpr const char *json_protocol = "message.json";
+/**
+ * @brief The subprotocol of CBOR binary frames.
+ */
+constexpr const char *cbor_protocol = "message.cbor";
+
+} // namespace
+
+void WebSocket::run(const Config &config) {
+    // The session drives the handshake deadline and the keep-alive pings
+    // from its timer wheel, so Beast arms no timer of its own
+    websocket::stream_base::timeout timeout{};
+    timeout.handshake_timeout = websocket::stream_base::none();
+    timeout.idle_timeout = websocket::stream_base::none();
+    timeout.keep_alive_pings = false;
+    this->set_option(timeout);
+
+    if (config.deflate) {
+        // Without context takeover, a compressed frame can go to any session
+        websocket::permessage_deflate pmd;
+        pmd.server_enable = true;
+        pmd.server_no_context_takeover = true;
+        this->set_option(pmd);
+    }
+
+    // Set a decorator to change the Server of the handshake. Beast has already
+    // negotiated the extensions when the decorator runs.
+    this->set_option(websocket::stream_base::decorator(
+        [this, enabled = config.deflate](websocket::response_type &res) {
             res.set(http::field::server,
                     std::string(BOOST_BEAST_VERSION_STRING) +
                         " message-server-async");
+            if (!protocol_.empty()) {
+                res.set(http::field::sec_websocket_protocol, protocol_);
+            }
+
+            auto const extensions = res[http::field::sec_websocket_extensions];
+            // Shared frames are compressed with the full window, so a client
+            // that asked for a smaller one gets them uncompressed
+            deflate_ = enabled &&
+                       extensions.find("permessage-deflate") !=
+                           beast::string_view::npos &&
+                       extensions.find("server_max_window_bits") ==
+                           beast::string_view::npos;
         }));
 
+    // Reject oversized messages before they are buffered
+    this->read_message_max(Message::max_size);
+
     this->text(true);
 }
 
-std::string WebSocket::login() {
-    for (;;) {
-        beast::flat_buffer buffer;
-        this->read(buffer);
-        Message message(beast::buffers_to_string(buffer.data()));
-        if (message.is_login_info()) {
-            return message.get_username();
-        }
+void WebSocket::negotiate(const http::request<http::string_body> &request) {
+    http::token_list protocols(request[http::field::sec_websocket_protocol]);
+    if (protocols.exists(cbor_protocol)) {
+        encoding_ = Encoding::cbor;
+        protocol_ = cbor_protocol;
+        this->binary(true);
+    } else if (protocols.exists(json_protocol)) {
+        protocol_ = json_protocol;
     }
 }
-
-void WebSocket::login_success() {
-    boost::beast::error_code ec;
-    this->write(
-        asio::buffer(std::string(R"({"type": "login", "success": true})")), ec);
-
-    if (ec) {
-        fail(ec, "write");
-    }
-}
\ No newline at end of file
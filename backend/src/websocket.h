@@ -12,18 +12,25 @@
 #pragma once
 
 #include "base.h"
+#include "config.h"
+#include "frame.h"
+#include "gated_stream.h"
 
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
 #include <boost/beast/websocket.hpp>
+#include <string>
 
 /**
  * @brief WebSocket class
- * @details This class is a wrapper of boost::beast::websocket::stream
+ * @details This class is a wrapper of boost::beast::websocket::stream, over
+ * a TCP stream that the session may also write prebuilt frames to.
+ * @see GatedStream
  * @see
  * https://www.boost.org/doc/libs/1_75_0/libs/beast/doc/html/beast/ref/boost__beast__websocket__stream.html
  */
-class WebSocket : public websocket::stream<beast::tcp_stream> {
+class WebSocket : public websocket::stream<GatedStream> {
   public:
     /**
      * @brief Construct a new WebSocket object
@@ -31,24 +38,60 @@ class WebSocket : public websocket::stream<beast::tcp_stream> {
      * @param socket Socket object.
      */
     explicit WebSocket(tcp::socket &&socket)
-        : websocket::stream<beast::tcp_stream>(std::move(socket)) {}
+        : websocket::stream<GatedStream>(std::move(socket)) {}
     /**
      * @brief Run WebSocket
-     * @details Set suggested timeout settings for the websocket. Set a
-     * decorator to change the Server of the handshake. Set text mode.
+     * @details Turn the Beast timeouts off, the session has its own. Offer
+     * permessage-deflate if enabled. Set a decorator to change the Server of
+     * the handshake. Limit the size of a received message. Set text mode.
+     *
+     * @param config The server settings.
+     */
+    void run(const Config &config);
+    /**
+     * @brief Choose the subprotocol of the connection.
+     * @details Pick message.cbor if the client offers it, message.json
+     * otherwise. A client that offers no subprotocol speaks JSON, and gets no
+     * Sec-WebSocket-Protocol header back. A CBOR connection writes binary
+     * frames. It must be called before the handshake is accepted.
+     *
+     * @param request The upgrade request of the client.
+     */
+    void negotiate(const http::request<http::string_body> &request);
+    /**
+     * @brief Get the encoding of the frames sent to the client.
+     *
+     * @return Encoding The negotiated encoding.
      */
-    void run();
+    [[nodiscard]] Encoding encoding() const {
+        return encoding_;
+    }
     /**
-     * @brief Login
-     * @details Read message from client. If message is login info, return
-     * username. If message is not login info, read again.
+     * @brief Whether the client negotiated permessage-deflate.
+     * @details Only meaningful after the handshake. If true, the frames
+     * written by the batch writer may be compressed.
+     * @see Frame::deflated
      *
-     * @return std::string Username.
+     * @return true The client accepted a full-window, no context takeover
+     * deflate.
+     * @return false Frames must be written uncompressed.
+     */
+    [[nodiscard]] bool deflate() const {
+        return deflate_;
+    }
+
+  private:
+    /**
+     * @brief Whether the client negotiated permessage-deflate.
+     */
+    bool deflate_ = false;
+    /**
+     * @brief The encoding of the frames sent to the client.
      */
-    std::string login();
+    Encoding encoding_ = Encoding::json;
     /**
-     * @brief Login success
-     * @details Send login success message to client.
+     * @brief The subprotocol accepted in the handshake response.
+     * @details Empty if the client offered none.
      */
-    void login_success();
+    std::string protocol_;
 };
\ No newline at end of file
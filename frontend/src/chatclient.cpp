@@ -11,6 +11,9 @@
 
 #include "chatclient.h"
 
+#include <QCborMap>
+#include <QCborParserError>
+#include <QCborValue>
 #include <QHostAddress>
 #include <QJsonArray>
 #include <QJsonDocument>
@@ -18,11 +21,15 @@
 #include <QJsonParseError>
 #include <QJsonValue>
 #include <QMessageBox>
+#include <QNetworkRequest>
 
 ChatClient::ChatClient(QObject *parent)
-    : QObject(parent), client_socket_(new QWebSocket), logged_in_(false) {
+    : QObject(parent), client_socket_(new QWebSocket), logged_in_(false),
+      binary_(false), presence_version_(-1) {
     connect(client_socket_, &QWebSocket::textMessageReceived, this,
             &ChatClient::onReadyRead);
+    connect(client_socket_, &QWebSocket::binaryMessageReceived, this,
+            &ChatClient::onBinaryMessage);
     connect(client_socket_, &QWebSocket::connected, this,
             &ChatClient::connected);
     connect(client_socket_, &QWebSocket::disconnected, this,
@@ -33,16 +40,28 @@ ChatClient::ChatClient(QObject *parent)
 }
 
 void ChatClient::connectToServer(const QHostAddress &address, quint16 port) {
-    client_socket_->open(
+    QNetworkRequest request(
         QUrl("ws://" + address.toString() + ":" + QString::number(port)));
+    // Older servers ignore the header and keep speaking JSON
+    request.setRawHeader("Sec-WebSocket-Protocol",
+                         "message.cbor, message.json");
+    binary_ = false;
+    users_.clear();
+    presence_version_ = -1;
+    client_socket_->open(request);
 }
 
 void ChatClient::login(const QString &user_name) {
     QJsonObject login;
     login["type"] = "login";
     login["username"] = user_name;
-    QJsonDocument doc(login);
-    client_socket_->sendTextMessage(doc.toJson());
+    send(login);
+}
+
+void ChatClient::requestUserList() {
+    QJsonObject request;
+    request["type"] = "user_list";
+    send(request);
 }
 
 void ChatClient::sendMessage(const QString &text, const QString &user_name_) {
@@ -50,8 +69,28 @@ void ChatClient::sendMessage(const QString &text, const QString &user_name_) {
     message["type"] = "message";
     message["sender"] = user_name_;
     message["text"] = text;
-    QJsonDocument doc(message);
-    client_socket_->sendTextMessage(doc.toJson());
+    send(message);
+}
+
+void ChatClient::sendDirectMessage(const QString &text,
+                                   const QString &user_name_,
+                                   const QString &to) {
+    QJsonObject message;
+    message["type"] = "direct";
+    message["sender"] = user_name_;
+    message["to"] = to;
+    message["text"] = text;
+    send(message);
+}
+
+void ChatClient::send(const QJsonObject &message) {
+    if (binary_) {
+        client_socket_->sendBinaryMessage(
+            QCborMap::fromJsonObject(message).toCborValue().toCbor());
+        return;
+    }
+    client_socket_->sendTextMessage(
+        QJsonDocument(message).toJson(QJsonDocument::Compact));
 }
 
 void ChatClient::disconnectFromHost() {
@@ -68,17 +107,35 @@ void ChatClient::onReadyRead(const QString &message) {
     jsonReceived(doc.object());
 }
 
+void ChatClient::onBinaryMessage(const QByteArray &message) {
+    QCborParserError error;
+    QCborValue value = QCborValue::fromCbor(message, &error);
+    if (error.error != QCborError::NoError) {
+        QMessageBox::warning(nullptr, "Error", error.errorString());
+        return;
+    }
+    binary_ = true;
+    jsonReceived(value.toMap().toJsonObject());
+}
+
 void ChatClient::jsonReceived(const QJsonObject &doc) {
     if (doc["type"] == "login") {
         if (doc["success"].toBool()) {
             logged_in_ = true;
             emit loggedIn();
+            requestUserList();
         } else {
             emit loginError(doc["reason"].toString());
         }
     } else if (doc["type"] == "message") {
         emit messageReceived(doc["sender"].toString(), doc["text"].toString());
+    } else if (doc["type"] == "direct") {
+        emit directMessageReceived(doc["sender"].toString(),
+                                   doc["text"].toString());
+    } else if (doc["type"] == "presence") {
+        presenceReceived(doc);
     } else if (doc["type"] == "user_joined") {
+        // Sent by older servers instead of presence deltas
         emit userJoined(doc["username"].toString());
     } else if (doc["type"] == "user_left") {
         emit userLeft(doc["username"].toString());
@@ -90,6 +147,31 @@ void ChatClient::jsonReceived(const QJsonObject &doc) {
         for (const auto user : users) {
             user_list.append(user.toString());
         }
+        users_ = user_list;
+        presence_version_ = doc["version"].toVariant().toLongLong();
         emit userListReceived(user_list);
     }
+}
+
+void ChatClient::presenceReceived(const QJsonObject &doc) {
+    const qint64 version = doc["version"].toVariant().toLongLong();
+    if (presence_version_ < 0 || version <= presence_version_) {
+        // The list is not known yet, or already has this delta
+        return;
+    }
+    if (version != presence_version_ + 1) {
+        presence_version_ = -1;
+        requestUserList();
+        return;
+    }
+
+    presence_version_ = version;
+    for (const auto user : doc["joined"].toArray()) {
+        users_.append(user.toString());
+        emit userJoined(user.toString());
+    }
+    for (const auto user : doc["left"].toArray()) {
+        users_.removeAll(user.toString());
+        emit userLeft(user.toString());
+    }
 }
\ No newline at end of file
@@ -11,6 +11,9 @@
 
 #pragma once
 
+#include <QByteArray>
+#include <QCborMap>
+#include <QCborValue>
 #include <QHostAddress>
 #include <QJsonArray>
 #include <QJsonDocument>
@@ -75,6 +78,14 @@ class ChatClient : public QObject {
      * @param text The text of the message
      */
     void messageReceived(const QString &sender, const QString &text);
+    /**
+     * @brief Signals emitted when the client receives a direct message
+     * @details These signals are connected to slots in the ChatWindow class.
+     *
+     * @param sender The sender of the message
+     * @param text The message
+     */
+    void directMessageReceived(const QString &sender, const QString &text);
     /**
      * @brief Signals emitted when the client receives an error
      * @details These signals are connected to slots in the ChatWindow class.
@@ -140,6 +151,17 @@ class ChatClient : public QObject {
      * @param user_name_ The username
      */
     void sendMessage(const QString &text, const QString &user_name_);
+    /**
+     * @brief Sends a message to one user
+     * @details This function sends a direct message, which only the
+     * recipient receives.
+     *
+     * @param text The message
+     * @param user_name_ The username
+     * @param to The username of the recipient
+     */
+    void sendDirectMessage(const QString &text, const QString &user_name_,
+                           const QString &to);
     /**
      * @brief Disconnects from the server
      * @details This function disconnects from the server.
@@ -155,6 +177,15 @@ class ChatClient : public QObject {
      * @param message The message received
      */
     void onReadyRead(const QString &message);
+    /**
+     * @brief Called when the client receives a binary message
+     * @details The server only sends binary messages once it has chosen the
+     * CBOR subprotocol. The message is decoded, and the client switches to
+     * CBOR for the messages it sends.
+     *
+     * @param message The CBOR message received
+     */
+    void onBinaryMessage(const QByteArray &message);
 
   private:
     /**
@@ -169,6 +200,48 @@ class ChatClient : public QObject {
      * It is initialized to false in the constructor.
      */
     bool logged_in_;
+    /**
+     * @brief A boolean indicating whether the client sends CBOR
+     * @details The client offers CBOR and JSON when it connects. It sends
+     * compact JSON until the server sends a binary message, since Qt does not
+     * expose the subprotocol the server chose.
+     */
+    bool binary_;
+    /**
+     * @brief The online users
+     * @details The list fetched after the login, kept up to date with the
+     * presence deltas of the server.
+     */
+    QStringList users_;
+    /**
+     * @brief The version of users_
+     * @details -1 until the list is received.
+     */
+    qint64 presence_version_;
+
+    /**
+     * @brief Asks the server for the list of online users
+     * @details The server answers with a user_list message.
+     */
+    void requestUserList();
+    /**
+     * @brief Applies a presence delta to the list of online users
+     * @details A delta is only applied to the list of the previous version,
+     * and older deltas are ignored. If a delta was missed, the list is asked
+     * for again. The users that joined or left are signalled.
+     *
+     * @param doc The presence message
+     */
+    void presenceReceived(const QJsonObject &doc);
+
+    /**
+     * @brief Sends a message to the server
+     * @details This function encodes the message as CBOR or compact JSON,
+     * depending on the protocol of the server.
+     *
+     * @param message The message to send
+     */
+    void send(const QJsonObject &message);
 
     /**
      * @brief Parses a JSON message received from the server
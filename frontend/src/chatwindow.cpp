@@ -58,6 +58,8 @@ ChatWindow::ChatWindow(QWidget *parent)
     connect(chat_client_, &ChatClient::userLeft, this, &ChatWindow::userLeft);
     connect(chat_client_, &ChatClient::messageReceived, this,
             &ChatWindow::messageReceived);
+    connect(chat_client_, &ChatClient::directMessageReceived, this,
+            &ChatWindow::messageReceived);
     connect(chat_client_, &ChatClient::userListReceived, this,
             &ChatWindow::userListReceived);
 }
@@ -0,0 +1,234 @@
+/**
+ * @file client.cpp
+ * @brief Client class implementation.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-19
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#include "client.h"
+
+#include <algorithm>
+#include <charconv>
+#include <fmt/format.h>
+#include <string_view>
+#include <utility>
+
+namespace {
+
+/**
+ * @brief The key that precedes the send time in a chat message.
+ */
+constexpr std::string_view text_key = R"("text":")";
+
+/**
+ * @brief Get the wall clock time.
+ * @details The wall clock, so that clients on several hosts can measure each
+ * other's messages, as long as their clocks are synchronized.
+ *
+ * @return std::int64_t The time, in nanoseconds since the epoch.
+ */
+std::int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+} // namespace
+
+Client::Client(asio::io_context &ioc, const Options &options, Run &run,
+               Stats &stats, std::size_t id)
+    : options_(options), run_(run), stats_(stats), id_(id), ws_(ioc),
+      timer_(ioc) {}
+
+void Client::start() {
+    started_ = std::chrono::steady_clock::now();
+    beast::get_lowest_layer(ws_).expires_after(options_.connect_timeout);
+    beast::get_lowest_layer(ws_).async_connect(
+        tcp::endpoint(options_.address, options_.port),
+        beast::bind_front_handler(&Client::on_connect, shared_from_this()));
+}
+
+void Client::on_connect(beast::error_code ec) {
+    if (ec) {
+        return abort(ec, "connect");
+    }
+
+    // Chat messages are small, they must not wait for Nagle
+    beast::get_lowest_layer(ws_).socket().set_option(tcp::no_delay(true), ec);
+
+    // The websocket stream has its own timeouts
+    beast::get_lowest_layer(ws_).expires_never();
+    ws_.set_option(
+        websocket::stream_base::timeout::suggested(beast::role_type::client));
+    ws_.set_option(
+        websocket::stream_base::decorator([](websocket::request_type &req) {
+            req.set(http::field::user_agent, "message_loadgen");
+            req.set(http::field::sec_websocket_protocol, "message.json");
+        }));
+
+    ws_.async_handshake(
+        fmt::format("{}:{}", options_.address.to_string(), options_.port), "/",
+        beast::bind_front_handler(&Client::on_handshake, shared_from_this()));
+}
+
+void Client::on_handshake(beast::error_code ec) {
+    if (ec) {
+        return abort(ec, "handshake");
+    }
+
+    established_ = true;
+    stats_.connect.record(static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - started_)
+            .count()));
+    run_.in_flight.fetch_sub(1, std::memory_order_relaxed);
+    run_.established.fetch_add(1, std::memory_order_relaxed);
+
+    send(fmt::format(R"({{"type":"login","username":"lg{}"}})", id_));
+    if (!options_.room.empty()) {
+        send(fmt::format(R"({{"type":"join","room":"{}"}})", options_.room));
+    }
+    do_read();
+
+    if (id_ < options_.senders) {
+        // Spread the senders over the interval, so they do not send in bursts
+        auto const interval = std::chrono::duration<double>(1.0 / options_.rate);
+        next_ = std::chrono::steady_clock::now() +
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    interval * static_cast<double>(id_ % 1000) / 1000.0);
+        schedule();
+    }
+}
+
+void Client::abort(beast::error_code ec, char const *what) {
+    run_.in_flight.fetch_sub(1, std::memory_order_relaxed);
+    run_.failed.fetch_add(1, std::memory_order_relaxed);
+    if (!run_.reported.exchange(true)) {
+        fail(ec, what);
+    }
+}
+
+void Client::do_read() {
+    ws_.async_read(buffer_, beast::bind_front_handler(&Client::on_read,
+                                                      shared_from_this()));
+}
+
+void Client::on_read(beast::error_code ec, std::size_t bytes_transferred) {
+    boost::ignore_unused(bytes_transferred);
+
+    if (ec) {
+        return lost(ec, "read");
+    }
+
+    auto const data = buffer_.cdata();
+    std::string_view const frame(static_cast<const char *>(data.data()),
+                                 data.size());
+    auto const key = frame.find(text_key);
+    if (key != std::string_view::npos) {
+        auto const *const first = frame.data() + key + text_key.size();
+        std::int64_t sent = 0;
+        auto const result =
+            std::from_chars(first, frame.data() + frame.size(), sent);
+        if (result.ec == std::errc() &&
+            sent >= run_.measure_from.load(std::memory_order_relaxed) &&
+            sent < run_.measure_until.load(std::memory_order_relaxed)) {
+            auto const latency = now() - sent;
+            stats_.latency.record(
+                static_cast<std::uint64_t>(std::max<std::int64_t>(latency, 0)));
+            ++stats_.delivered;
+        }
+    }
+    buffer_.consume(buffer_.size());
+
+    do_read();
+}
+
+void Client::schedule() {
+    timer_.expires_at(next_);
+    timer_.async_wait(
+        beast::bind_front_handler(&Client::on_tick, shared_from_this()));
+}
+
+void Client::on_tick(beast::error_code ec) {
+    if (ec) {
+        return;
+    }
+
+    next_ += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(1.0 / options_.rate));
+
+    // A sender that cannot keep up skips messages, instead of queueing them
+    if (!outbox_.empty()) {
+        ++stats_.skipped;
+        return schedule();
+    }
+
+    // Senders wait for every connection, so as not to slow the others down
+    auto const sent = now();
+    if (sent < run_.measure_from.load(std::memory_order_relaxed)) {
+        return schedule();
+    }
+    if (sent < run_.measure_until.load(std::memory_order_relaxed)) {
+        ++stats_.sent;
+    }
+
+    auto text = std::to_string(sent);
+    text.push_back(' ');
+    if (text.size() < options_.size) {
+        text.append(options_.size - text.size(), 'x');
+    }
+    if (options_.room.empty()) {
+        send(fmt::format(R"({{"type":"message","sender":"lg{}","text":"{}"}})",
+                         id_, text));
+    } else {
+        send(fmt::format(
+            R"({{"type":"message","sender":"lg{}","text":"{}","room":"{}"}})",
+            id_, text, options_.room));
+    }
+    schedule();
+}
+
+void Client::send(std::string frame) {
+    outbox_.push_back(std::move(frame));
+    if (outbox_.size() == 1) {
+        do_write();
+    }
+}
+
+void Client::do_write() {
+    ws_.async_write(
+        asio::buffer(outbox_.front()),
+        beast::bind_front_handler(&Client::on_write, shared_from_this()));
+}
+
+void Client::on_write(beast::error_code ec, std::size_t bytes_transferred) {
+    boost::ignore_unused(bytes_transferred);
+
+    if (ec) {
+        return lost(ec, "write");
+    }
+
+    outbox_.pop_front();
+    if (!outbox_.empty()) {
+        do_write();
+    }
+}
+
+void Client::lost(beast::error_code ec, char const *what) {
+    if (!established_) {
+        return;
+    }
+    established_ = false;
+    timer_.cancel();
+    if (run_.stopping.load(std::memory_order_relaxed)) {
+        return;
+    }
+    run_.closed.fetch_add(1, std::memory_order_relaxed);
+    if (!run_.reported.exchange(true)) {
+        fail(ec, what);
+    }
+}
@@ -0,0 +1,241 @@
+/**
+ * @file client.h
+ * @brief Client class definition. A scripted chat client that measures the
+ * delivery latency of the messages it receives.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-19
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#pragma once
+
+#include "base.h"
+#include "histogram.h"
+#include "options.h"
+
+#include <atomic>
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <string>
+
+/**
+ * @brief The progress of a run, shared by every thread.
+ */
+struct Run {
+    /**
+     * @brief The connections being opened.
+     */
+    std::atomic<std::size_t> in_flight{0};
+    /**
+     * @brief The connections that logged in.
+     */
+    std::atomic<std::size_t> established{0};
+    /**
+     * @brief The connections that could not be opened.
+     */
+    std::atomic<std::size_t> failed{0};
+    /**
+     * @brief The established connections that were closed before the end.
+     */
+    std::atomic<std::size_t> closed{0};
+    /**
+     * @brief Whether an error was printed already.
+     * @details Only the first error is printed, so that a failing server does
+     * not flood the terminal.
+     */
+    std::atomic<bool> reported{false};
+    /**
+     * @brief Whether the run is over, and connections are expected to close.
+     */
+    std::atomic<bool> stopping{false};
+    /**
+     * @brief The measured messages are the ones sent from this time on, in
+     * nanoseconds since the epoch.
+     */
+    std::atomic<std::int64_t> measure_from{
+        std::numeric_limits<std::int64_t>::max()};
+    /**
+     * @brief The measured messages are the ones sent before this time.
+     */
+    std::atomic<std::int64_t> measure_until{
+        std::numeric_limits<std::int64_t>::max()};
+};
+
+/**
+ * @brief The measurements of the clients of one thread.
+ * @details Only touched by the thread of the clients, and read once the
+ * threads are joined.
+ */
+struct Stats {
+    /**
+     * @brief The delivery latency of the measured messages, in nanoseconds.
+     */
+    Histogram latency;
+    /**
+     * @brief The time from connecting to logging in, in nanoseconds.
+     */
+    Histogram connect;
+    /**
+     * @brief The measured messages sent.
+     */
+    std::uint64_t sent = 0;
+    /**
+     * @brief The measured messages received, summed over every recipient.
+     */
+    std::uint64_t delivered = 0;
+    /**
+     * @brief The messages not sent because the previous ones were still
+     * being written.
+     */
+    std::uint64_t skipped = 0;
+};
+
+/**
+ * @brief Client class, one connection of the load generator.
+ * @details A client connects, logs in as lg<id>, joins the room if any, then
+ * reads every frame. A sender also writes a chat message at a fixed rate.
+ * The text of a message starts with the time it was sent, so any client that
+ * receives it can compute its delivery latency. A client runs on one
+ * io_context, which runs on one thread, so it needs no strand.
+ * @see Run
+ * @see Stats
+ */
+class Client : public std::enable_shared_from_this<Client> {
+  public:
+    /**
+     * @brief Construct a new Client object.
+     *
+     * @param ioc The io_context of the client, run by a single thread.
+     * @param options The settings of the load generator.
+     * @param run The progress of the run.
+     * @param stats The measurements of the thread.
+     * @param id The number of the client.
+     */
+    Client(asio::io_context &ioc, const Options &options, Run &run,
+           Stats &stats, std::size_t id);
+
+    /**
+     * @brief Connect to the server.
+     */
+    void start();
+
+  private:
+    /**
+     * @brief Handle the connection.
+     *
+     * @param ec Error code.
+     */
+    void on_connect(beast::error_code ec);
+    /**
+     * @brief Handle the websocket handshake.
+     * @details Log in, join the room if any, and start reading and sending.
+     *
+     * @param ec Error code.
+     */
+    void on_handshake(beast::error_code ec);
+    /**
+     * @brief Give up on a connection that could not be opened.
+     *
+     * @param ec Error code.
+     * @param what The step that failed.
+     */
+    void abort(beast::error_code ec, char const *what);
+    /**
+     * @brief Read a frame.
+     */
+    void do_read();
+    /**
+     * @brief Handle a frame.
+     * @details Record the latency of a measured chat message.
+     *
+     * @param ec Error code.
+     * @param bytes_transferred The number of bytes transferred.
+     */
+    void on_read(beast::error_code ec, std::size_t bytes_transferred);
+    /**
+     * @brief Wait for the next chat message to send.
+     */
+    void schedule();
+    /**
+     * @brief Send a chat message, unless the previous ones are still queued.
+     *
+     * @param ec Error code.
+     */
+    void on_tick(beast::error_code ec);
+    /**
+     * @brief Queue a frame, and start writing if needed.
+     *
+     * @param frame The frame.
+     */
+    void send(std::string frame);
+    /**
+     * @brief Write the frame at the front of the outbox.
+     */
+    void do_write();
+    /**
+     * @brief Handle the end of a write, and write the next frame.
+     *
+     * @param ec Error code.
+     * @param bytes_transferred The number of bytes transferred.
+     */
+    void on_write(beast::error_code ec, std::size_t bytes_transferred);
+    /**
+     * @brief Report an error once the connection is established.
+     *
+     * @param ec Error code.
+     * @param what The step that failed.
+     */
+    void lost(beast::error_code ec, char const *what);
+
+    /**
+     * @brief The settings of the load generator.
+     */
+    const Options &options_;
+    /**
+     * @brief The progress of the run.
+     */
+    Run &run_;
+    /**
+     * @brief The measurements of the thread.
+     */
+    Stats &stats_;
+    /**
+     * @brief The number of the client.
+     */
+    const std::size_t id_;
+    /**
+     * @brief The websocket stream.
+     */
+    websocket::stream<beast::tcp_stream> ws_;
+    /**
+     * @brief The buffer of the frame being read.
+     */
+    beast::flat_buffer buffer_;
+    /**
+     * @brief The pacing timer of a sender.
+     */
+    asio::steady_timer timer_;
+    /**
+     * @brief The time the next chat message is due.
+     */
+    std::chrono::steady_clock::time_point next_;
+    /**
+     * @brief The time the client started to connect.
+     */
+    std::chrono::steady_clock::time_point started_;
+    /**
+     * @brief The frames to be written, the front one is being written.
+     */
+    std::deque<std::string> outbox_;
+    /**
+     * @brief Whether the connection is established.
+     */
+    bool established_ = false;
+};
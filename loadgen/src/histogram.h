@@ -0,0 +1,155 @@
+/**
+ * @file histogram.h
+ * @brief Histogram class definition. A log-linear histogram of latencies.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-19
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Histogram class, count values in log-linear buckets.
+ * @details Values under 2^sub_bits have a bucket each. Above, every power of
+ * two is split into 2^(sub_bits - 1) buckets, so a value is known within
+ * 1 / 2^(sub_bits - 1), under 1%, whatever its magnitude. Recording is an
+ * index computation and an increment. The histogram is not synchronized:
+ * every thread records into its own, and they are merged at the end.
+ */
+class Histogram {
+  public:
+    /**
+     * @brief Construct a new, empty, Histogram object.
+     */
+    Histogram() : counts_(bucket_count) {}
+
+    /**
+     * @brief Record a value.
+     *
+     * @param value The value.
+     */
+    void record(std::uint64_t value) {
+        ++counts_[index(value)];
+        ++count_;
+        max_ = std::max(max_, value);
+    }
+
+    /**
+     * @brief Add the values of another histogram.
+     *
+     * @param other The other histogram.
+     */
+    void merge(const Histogram &other) {
+        for (std::size_t i = 0; i < bucket_count; ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        count_ += other.count_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    /**
+     * @brief Get the number of values.
+     *
+     * @return std::uint64_t The number of values.
+     */
+    [[nodiscard]] std::uint64_t count() const {
+        return count_;
+    }
+
+    /**
+     * @brief Get the largest value.
+     *
+     * @return std::uint64_t The largest value, or 0 if there is none.
+     */
+    [[nodiscard]] std::uint64_t max() const {
+        return max_;
+    }
+
+    /**
+     * @brief Get a percentile.
+     *
+     * @param percentile The percentile, between 0 and 100.
+     * @return std::uint64_t The highest value of the bucket of the
+     * percentile, or 0 if there is no value.
+     */
+    [[nodiscard]] std::uint64_t percentile(double percentile) const {
+        if (count_ == 0) {
+            return 0;
+        }
+        auto const rank = std::max<std::uint64_t>(
+            1, static_cast<std::uint64_t>(
+                   std::ceil(percentile / 100.0 * static_cast<double>(count_))));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < bucket_count; ++i) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                return std::min(highest(i), max_);
+            }
+        }
+        return max_;
+    }
+
+  private:
+    /**
+     * @brief The number of bits of a value kept exactly.
+     */
+    static constexpr unsigned sub_bits = 8;
+    /**
+     * @brief The number of buckets, enough for any 64-bit value.
+     */
+    static constexpr std::size_t bucket_count =
+        ((64 - sub_bits) << (sub_bits - 1)) + (1U << sub_bits);
+
+    /**
+     * @brief Get the bucket of a value.
+     *
+     * @param value The value.
+     * @return std::size_t The index of the bucket.
+     */
+    static std::size_t index(std::uint64_t value) {
+        unsigned width = 0;
+        for (auto v = value; v != 0; v >>= 1U) {
+            ++width;
+        }
+        unsigned const shift = width > sub_bits ? width - sub_bits : 0;
+        return (static_cast<std::size_t>(shift) << (sub_bits - 1)) +
+               static_cast<std::size_t>(value >> shift);
+    }
+
+    /**
+     * @brief Get the highest value of a bucket.
+     *
+     * @param index The index of the bucket.
+     * @return std::uint64_t The highest value that falls in the bucket.
+     */
+    static std::uint64_t highest(std::size_t index) {
+        if (index < (1U << sub_bits)) {
+            return index;
+        }
+        auto const shift = (index >> (sub_bits - 1)) - 1;
+        auto const base = index - (shift << (sub_bits - 1));
+        return ((static_cast<std::uint64_t>(base) + 1) << shift) - 1;
+    }
+
+    /**
+     * @brief The number of values of every bucket.
+     */
+    std::vector<std::uint64_t> counts_;
+    /**
+     * @brief The number of values.
+     */
+    std::uint64_t count_ = 0;
+    /**
+     * @brief The largest value.
+     */
+    std::uint64_t max_ = 0;
+};
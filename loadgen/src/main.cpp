@@ -0,0 +1,180 @@
+/**
+ * @file main.cpp
+ * @brief Main entry point for the load generator. Open many connections to
+ * the server, drive chat messages through it, and report the delivery
+ * latency and throughput.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-19
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#include "client.h"
+#include "histogram.h"
+#include "options.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <memory>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
+
+namespace {
+
+/**
+ * @brief The time given to the last measured messages to be delivered.
+ */
+constexpr std::chrono::seconds drain_time{2};
+
+/**
+ * @brief Get the wall clock time, as the clients stamp messages.
+ *
+ * @return std::int64_t The time, in nanoseconds since the epoch.
+ */
+std::int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+/**
+ * @brief Raise the limit of open files to its maximum.
+ * @details Tens of thousands of connections need as many descriptors.
+ */
+void raise_file_limit() {
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/**
+ * @brief Print a latency histogram, in microseconds.
+ *
+ * @param name The name of the histogram.
+ * @param histogram The histogram, in nanoseconds.
+ */
+void print_latency(const char *name, const Histogram &histogram) {
+    auto const us = [](std::uint64_t ns) {
+        return static_cast<double>(ns) / 1000.0;
+    };
+    fmt::print("{} (us): p50 {:.1f}  p99 {:.1f}  p999 {:.1f}  max {:.1f}\n",
+               name, us(histogram.percentile(50)),
+               us(histogram.percentile(99)), us(histogram.percentile(99.9)),
+               us(histogram.max()));
+}
+
+} // namespace
+
+/**
+ * @brief Main entry point for the load generator.
+ * @details Open the connections, at most concurrency at a time, spread over
+ * one io_context per thread. Once they are all up, measure the messages sent
+ * during the run duration, then stop and report.
+ *
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments.
+ * @return int The exit code.
+ */
+int main(int argc, char **argv) {
+    auto const parsed = Options::parse(argc, argv);
+    if (!parsed) {
+        Options::print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    auto const &options = *parsed;
+    raise_file_limit();
+
+    Run run;
+    auto const threads = static_cast<std::size_t>(options.threads);
+    std::vector<std::unique_ptr<asio::io_context>> contexts;
+    std::vector<asio::executor_work_guard<asio::io_context::executor_type>>
+        guards;
+    std::vector<Stats> stats(threads);
+    std::vector<std::thread> workers;
+    for (std::size_t i = 0; i < threads; ++i) {
+        contexts.push_back(std::make_unique<asio::io_context>(1));
+        guards.push_back(asio::make_work_guard(*contexts.back()));
+    }
+    for (std::size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([&ioc = *contexts[i]] { ioc.run(); });
+    }
+
+    // Open the connections, a bounded number of handshakes at a time
+    auto const started = std::chrono::steady_clock::now();
+    auto const deadline = started + options.connect_timeout;
+    for (std::size_t id = 0; id < options.connections; ++id) {
+        while (run.in_flight.load(std::memory_order_relaxed) >=
+                   options.concurrency &&
+               std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        run.in_flight.fetch_add(1, std::memory_order_relaxed);
+        auto &ioc = *contexts[id % threads];
+        auto &thread_stats = stats[id % threads];
+        asio::post(ioc, [&ioc, &options, &run, &thread_stats, id] {
+            std::make_shared<Client>(ioc, options, run, thread_stats, id)
+                ->start();
+        });
+    }
+    while (run.established.load() + run.failed.load() < options.connections &&
+           std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    auto const ramp = std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - started)
+                          .count();
+    auto const established = run.established.load();
+    fmt::print("connections: {} established, {} failed in {:.2f} s "
+               "({:.0f} connections/s)\n",
+               established, run.failed.load(), ramp,
+               static_cast<double>(established) / ramp);
+
+    // Measure the messages sent during the run, and wait for their delivery
+    run.measure_from = now();
+    std::this_thread::sleep_for(options.duration);
+    run.measure_until = now();
+    std::this_thread::sleep_for(drain_time);
+
+    run.stopping = true;
+    guards.clear();
+    for (auto &ioc : contexts) {
+        ioc->stop();
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    Stats total;
+    for (const auto &thread_stats : stats) {
+        total.latency.merge(thread_stats.latency);
+        total.connect.merge(thread_stats.connect);
+        total.sent += thread_stats.sent;
+        total.delivered += thread_stats.delivered;
+        total.skipped += thread_stats.skipped;
+    }
+
+    auto const seconds =
+        std::chrono::duration<double>(options.duration).count();
+    print_latency("connect", total.connect);
+    fmt::print("messages: {} sent ({:.0f}/s), {} skipped, {} delivered "
+               "({:.0f}/s, fan-out {:.1f})\n",
+               total.sent, static_cast<double>(total.sent) / seconds,
+               total.skipped, total.delivered,
+               static_cast<double>(total.delivered) / seconds,
+               total.sent == 0 ? 0.0
+                               : static_cast<double>(total.delivered) /
+                                     static_cast<double>(total.sent));
+    print_latency("delivery", total.latency);
+    if (run.closed.load() != 0) {
+        fmt::print("{} connections closed by the server\n", run.closed.load());
+    }
+
+    return EXIT_SUCCESS;
+}
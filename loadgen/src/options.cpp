@@ -0,0 +1,152 @@
+/**
+ * @file options.cpp
+ * @brief Options struct implementation.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-19
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#include "options.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <string_view>
+
+namespace {
+
+/**
+ * @brief Get the value of an option of the form --name=value.
+ *
+ * @param option The command line argument.
+ * @param name The option name, with its leading dashes.
+ * @return std::optional<std::string_view> The value, or nothing if the
+ * argument is another option.
+ */
+std::optional<std::string_view> option_value(std::string_view option,
+                                             std::string_view name) {
+    if (option.size() <= name.size() || option.substr(0, name.size()) != name ||
+        option[name.size()] != '=') {
+        return std::nullopt;
+    }
+    return option.substr(name.size() + 1);
+}
+
+/**
+ * @brief Parse a positive number.
+ *
+ * @param text The text to parse.
+ * @param value Receive the number.
+ * @return true The text is a positive number.
+ * @return false The text is not a positive number.
+ */
+template <typename T> bool parse_number(std::string_view text, T &value) {
+    T number{};
+    auto const [end, ec] =
+        std::from_chars(text.data(), text.data() + text.size(), number);
+    if (ec != std::errc() || end != text.data() + text.size() || number <= 0) {
+        return false;
+    }
+    value = number;
+    return true;
+}
+
+/**
+ * @brief Parse a positive rate, which may have a fraction.
+ *
+ * @param text The text to parse.
+ * @param value Receive the rate.
+ * @return true The text is a positive rate.
+ * @return false The text is not a positive rate.
+ */
+bool parse_rate(std::string_view text, double &value) {
+    std::string const copy(text);
+    char *end = nullptr;
+    auto const number = std::strtod(copy.c_str(), &end);
+    if (copy.empty() || end != copy.c_str() + copy.size() || !(number > 0)) {
+        return false;
+    }
+    value = number;
+    return true;
+}
+
+} // namespace
+
+std::optional<Options> Options::parse(int argc, char **argv) {
+    if (argc < 4) {
+        return std::nullopt;
+    }
+
+    Options options;
+    boost::system::error_code ec;
+    options.address = asio::ip::make_address(argv[1], ec);
+    if (ec) {
+        return std::nullopt;
+    }
+    options.port = static_cast<std::uint16_t>(std::atoi(argv[2]));
+    options.threads = std::max<int>(1, std::atoi(argv[3]));
+
+    for (int i = 4; i < argc; ++i) {
+        std::string_view const option(argv[i]);
+        bool valid = true;
+        if (auto const value = option_value(option, "--connections")) {
+            valid = parse_number(*value, options.connections);
+        } else if (auto const value = option_value(option, "--senders")) {
+            valid = parse_number(*value, options.senders);
+        } else if (option == "--no-senders") {
+            options.senders = 0;
+        } else if (auto const value = option_value(option, "--rate")) {
+            valid = parse_rate(*value, options.rate);
+        } else if (auto const value = option_value(option, "--size")) {
+            valid = parse_number(*value, options.size);
+        } else if (auto const value = option_value(option, "--duration")) {
+            std::chrono::seconds::rep seconds = 0;
+            valid = parse_number(*value, seconds);
+            options.duration = std::chrono::seconds(seconds);
+        } else if (auto const value = option_value(option, "--concurrency")) {
+            valid = parse_number(*value, options.concurrency);
+        } else if (auto const value =
+                       option_value(option, "--connect-timeout")) {
+            std::chrono::seconds::rep seconds = 0;
+            valid = parse_number(*value, seconds);
+            options.connect_timeout = std::chrono::seconds(seconds);
+        } else if (auto const value = option_value(option, "--room")) {
+            options.room = std::string(*value);
+            valid = !options.room.empty();
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            return std::nullopt;
+        }
+    }
+
+    options.senders = std::min(options.senders, options.connections);
+    return options;
+}
+
+void Options::print_usage(char const *program) {
+    fmt::print(stderr, "Usage: {} <address> <port> <threads> [options]\n",
+               program);
+    fmt::print(stderr,
+               "Options:\n"
+               "  --connections=<n>      connections to open (default 1000)\n"
+               "  --senders=<n>          connections that send chat "
+               "messages (default 10)\n"
+               "  --no-senders           only receive\n"
+               "  --rate=<n>             messages per second per sender "
+               "(default 1)\n"
+               "  --size=<n>             bytes of text per message "
+               "(default 64)\n"
+               "  --duration=<s>         seconds measured once connected "
+               "(default 30)\n"
+               "  --concurrency=<n>      handshakes in progress at once "
+               "(default 256)\n"
+               "  --connect-timeout=<s>  seconds to open every connection "
+               "(default 60)\n"
+               "  --room=<name>          join a room and send to it\n");
+}
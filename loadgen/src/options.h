@@ -0,0 +1,90 @@
+/**
+ * @file options.h
+ * @brief Options struct definition. The settings of the load generator.
+ *
+ * @author salvor
+ * @version 0.1
+ * @date 2023-02-19
+ *
+ * Copyright (c) 2023 Salvor
+ */
+
+#pragma once
+
+#include "base.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+/**
+ * @brief Options struct, the settings of the load generator.
+ * @details Parsed once from the command line, then shared read-only by every
+ * client.
+ */
+struct Options {
+    /**
+     * @brief The address of the server.
+     */
+    asio::ip::address address;
+    /**
+     * @brief The port of the server.
+     */
+    std::uint16_t port = 0;
+    /**
+     * @brief The number of io threads, each with its own io_context.
+     */
+    int threads = 1;
+    /**
+     * @brief The number of connections.
+     */
+    std::size_t connections = 1000;
+    /**
+     * @brief The number of connections that send chat messages. The others
+     * only receive.
+     */
+    std::size_t senders = 10;
+    /**
+     * @brief The chat messages sent per second by every sender.
+     */
+    double rate = 1.0;
+    /**
+     * @brief The size of the text of a chat message, in bytes.
+     */
+    std::size_t size = 64;
+    /**
+     * @brief The time messages are measured, once every connection is up.
+     */
+    std::chrono::seconds duration{30};
+    /**
+     * @brief The maximum number of handshakes in progress.
+     */
+    std::size_t concurrency = 256;
+    /**
+     * @brief The time every connection has to come up.
+     */
+    std::chrono::seconds connect_timeout{60};
+    /**
+     * @brief The room every connection joins, and every message is sent to.
+     * @details Empty to send to everyone.
+     */
+    std::string room;
+
+    /**
+     * @brief Parse the command line.
+     *
+     * @param argc The number of command line arguments.
+     * @param argv The command line arguments.
+     * @return std::optional<Options> The settings, or nothing if the command
+     * line is invalid.
+     */
+    static std::optional<Options> parse(int argc, char **argv);
+    /**
+     * @brief Print the usage message to stderr.
+     *
+     * @param program The program name.
+     */
+    static void print_usage(char const *program);
+};